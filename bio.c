@@ -17,6 +17,11 @@
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+//
+// Regular file data is written back lazily (see log_writedata):
+// such buffers stay dirty in the cache until bflush() writes
+// them, from the commit, fsync() or the bflusher thread, or
+// until bget() needs the buffer.
 
 #include "types.h"
 #include "defs.h"
@@ -33,6 +38,8 @@ struct {
   // Linked list of all buffers, through prev/next.
   // head.next is most recently used.
   struct buf head;
+
+  struct sleeplock flushlock;  // one bflush() at a time
 } bcache;
 
 void
@@ -41,6 +48,7 @@ binit(void)
   struct buf *b;
 
   initlock(&bcache.lock, "bcache");
+  initsleeplock(&bcache.flushlock, "bflush");
 
 //PAGEBREAK!
   // Create linked list of buffers
@@ -50,6 +58,7 @@ binit(void)
     b->next = bcache.head.next;
     b->prev = &bcache.head;
     initsleeplock(&b->lock, "buffer");
+    initwaitq(&b->wq, "buffer");
     bcache.head.next->prev = b;
     bcache.head.next = b;
   }
@@ -63,6 +72,7 @@ bget(uint dev, uint blockno)
 {
   struct buf *b;
 
+again:
   acquire(&bcache.lock);
 
   // Is the block already cached?
@@ -76,8 +86,8 @@ bget(uint dev, uint blockno)
   }
 
   // Not cached; recycle an unused buffer.
-  // Even if refcnt==0, B_DIRTY indicates a buffer is in use
-  // because log.c has modified it but not yet committed it.
+  // Buffers that log.c has modified but not yet installed
+  // are pinned (see bpin), so their refcnt is not zero.
   for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
     if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
       b->dev = dev;
@@ -89,6 +99,20 @@ bget(uint dev, uint blockno)
       return b;
     }
   }
+
+  // No clean buffer is free; write back the least
+  // recently used dirty one and look again.
+  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
+    if(b->refcnt == 0) {
+      b->refcnt++;
+      release(&bcache.lock);
+      acquiresleep(&b->lock);
+      if(b->flags & B_DIRTY)
+        iderw(b);
+      brelse(b);
+      goto again;
+    }
+  }
   panic("bget: no buffers");
 }
 
@@ -105,6 +129,44 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Return locked bufs in b[0..n-1] with the contents of blocks
+// blockno through blockno+n-1, reading the ones not cached
+// in as few disk requests as possible. n is at most MAXCHAIN.
+// Bufs are locked in block order, so two callers cannot
+// deadlock over overlapping runs.
+void
+breadn(uint dev, uint blockno, int n, struct buf **b)
+{
+  struct buf *head[MAXCHAIN], *last, *c, *next;
+  int i, nhead;
+
+  if(n > MAXCHAIN)
+    panic("breadn");
+  nhead = 0;
+  last = 0;
+  for(i = 0; i < n; i++){
+    b[i] = bget(dev, blockno+i);
+    if(b[i]->flags & B_VALID)
+      continue;
+    // Chain consecutive uncached blocks into one request.
+    b[i]->cnext = 0;
+    if(last && last->blockno+1 == b[i]->blockno)
+      last->cnext = b[i];
+    else
+      head[nhead++] = b[i];
+    last = b[i];
+  }
+  for(i = 0; i < nhead; i++)
+    idesubmit(head[i]);
+  for(i = 0; i < nhead; i++){
+    ideawait(head[i]);
+    for(c = head[i]; c; c = next){
+      next = c->cnext;
+      c->cnext = 0;
+    }
+  }
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -115,6 +177,77 @@ bwrite(struct buf *b)
   iderw(b);
 }
 
+// Write all dirty buffers of device dev to disk, in block
+// order, with adjacent blocks chained into one request.
+void
+bflush(uint dev)
+{
+  static struct buf *list[NBUF];
+  struct buf *b, *last, *c, *next;
+  static struct buf *head[NBUF];
+  int i, j, n, nhead, len;
+
+  acquiresleep(&bcache.flushlock);
+  acquire(&bcache.lock);
+  n = 0;
+  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+    if(b->dev != dev || (b->flags & B_DIRTY) == 0)
+      continue;
+    b->refcnt++;
+    for(j = n; j > 0 && list[j-1]->blockno > b->blockno; j--)
+      list[j] = list[j-1];
+    list[j] = b;
+    n++;
+  }
+  release(&bcache.lock);
+
+  nhead = 0;
+  last = 0;
+  len = 0;
+  for(i = 0; i < n; i++){
+    b = list[i];
+    acquiresleep(&b->lock);
+    if((b->flags & B_DIRTY) == 0){
+      // written meanwhile, or now owned by the log.
+      brelse(b);
+      list[i] = 0;
+      continue;
+    }
+    b->cnext = 0;
+    if(last && last->blockno+1 == b->blockno && len < MAXCHAIN){
+      last->cnext = b;
+      len++;
+    } else {
+      head[nhead++] = b;
+      len = 1;
+    }
+    last = b;
+  }
+  for(i = 0; i < nhead; i++)
+    idesubmit(head[i]);
+  for(i = 0; i < nhead; i++){
+    ideawait(head[i]);
+    for(c = head[i]; c; c = next){
+      next = c->cnext;
+      c->cnext = 0;
+      brelse(c);
+    }
+  }
+  releasesleep(&bcache.flushlock);
+}
+
+// Kernel thread that writes back dirty file data on the
+// root device every BFLUSHTICKS ticks, so that it reaches
+// the disk even if no transaction commits.
+void
+bflusher(void)
+{
+  for(;;){
+    sleepuntil(usecs() + BFLUSHTICKS*TICKUS);
+    bflush(ROOTDEV);
+  }
+}
+
 // Release a locked buffer.
 // Move to the head of the MRU list.
 void
@@ -139,6 +272,25 @@ brelse(struct buf *b)
   
   release(&bcache.lock);
 }
+
+// Keep b in the cache even while no one holds it,
+// e.g. because the log has modified it but not yet
+// written it to its home location.
+void
+bpin(struct buf *b)
+{
+  acquire(&bcache.lock);
+  b->refcnt++;
+  release(&bcache.lock);
+}
+
+void
+bunpin(struct buf *b)
+{
+  acquire(&bcache.lock);
+  b->refcnt--;
+  release(&bcache.lock);
+}
 //PAGEBREAK!
 // Blank page.
 
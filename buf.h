@@ -3,13 +3,18 @@ struct buf {
   uint dev;
   uint blockno;
   struct sleeplock lock;
+  struct waitq wq;  // waiting for its disk request (ideawait)
   uint refcnt;
   struct buf *prev; // LRU cache list
   struct buf *next;
   struct buf *qnext; // disk queue
+  struct buf *cnext; // next block of a multi-block request
   uchar data[BSIZE];
 };
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
 #define B_RAW   0x8  // buffer is for raw disk access
 
+
+// Max bufs chained into one disk request (256 sectors).
+#define MAXCHAIN (256*512/BSIZE)
@@ -324,13 +324,18 @@ consoleintr(int (*getc)(void))
   }
 }
 
+// Reads at most a line, gathered in buf and copied out to the
+// user without cons.lock (see trap).
 int
 consoleread(struct inode *ip, char *dst, int n, int off)
 {
+  char buf[INPUT_BUF];
   uint target;
   int c;
 
   iunlock(ip);
+  if(n > INPUT_BUF)
+    n = INPUT_BUF;
   target = n;
   acquire(&cons.lock);
   while(n > 0){
@@ -351,27 +356,37 @@ consoleread(struct inode *ip, char *dst, int n, int off)
       }
       break;
     }
-    *dst++ = c;
+    buf[target - n] = c;
     --n;
     if(c == '\n')
       break;
   }
   release(&cons.lock);
+  memmove(dst, buf, target - n);
   ilock(ip);
 
   return target - n;
 }
 
+// Writes through buf, a piece at a time, so as not to touch
+// user memory holding cons.lock.
 int
-consolewrite(struct inode *ip, char *buf, int n, int off)
+consolewrite(struct inode *ip, char *src, int n, int off)
 {
-  int i;
+  char buf[INPUT_BUF];
+  int i, j, m;
 
   iunlock(ip);
-  acquire(&cons.lock);
-  for(i = 0; i < n; i++)
-    consputc(buf[i] & 0xff);
-  release(&cons.lock);
+  for(i = 0; i < n; i += m){
+    m = n - i;
+    if(m > sizeof(buf))
+      m = sizeof(buf);
+    memmove(buf, src + i, m);
+    acquire(&cons.lock);
+    for(j = 0; j < m; j++)
+      consputc(buf[j] & 0xff);
+    release(&cons.lock);
+  }
   ilock(ip);
 
   return n;
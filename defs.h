@@ -5,17 +5,26 @@ struct inode;
 struct pipe;
 struct proc;
 struct rtcdate;
+struct rwlock;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct waitq;
+struct vmspace;
+struct files;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+void            breadn(uint, uint, int, struct buf**);
 struct buf*     bget(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bpin(struct buf*);
+void            bunpin(struct buf*);
+void            bflush(uint);
+void            bflusher(void);
 
 // console.c
 void            consoleinit(void);
@@ -24,15 +33,24 @@ void            consoleintr(int(*)(void));
 void            panic(char*) __attribute__((noreturn));
 void            console_setmode(int);
 
+// e820.c
+int             memrange(int, uint*, uint*);
+
 // exec.c
 int             exec(char*, char**);
+int             execinto(struct proc*, char*, char**);
 
 // file.c
 struct file*    filealloc(void);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
+struct file*    fileget(struct files*, int);
 void            fileinit(void);
+struct files*   filesalloc(void);
+struct files*   filesdup(struct files*);
+void            filesput(struct files*);
 int             fileread(struct file*, char*, int n);
+int             filesplice(struct file*, struct file*, int);
 int             filestat(struct file*, struct stat*);
 int             filewrite(struct file*, char*, int n);
 
@@ -49,6 +67,7 @@ void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
+void            dcinval(struct inode*, char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             mount(struct inode*, int);
@@ -61,6 +80,8 @@ int             writei(struct inode*, char*, uint, uint);
 void            ideinit(void);
 void            ideintr(void);
 void            iderw(struct buf*);
+void            idesubmit(struct buf*);
+void            ideawait(struct buf*);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -70,8 +91,12 @@ void            ioapicinit(void);
 // kalloc.c
 char*           kalloc(void);
 void            kfree(char*);
+char*           kallocn(int);
+void            kfreen(char*, int);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
+void            kref(char*);
+int             krefs(char*);
 
 // kbd.c
 void            kbdintr(void);
@@ -80,17 +105,40 @@ void            kbdintr(void);
 void            cmostime(struct rtcdate *r);
 int             lapicid(void);
 extern volatile uint*    lapic;
+void            lapicarm(uint);
 void            lapiceoi(void);
 void            lapicinit(void);
+void            lapicipi(int, int);
 void            lapicstartap(uchar, uint);
+void            lapictimerstart(void);
+uint            lapictimerstop(void);
+extern uint     lapicperus;
 void            microdelay(int);
 
 // log.c
 void            initlog(int dev);
 void            log_write(struct buf*);
+void            log_writedata(struct buf*);
+void            log_bfree(uint, uint);
+int             log_busy(uint, uint);
 void            begin_op();
 void            end_op();
 
+// mmap.c
+uint            mmap(struct file*, uint, int, int, uint);
+int             munmap(uint, uint);
+int             vmfault(uint, int);
+void            vmkill(uint);
+int             vmacheck(uint, uint, int);
+int             vmacopy(struct vmspace*, struct vmspace*);
+uint            mmapbase(struct vmspace*);
+void            vmlock(struct vmspace*);
+struct vmspace* vmspacealloc(pde_t*);
+struct vmspace* vmspacedup(struct vmspace*);
+void            vmspaceinit(void);
+void            vmspaceput(struct vmspace*);
+void            vmunlock(struct vmspace*);
+
 // mp.c
 extern int      ismp;
 void            mpinit(void);
@@ -103,30 +151,58 @@ void            piceoi(void);
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
+int             pipepeek(struct pipe*, char*, int);
 int             piperead(struct pipe*, char*, int);
+void            pipeskip(struct pipe*, int);
 int             pipewrite(struct pipe*, char*, int);
 
 //PAGEBREAK: 16
 // proc.c
+int             clone(uint, uint, uint, uint);
 int             cpuid(void);
 void            exit(void);
 int             fork(void);
+int             futexwait(uint, int);
+int             futexwake(uint, int);
 int             growproc(int);
 int             kill(int);
+void            killthreads(struct vmspace*);
+void            preempt(void);
+void            initwaitq(struct waitq*, char*);
+void            kthread(char*, void(*)(void));
 struct cpu*     mycpu(void);
 struct proc*    myproc();
 void            pinit(void);
+void            pinproc(struct proc*);
 void            procdump(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
+void            schedtick(void);
+void            tsleep(void*, struct spinlock*, uint64);
+int             setpriority(int, int, int);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
+int             spawn(char*, char**, int*, int);
+void            unpinproc(struct proc*);
 void            userinit(void);
 int             wait(void);
+void            wakeproc(struct proc*);
 void            wakeup(void*);
+int             wakeupn(void*, int);
+void            wqsleep(struct waitq*, struct spinlock*, uint64);
+void            wqwakeone(struct waitq*);
+void            wqwakeup(struct waitq*);
 void            yield(void);
 int             cps(void);
 
+// rcu.c
+void            rcubegin(void);
+int             rcudone(uint);
+void            rcuend(void);
+void            rcuquiesce(void);
+uint            rcustamp(void);
+void            rcuwait(uint);
+
 // swtch.S
 void            swtch(struct context**, struct context*);
 
@@ -135,7 +211,13 @@ void            acquire(struct spinlock*);
 void            getcallerpcs(void*, uint*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
+void            initrwlock(struct rwlock*, char*);
+void            lockstatinit(void);
+void            racquire(struct rwlock*);
 void            release(struct spinlock*);
+void            rrelease(struct rwlock*);
+void            wacquire(struct rwlock*);
+void            wrelease(struct rwlock*);
 void            pushcli(void);
 void            popcli(void);
 
@@ -157,6 +239,7 @@ char*           strncpy(char*, const char*, int);
 // syscall.c
 int             argint(int, int*);
 int             argptr(int, char**, int);
+int             argwptr(int, char**, int);
 int             argstr(int, char**);
 int             fetchint(uint, int*);
 int             fetchstr(uint, char**);
@@ -172,13 +255,23 @@ void            syscall(void);
 int             checkperm(struct inode*, int);
 
 // timer.c
+uint64          div64(uint64, uint);
+int             sleepuntil(uint64);
+void            tickupdate(void);
+void            timeradd(struct proc*);
+void            timerarm(void);
+void            timerdel(struct proc*);
 void            timerinit(void);
+void            timerintr(void);
+uint64          tscus(uint64);
+uint64          usecs(void);
 
 // trap.c
 void            idtinit(void);
 extern uint     ticks;
 void            tvinit(void);
 extern struct spinlock tickslock;
+extern struct waitq tickwq;
 
 // uart.c
 void            uartinit(void);
@@ -194,13 +287,17 @@ int             allocuvm(pde_t*, uint, uint);
 int             deallocuvm(pde_t*, uint, uint);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
-int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
 pde_t*          copyuvm(pde_t*, uint);
+int             uvmshare(pde_t*, pde_t*, uint, uint, int);
+int             cowfault(pde_t*, uint);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
+void            vmflush(struct vmspace*);
 int             copyout(pde_t*, uint, void*, uint);
 void            clearpteu(pde_t *pgdir, char *uva);
 int             mapvga(pde_t *pgdir, uint va);
+pte_t*          walkpgdir(pde_t*, const void*, int);
+int             mappages(pde_t*, void*, uint, uint, int);
 
 // e1000.c
 void            e1000_init(void);
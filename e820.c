@@ -0,0 +1,61 @@
+// Physical memory map.
+// bootasm.S asks the BIOS for its E820 memory map before
+// leaving real mode and leaves it at E820MAP; kinit2() gives
+// the page allocator the usable ranges it lists.
+// http://www.uruk.org/orig-grub/mem64mb.html
+
+#include "types.h"
+#include "defs.h"
+#include "memlayout.h"
+
+#define SMAP        0x534D4150  // "SMAP": bootasm.S left a map
+#define E820_RAM    1           // usable memory
+#define MEMDEFAULT  (256*1024*1024)  // assumed without a map
+
+struct e820 {
+  uint addrlo;
+  uint addrhi;
+  uint lenlo;
+  uint lenhi;
+  uint type;
+};
+
+struct e820map {
+  uint magic;
+  ushort n;
+  ushort pad;
+  struct e820 entry[E820MAX];
+};
+
+// Set *start and *end to the ith usable range of physical
+// memory below PHYSTOP. Returns 0 if there is no such range.
+// Without a map (e.g. when a multiboot loader started the
+// kernel) assume MEMDEFAULT bytes from 0.
+int
+memrange(int i, uint *start, uint *end)
+{
+  struct e820map *m;
+  struct e820 *e;
+
+  m = (struct e820map*)P2V(E820MAP);
+  if(m->magic != SMAP){
+    if(i > 0)
+      return 0;
+    *start = 0;
+    *end = MEMDEFAULT;
+    return 1;
+  }
+  for(e = m->entry; e < &m->entry[m->n] && e < &m->entry[E820MAX]; e++){
+    if(e->type != E820_RAM || e->addrhi != 0 || e->addrlo >= PHYSTOP)
+      continue;
+    if(i-- > 0)
+      continue;
+    *start = e->addrlo;
+    if(e->lenhi != 0 || e->lenlo > PHYSTOP - e->addrlo)
+      *end = PHYSTOP;
+    else
+      *end = e->addrlo + e->lenlo;
+    return 1;
+  }
+  return 0;
+}
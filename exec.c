@@ -6,9 +6,16 @@
 #include "defs.h"
 #include "x86.h"
 #include "elf.h"
+#include "fcntl.h"
 
+// Load the program at path, with arguments argv, into
+// process p: either the current process, whose user memory
+// it replaces (exec), or a new process that has none yet
+// (spawn). On failure p is left as it was.
+// The program gets an address space of its own: the other
+// threads of the current process are killed.
 int
-exec(char *path, char **argv)
+execinto(struct proc *p, char *path, char **argv)
 {
   char *s, *last;
   int i, off;
@@ -16,8 +23,10 @@ exec(char *path, char **argv)
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
-  pde_t *pgdir, *oldpgdir;
-  struct proc *curproc = myproc();
+  struct vma seg[NVMA];
+  int nseg;
+  pde_t *pgdir;
+  struct vmspace *vm, *oldvm;
 
   begin_op();
 
@@ -47,6 +56,7 @@ exec(char *path, char **argv)
     return -1;
   }
   pgdir = 0;
+  nseg = 0;
 
   // Check ELF header
   if(readi(ip, (char*)&elf, 0, sizeof(elf)) != sizeof(elf))
@@ -57,7 +67,8 @@ exec(char *path, char **argv)
   if((pgdir = setupkvm()) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record the program's segments. Their pages are read in
+  // from ip when first touched (see mmap.c).
   sz = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
@@ -66,14 +77,24 @@ exec(char *path, char **argv)
       continue;
     if(ph.memsz < ph.filesz)
       goto bad;
-    if(ph.vaddr + ph.memsz < ph.vaddr)
-      goto bad;
-    if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
+    if(ph.vaddr + ph.memsz < ph.vaddr || ph.vaddr + ph.memsz >= KERNBASE)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    if(loaduvm(pgdir, (char*)ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.memsz == 0)
+      continue;
+    if(nseg == NVMA)
       goto bad;
+    seg[nseg].start = ph.vaddr;
+    seg[nseg].end = PGROUNDUP(ph.vaddr + ph.memsz);
+    seg[nseg].prot = PROT_READ|PROT_WRITE;
+    seg[nseg].flags = MAP_PRIVATE|VMA_IMAGE;
+    seg[nseg].ip = idup(ip);
+    seg[nseg].off = ph.off;
+    seg[nseg].filesz = ph.filesz;
+    nseg++;
+    if(ph.vaddr + ph.memsz > sz)
+      sz = ph.vaddr + ph.memsz;
   }
   iunlockput(ip);
   end_op();
@@ -106,20 +127,37 @@ exec(char *path, char **argv)
   if(copyout(pgdir, sp, ustack, (3+argc+1)*4) < 0)
     goto bad;
 
+  if((vm = vmspacealloc(pgdir)) == 0)
+    goto bad;
+
   // Save program name for debugging.
   for(last=s=path; *s; s++)
     if(*s == '/')
       last = s+1;
-  safestrcpy(curproc->name, last, sizeof(curproc->name));
+  safestrcpy(p->name, last, sizeof(p->name));
 
   // Commit to the user image.
-  oldpgdir = curproc->pgdir;
-  curproc->pgdir = pgdir;
-  curproc->sz = sz;
-  curproc->tf->eip = elf.entry;  // main
-  curproc->tf->esp = sp;
-  switchuvm(curproc);
-  freevm(oldpgdir);
+  memmove(vm->vma, seg, nseg*sizeof(seg[0]));
+  vm->sz = sz;
+  oldvm = p->vm;
+  p->vm = vm;
+  p->pgdir = pgdir;
+  p->tgid = p->pid;
+  p->tls = 0;
+  p->tf->eip = elf.entry;  // main
+  p->tf->esp = sp;
+  if(p != myproc())
+    return 0;
+  switchuvm(p);
+  // Unmap the old regions, writing shared file pages
+  // back, once no other thread uses them.
+  killthreads(oldvm);
+  vmspaceput(oldvm);
+
+  // Read in the first pages of code now rather than
+  // fault on each of them right away.
+  for(i = 0; i < NEXECPREFETCH; i++)
+    vmfault(PGROUNDDOWN(elf.entry) + i*PGSIZE, 0);
   return 0;
 
  bad:
@@ -129,5 +167,16 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  for(i = 0; i < nseg; i++){
+    begin_op();
+    iput(seg[i].ip);
+    end_op();
+  }
   return -1;
 }
+
+int
+exec(char *path, char **argv)
+{
+  return execinto(myproc(), path, argv);
+}
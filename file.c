@@ -5,6 +5,8 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
+#include "proc.h"
 #include "fs.h"
 #include "spinlock.h"
 #include "sleeplock.h"
@@ -17,10 +19,76 @@ struct {
   struct file file[NFILE];
 } ftable;
 
+// Tables of open files, one per process; threads share one.
+struct {
+  struct spinlock lock;
+  struct files files[NPROC];
+} fdtable;
+
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  initlock(&fdtable.lock, "fdtable");
+}
+
+// Allocate an empty table of open files.
+struct files*
+filesalloc(void)
+{
+  struct files *fs;
+
+  acquire(&fdtable.lock);
+  for(fs = fdtable.files; fs < fdtable.files + NPROC; fs++){
+    if(fs->ref == 0){
+      fs->ref = 1;
+      release(&fdtable.lock);
+      memset(fs->ofile, 0, sizeof(fs->ofile));
+      return fs;
+    }
+  }
+  release(&fdtable.lock);
+  return 0;
+}
+
+// Add a reference to table fs, for a new thread.
+struct files*
+filesdup(struct files *fs)
+{
+  acquire(&fdtable.lock);
+  if(fs->ref < 1)
+    panic("filesdup");
+  fs->ref++;
+  release(&fdtable.lock);
+  return fs;
+}
+
+// Drop a reference to table fs. The last one closes its files.
+void
+filesput(struct files *fs)
+{
+  int fd;
+
+  acquire(&fdtable.lock);
+  if(fs->ref < 1)
+    panic("filesput");
+  if(fs->ref > 1){
+    fs->ref--;
+    release(&fdtable.lock);
+    return;
+  }
+  release(&fdtable.lock);
+
+  for(fd = 0; fd < NOFILE; fd++){
+    if(fs->ofile[fd]){
+      fileclose(fs->ofile[fd]);
+      fs->ofile[fd] = 0;
+    }
+  }
+
+  acquire(&fdtable.lock);
+  fs->ref = 0;
+  release(&fdtable.lock);
 }
 
 // Allocate a file structure.
@@ -53,6 +121,27 @@ filedup(struct file *f)
   return f;
 }
 
+// Return the file open as fd in table fs, with a new reference,
+// or 0. Another thread sharing fs may close fd at any time; a
+// close clears the slot before dropping the table's reference,
+// so a file still in the slot under ftable.lock is live.
+struct file*
+fileget(struct files *fs, int fd)
+{
+  struct file *f;
+
+  if(fd < 0 || fd >= NOFILE)
+    return 0;
+  acquire(&ftable.lock);
+  if((f = fs->ofile[fd]) != 0){
+    if(f->ref < 1)
+      panic("fileget");
+    f->ref++;
+  }
+  release(&ftable.lock);
+  return f;
+}
+
 // Close file f.  (Decrement ref count, close when reaches 0.)
 void
 fileclose(struct file *f)
@@ -99,7 +188,7 @@ st->uid = 0;
 st->gid = 0;
 st->rdev = 0;
 
-st->blksize = 512;
+st->blksize = BSIZE;
 st->blocks = (st->size + 511) / 512;
 
 st->atime = ticks;
@@ -148,9 +237,14 @@ filewrite(struct file *f, char *addr, int n)
     // the maximum log transaction size, including
     // i-node, indirect block, allocation blocks,
     // and 2 blocks of slop for non-aligned writes.
+    // a regular file's data is not logged, only the
+    // i-node, indirect and bitmap blocks, so it can
+    // go in bigger pieces.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * 512;
+    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    if(f->ip->type == T_FILE)
+      max = MAXOPDATA * BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
@@ -164,14 +258,72 @@ filewrite(struct file *f, char *addr, int n)
       iunlock(f->ip);
       end_op();
 
-      if(r < 0)
-        break;
+      if(r > 0)
+        i += r;
+      // Short when the disk or the inode is out of room.
       if(r != n1)
-        panic("short filewrite");
-      i += r;
+        break;
     }
-    return i == n ? n : -1;
+    if(i == 0 && n > 0)
+      return -1;
+    return i;
   }
   panic("filewrite");
 }
 
+
+// Move up to n bytes from file in to file out, one of which
+// must be a pipe, through a kernel buffer rather than user
+// memory. Stops early when a read comes up short, as a pipe
+// read does once the pipe is empty, or when out takes less
+// than it is given. What out does not take is left in in: in
+// the pipe, or before in's offset. A device's input cannot be
+// given back, and is lost.
+// Returns the number of bytes moved, or -1.
+int
+filesplice(struct file *in, struct file *out, int n)
+{
+  char *buf;
+  int tot, m, r, w;
+
+  if(in->type != FD_PIPE && out->type != FD_PIPE)
+    return -1;
+  if(in->type == FD_PIPE && out->type == FD_PIPE && in->pipe == out->pipe)
+    return -1;
+  if(in->readable == 0 || out->writable == 0)
+    return -1;
+  if((buf = kalloc()) == 0)
+    return -1;
+  r = 0;
+  for(tot = 0; tot < n; tot += w){
+    m = n - tot;
+    if(m > PGSIZE)
+      m = PGSIZE;
+    if(in->type == FD_PIPE)
+      r = pipepeek(in->pipe, buf, m);
+    else
+      r = fileread(in, buf, m);
+    if(r <= 0)
+      break;
+    if((w = filewrite(out, buf, r)) < 0)
+      w = 0;
+    if(in->type == FD_PIPE)
+      pipeskip(in->pipe, w);
+    else
+      in->off -= r - w;
+    if(w < r){
+      tot += w;
+      if(w == 0)
+        r = -1;
+      break;
+    }
+    if(r < m){
+      tot += w;
+      break;
+    }
+  }
+  kfree(buf);
+  if(tot == 0 && r < 0)
+    return -1;
+  return tot;
+}
@@ -17,6 +17,9 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *hnext;  // icache hash chain
+  struct inode *prev;   // icache LRU list of unreferenced inodes
+  struct inode *next;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -28,7 +31,8 @@ struct inode {
   uint uid;
   uint gid;
   uint mode;
-  uint addrs[NDIRECT+2];
+  struct extent ext[NEXTENT+1];
+  uint index;
 };
 
 // table mapping major device number to
@@ -42,6 +46,7 @@ extern struct devsw devsw[];
 
 #define CONSOLE 1
 #define MOUSE   3
+#define LOCKSTATDEV 4
 
 struct mount {
   int active;
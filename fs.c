@@ -23,6 +23,8 @@
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 static void itrunc(struct inode*);
+static void dcinit(void);
+static void dcpurge(uint, uint);
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
@@ -31,6 +33,10 @@ struct mount mounts[NMOUNT];
 
 
 
+// mount() and umount() change mounts[] holding mount_lock.
+// Lookups take no lock: they read it in a read section, and
+// umount() does not let a slot be reused until the grace
+// period is done (see rcu.c).
 struct spinlock mount_lock;
 
 void
@@ -44,14 +50,14 @@ getsb(uint dev)
 {
   struct mount *m;
   if(dev == ROOTDEV) return &sb;
-  acquire(&mount_lock);
+  rcubegin();
   for(m = mounts; m < mounts + NMOUNT; m++){
     if(m->active && m->dev == dev){
-      release(&mount_lock);
+      rcuend();
       return &m->sb;
     }
   }
-  release(&mount_lock);
+  rcuend();
   panic("getsb: unknown device");
 } 
 
@@ -79,32 +85,321 @@ bzero(int dev, int bno)
 }
 
 // Blocks.
+//
+// Each device has an in-memory summary of its free map: the
+// number of free blocks under each bitmap block (-1 until that
+// bitmap block is first read) and a hint where the last
+// allocation ended. balloc() searches from a goal block and
+// skips bitmap blocks known to be full.
+//
+// A file being appended to keeps a window of up to NPREALLOC
+// free blocks after its last block reserved in memory, so that
+// interleaved writers do not break up each other's extents.
+// Other allocations skip reserved blocks. Reservations are not
+// on disk, and are dropped when the inode's last reference goes.
+
+#define NBMAP 32  // bitmap blocks summarized per device
+
+struct bsummary {
+  uint dev;
+  int used;
+  uint hint;         // where to search when there is no goal
+  uint ihint;        // no free inode below this inum
+  uint igen;         // inodes freed, so ialloc() sees any behind it
+  int nfree[NBMAP];  // free blocks under each bitmap block, or -1
+};
+
+struct rsv {
+  struct inode *ip;  // owner, or 0 if the slot is unused
+  uint dev;
+  uint start;        // reserved blocks are [start, end)
+  uint end;
+};
+
+struct {
+  struct spinlock lock;
+  struct bsummary sum[NMOUNT+1];
+  struct rsv rsv[NRSV];
+} fsalloc;
+
+// Return the free map summary for dev. Caller holds fsalloc.lock.
+static struct bsummary*
+getbsum(uint dev)
+{
+  struct bsummary *bs, *empty;
+  int i;
+
+  empty = 0;
+  for(bs = fsalloc.sum; bs < fsalloc.sum + NMOUNT+1; bs++){
+    if(bs->used && bs->dev == dev)
+      return bs;
+    if(empty == 0 && !bs->used)
+      empty = bs;
+  }
+  if(empty == 0)
+    panic("getbsum");
+  empty->used = 1;
+  empty->dev = dev;
+  empty->hint = 0;
+  empty->ihint = 1;
+  empty->igen = 0;
+  for(i = 0; i < NBMAP; i++)
+    empty->nfree[i] = -1;
+  return empty;
+}
+
+// Forget the free map summary of dev, which is being
+// mounted or unmounted.
+static void
+bsumreset(uint dev)
+{
+  struct bsummary *bs;
+
+  acquire(&fsalloc.lock);
+  bs = getbsum(dev);
+  bs->used = 0;
+  release(&fsalloc.lock);
+}
 
-// Allocate a zeroed disk block.
+// If block b of dev is reserved for an inode other than ip,
+// return the end of that reservation, else 0.
+// Caller holds fsalloc.lock.
 static uint
-balloc(uint dev)
+rsvblocked(uint dev, uint b, struct inode *ip)
 {
-  int b, bi, m;
-  struct buf *bp;
+  struct rsv *r;
 
-  bp = 0;
+  for(r = fsalloc.rsv; r < fsalloc.rsv + NRSV; r++)
+    if(r->ip && r->ip != ip && r->dev == dev && b >= r->start && b < r->end)
+      return r->end;
+  return 0;
+}
+
+// Drop ip's block reservation, if any.
+static void
+brsvdrop(struct inode *ip)
+{
+  struct rsv *r;
+
+  acquire(&fsalloc.lock);
+  for(r = fsalloc.rsv; r < fsalloc.rsv + NRSV; r++)
+    if(r->ip == ip)
+      r->ip = 0;
+  release(&fsalloc.lock);
+}
+
+// Count the free blocks in bitmap block bp, which holds
+// the bits for blocks [base, base+BPB) of a size-block device.
+static int
+bcount(struct buf *bp, uint base, uint size)
+{
+  int bi, n;
+
+  n = 0;
+  for(bi = 0; bi < BPB && base + bi < size; bi++)
+    if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+      n++;
+  return n;
+}
+
+// Mark block b in use in its bitmap block bp, which the caller
+// has locked, and update the summary.
+static void
+bmark(struct buf *bp, uint b)
+{
+  struct bsummary *bs;
+  int bi;
+
+  bi = b % BPB;
+  bp->data[bi/8] |= 1 << (bi % 8);
+  log_write(bp);
+  acquire(&fsalloc.lock);
+  bs = getbsum(bp->dev);
+  if(b/BPB < NBMAP && bs->nfree[b/BPB] > 0)
+    bs->nfree[b/BPB]--;
+  bs->hint = b + 1;
+  release(&fsalloc.lock);
+}
+
+// Allocate a disk block for ip (0 if none in particular),
+// at or after block goal if possible. The caller zeroes it.
+// A regular file's data is written in place rather than
+// logged (see log_writedata), so its blocks must not be ones
+// the log may still write (see log_busy).
+// Returns 0 if the disk is full.
+static uint
+balloc(uint dev, uint goal, struct inode *ip)
+{
   struct superblock *s = getsb(dev);
-  bp = 0;
-  for(b = 0; b < s->size; b += BPB){
-    bp = bread(dev, BBLOCK(b, (*s)));
-    for(bi = 0; bi < BPB && b + bi < s->size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+  struct bsummary *bs;
+  struct rsv *r;
+  struct buf *bp;
+  uint nb, i, k, b, end, e;
+  int dropped;
+
+  dropped = 0;
+again:
+  nb = (s->size + BPB - 1) / BPB;
+  acquire(&fsalloc.lock);
+  bs = getbsum(dev);
+  if(goal == 0 || goal >= s->size)
+    goal = bs->hint < s->size ? bs->hint : 0;
+  release(&fsalloc.lock);
+
+  // Search from goal to the end of the device, then wrap
+  // around to the start of goal's bitmap block.
+  for(i = 0; i <= nb; i++){
+    k = (goal/BPB + i) % nb;
+    if(k < NBMAP && bs->nfree[k] == 0)
+      continue;
+    bp = bread(dev, s->bmapstart + k);
+    if(k < NBMAP && bs->nfree[k] < 0){
+      acquire(&fsalloc.lock);
+      bs->nfree[k] = bcount(bp, k*BPB, s->size);
+      release(&fsalloc.lock);
+    }
+    b = k*BPB + (i == 0 ? goal%BPB : 0);
+    end = min((k+1)*BPB, s->size);
+    while(b < end){
+      if(bp->data[(b%BPB)/8] == 0xff && b%8 == 0){
+        b += 8;  // skip a full byte
+        continue;
+      }
+      if(bp->data[(b%BPB)/8] & (1 << (b%8))){
+        b++;
+        continue;
+      }
+      acquire(&fsalloc.lock);
+      e = rsvblocked(dev, b, ip);
+      release(&fsalloc.lock);
+      if(e){
+        b = e;  // skip another file's reservation
+        continue;
       }
+      if(ip && ip->type == T_FILE && log_busy(dev, b)){
+        b++;
+        continue;
+      }
+      bmark(bp, b);
+      brelse(bp);
+      return b;
     }
     brelse(bp);
   }
-  panic("balloc: out of blocks");
+
+  // The only free blocks may be preallocated to other files.
+  if(!dropped){
+    acquire(&fsalloc.lock);
+    for(r = fsalloc.rsv; r < fsalloc.rsv + NRSV; r++)
+      if(r->dev == dev)
+        r->ip = 0;
+    release(&fsalloc.lock);
+    dropped = 1;
+    goto again;
+  }
+  return 0;
+}
+
+// Allocate disk block b for ip if it is free and not
+// reserved for another inode. The caller zeroes it.
+// Returns b, or 0 if b is not available.
+static uint
+balloc_at(uint dev, uint b, struct inode *ip)
+{
+  int bi, m;
+  uint e;
+  struct buf *bp;
+
+  struct superblock *s = getsb(dev);
+  if(b >= s->size)
+    return 0;
+  acquire(&fsalloc.lock);
+  e = rsvblocked(dev, b, ip);
+  release(&fsalloc.lock);
+  if(e)
+    return 0;
+  if(ip && ip->type == T_FILE && log_busy(dev, b))
+    return 0;
+  bp = bread(dev, BBLOCK(b, (*s)));
+  bi = b % BPB;
+  m = 1 << (bi % 8);
+  if(bp->data[bi/8] & m){
+    brelse(bp);
+    return 0;
+  }
+  bmark(bp, b);
+  brelse(bp);
+  return b;
+}
+
+// Reserve for ip the free blocks from b on, up to NPREALLOC
+// of them, replacing any reservation it had.
+static void
+breserve(struct inode *ip, uint b)
+{
+  struct superblock *s = getsb(ip->dev);
+  struct rsv *r, *slot;
+  struct buf *bp;
+  uint end, limit;
+
+  if(b >= s->size)
+    return;
+  limit = min(b + NPREALLOC, min(s->size, (b/BPB + 1)*BPB));
+  bp = bread(ip->dev, BBLOCK(b, (*s)));
+  for(end = b; end < limit; end++)
+    if(bp->data[(end%BPB)/8] & (1 << (end%8)))
+      break;
+  brelse(bp);
+
+  acquire(&fsalloc.lock);
+  slot = 0;
+  for(r = fsalloc.rsv; r < fsalloc.rsv + NRSV; r++){
+    if(r->ip == ip)
+      r->ip = 0;
+    if(slot == 0 && r->ip == 0)
+      slot = r;
+  }
+  for(limit = b; limit < end; limit++)
+    if(rsvblocked(ip->dev, limit, ip))
+      break;
+  if(slot && limit > b){
+    slot->ip = ip;
+    slot->dev = ip->dev;
+    slot->start = b;
+    slot->end = limit;
+  }
+  release(&fsalloc.lock);
+}
+
+// Allocate a block to append to ip, whose last block is goal-1.
+// Takes goal from ip's reservation if it has one there, else
+// allocates as close after goal as possible and reserves the
+// blocks following the new one. Returns 0 if the disk is full.
+static uint
+balloc_append(struct inode *ip, uint goal)
+{
+  struct rsv *r;
+  uint b;
+  int have;
+
+  have = 0;
+  acquire(&fsalloc.lock);
+  for(r = fsalloc.rsv; r < fsalloc.rsv + NRSV; r++){
+    if(r->ip == ip && goal != 0 && r->start == goal){
+      if(++r->start == r->end)
+        r->ip = 0;
+      have = 1;
+    }
+  }
+  release(&fsalloc.lock);
+  if(have && (b = balloc_at(ip->dev, goal, ip)) != 0)
+    return b;
+
+  if(goal == 0 || (b = balloc_at(ip->dev, goal, ip)) == 0)
+    if((b = balloc(ip->dev, goal, ip)) == 0)
+      return 0;
+  breserve(ip, b+1);
+  return b;
 }
 
 // Free a disk block.
@@ -112,6 +407,7 @@ static void
 bfree(int dev, uint b)
 {
   struct buf *bp;
+  struct bsummary *bs;
   int bi, m;
 
   struct superblock *s = getsb(dev);
@@ -122,6 +418,12 @@ bfree(int dev, uint b)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+  log_bfree(dev, b);
+  acquire(&fsalloc.lock);
+  bs = getbsum(dev);
+  if(b/BPB < NBMAP && bs->nfree[b/BPB] >= 0)
+    bs->nfree[b/BPB]++;
+  release(&fsalloc.lock);
   brelse(bp);
 }
 
@@ -150,18 +452,20 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in cache: an entry in the inode cache
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a cache entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in cache: ip->ref tracks the number of
+//   in-memory pointers to the entry (open files and current
+//   directories). iget() finds or creates a cache entry and
+//   increments its ref; iput() decrements ref. Entries are
+//   hashed by (dev, inum). An entry whose ref is zero stays
+//   cached, on an LRU list, until iget() recycles it for
+//   another inode.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   cache entry is only correct when ip->valid is 1.
-//   ilock() reads the inode from
-//   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ilock() reads the inode from the disk and sets
+//   ip->valid, while iput() clears ip->valid if it frees
+//   the inode. An unreferenced entry stays valid, so
+//   iget() of a recently used inode needs no disk read.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -188,29 +492,77 @@ bfree(int dev, uint b)
 // The icache.lock spin-lock protects the allocation of icache
 // entries. Since ip->ref indicates whether an entry is free,
 // and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold icache.lock while using any of those fields.
+// holds, one must hold icache.lock while using any of those
+// fields, or the hash chain and LRU links.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 257
+#define IHASH(dev, inum) (((dev)*31 + (inum)) % NIHASH)
+
 struct {
   struct spinlock lock;
   struct inode inode[NINODE];
+  struct inode *hash[NIHASH];
+
+  // Linked list of entries with ref == 0, through prev/next.
+  // lru.next is most recently used.
+  struct inode lru;
 } icache;
 
+// Move ip, whose ref has just fallen to zero, onto the LRU
+// list: at the front, or at the back (to be recycled first)
+// if it no longer holds a valid inode.
+// Caller holds icache.lock.
+static void
+ilru(struct inode *ip, int recent)
+{
+  struct inode *at;
+
+  at = recent ? &icache.lru : icache.lru.prev;
+  ip->next = at->next;
+  ip->prev = at;
+  at->next->prev = ip;
+  at->next = ip;
+}
+
+// Remove ip from the hash chain. Caller holds icache.lock.
+static void
+iunhash(struct inode *ip)
+{
+  struct inode **pp;
+
+  for(pp = &icache.hash[IHASH(ip->dev, ip->inum)]; *pp; pp = &(*pp)->hnext){
+    if(*pp == ip){
+      *pp = ip->hnext;
+      break;
+    }
+  }
+  ip->hnext = 0;
+  ip->inum = 0;
+}
+
 void
 iinit(int dev)
 {
   int i = 0;
   
   initlock(&icache.lock, "icache");
+  initlock(&fsalloc.lock, "fsalloc");
+  dcinit();
+  icache.lru.next = &icache.lru;
+  icache.lru.prev = &icache.lru;
   for(i = 0; i < NINODE; i++) {
     initsleeplock(&icache.inode[i].lock, "inode");
+    ilru(&icache.inode[i], 1);
   }
   mountinit();
 
   readsb(dev, &sb);
+  if(sb.magic != FSMAGIC || sb.version != FSVERSION)
+    panic("iinit: unsupported fs format");
   cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
  inodestart %d bmap start %d\n", sb.size, sb.nblocks,
           sb.ninodes, sb.nlog, sb.logstart, sb.inodestart,
@@ -219,6 +571,35 @@ iinit(int dev)
 
 static struct inode* iget(uint dev, uint inum);
 
+// Note that inode inum of dev is free again, so that
+// ialloc() considers it.
+static void
+ifreed(uint dev, uint inum)
+{
+  struct bsummary *bs;
+
+  acquire(&fsalloc.lock);
+  bs = getbsum(dev);
+  if(inum < bs->ihint)
+    bs->ihint = inum;
+  bs->igen++;
+  release(&fsalloc.lock);
+}
+
+// Forget the cached unreferenced inodes of dev, which
+// is being mounted or unmounted.
+static void
+iinval(uint dev)
+{
+  struct inode *ip;
+
+  acquire(&icache.lock);
+  for(ip = icache.lru.next; ip != &icache.lru; ip = ip->next)
+    if(ip->inum && ip->dev == dev)
+      iunhash(ip);
+  release(&icache.lock);
+}
+
 //PAGEBREAK!
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
@@ -226,13 +607,28 @@ static struct inode* iget(uint dev, uint inum);
 struct inode*
 ialloc(uint dev, short type)
 {
-  int inum;
+  uint inum, start, gen;
   struct buf *bp;
   struct dinode *dip;
+  struct bsummary *bs;
 
   struct superblock *s = getsb(dev);
-  for(inum = 1; inum < s->ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, (*s)));
+again:
+  acquire(&fsalloc.lock);
+  bs = getbsum(dev);
+  start = bs->ihint;
+  gen = bs->igen;
+  release(&fsalloc.lock);
+
+  // Scan from the lowest inum that may be free,
+  // reading each inode block once.
+  bp = 0;
+  for(inum = start; inum < s->ninodes; inum++){
+    if(bp == 0 || inum%IPB == 0){
+      if(bp)
+        brelse(bp);
+      bp = bread(dev, IBLOCK(inum, (*s)));
+    }
     dip = (struct dinode*)bp->data + inum%IPB;
     if(dip->type == 0){  // a free inode
       memset(dip, 0, sizeof(*dip));
@@ -242,10 +638,24 @@ ialloc(uint dev, short type)
       dip->mode = (type == T_DIR) ? 0755 : 0644;
       log_write(bp);   // mark it allocated on the disk
       brelse(bp);
+      // Move the hint past the inodes scanned, unless one of
+      // them may have been freed behind the scan.
+      acquire(&fsalloc.lock);
+      if(bs->ihint == start && bs->igen == gen)
+        bs->ihint = inum + 1;
+      release(&fsalloc.lock);
       return iget(dev, inum);
     }
+  }
+  if(bp)
     brelse(bp);
+  // An inode freed behind the scan is still free.
+  acquire(&fsalloc.lock);
+  if(bs->igen != gen){
+    release(&fsalloc.lock);
+    goto again;
   }
+  release(&fsalloc.lock);
   panic("ialloc: no inodes");
 }
 
@@ -270,7 +680,8 @@ iupdate(struct inode *ip)
   dip->uid = ip->uid;
   dip->gid = ip->gid;
   dip->mode = ip->mode;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+  memmove(dip->ext, ip->ext, sizeof(ip->ext));
+  dip->index = ip->index;
   log_write(bp);
   brelse(bp);
 }
@@ -281,29 +692,35 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
 
   acquire(&icache.lock);
 
   // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  for(ip = icache.hash[IHASH(dev, inum)]; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0){
+        ip->next->prev = ip->prev;
+        ip->prev->next = ip->next;
+      }
       release(&icache.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
+  // Recycle the least recently used unreferenced entry.
+  ip = icache.lru.prev;
+  if(ip == &icache.lru)
     panic("iget: no inodes");
+  ip->next->prev = ip->prev;
+  ip->prev->next = ip->next;
+  if(ip->inum)
+    iunhash(ip);
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
+  ip->hnext = icache.hash[IHASH(dev, inum)];
+  icache.hash[IHASH(dev, inum)] = ip;
   ip->ref = 1;
   ip->valid = 0;
   release(&icache.lock);
@@ -347,7 +764,8 @@ ilock(struct inode *ip)
     ip->uid = dip->uid;
     ip->gid = dip->gid;
     ip->mode = dip->mode;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    memmove(ip->ext, dip->ext, sizeof(ip->ext));
+    ip->index = dip->index;
     brelse(bp);
     ip->valid = 1;
     if(ip->type == 0)
@@ -376,22 +794,28 @@ void
 iput(struct inode *ip)
 {
   acquiresleep(&ip->lock);
-  if(ip->valid && ip->nlink == 0){
-    acquire(&icache.lock);
-    int r = ip->ref;
-    release(&icache.lock);
-    if(r == 1){
+  acquire(&icache.lock);
+  int r = ip->ref;
+  release(&icache.lock);
+  if(r == 1){
+    // last reference: give back preallocated blocks.
+    brsvdrop(ip);
+    if(ip->valid && ip->nlink == 0){
       // inode has no links and no other references: truncate and free.
+      if(ip->type == T_DIR)
+        dcpurge(ip->dev, ip->inum);
       itrunc(ip);
       ip->type = 0;
       iupdate(ip);
       ip->valid = 0;
+      ifreed(ip->dev, ip->inum);
     }
   }
   releasesleep(&ip->lock);
 
   acquire(&icache.lock);
-  ip->ref--;
+  if(--ip->ref == 0)
+    ilru(ip, ip->valid);
   release(&icache.lock);
 }
 
@@ -407,64 +831,152 @@ iunlockput(struct inode *ip)
 // Inode content
 //
 // The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// in runs of contiguous blocks on the disk, each described
+// by an extent. The first NEXTENT extents are listed in
+// ip->ext[]. Up to NIEXTENT more are listed in block
+// ip->ext[NEXTENT].start, and ip->ext[NEXTENT].len counts
+// them. Extents map the file's blocks in order, so a file
+// written sequentially onto free disk needs only one.
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one as close after
+// the file's last block as it can, growing the last extent if
+// that block comes right after it. Blocks are only ever added
+// at the end of the file. Returns 0 if the inode has no room
+// for another extent or the disk is full.
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
-  struct buf *bp;
+  struct extent *e, *x;
+  struct buf *bp, *zp;
+  uint addr;
+  int i, n;
+
+  e = 0;
+  for(i = 0; i < NEXTENT && ip->ext[i].len > 0; i++){
+    e = &ip->ext[i];
+    if(bn < e->len)
+      return e->start + bn;
+    bn -= e->len;
+  }
 
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
-    return addr;
-  }
-  bn -= NDIRECT;
-
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
+  bp = 0;
+  x = 0;
+  n = 0;
+  if(ip->ext[NEXTENT].start){
+    // Load indirect extent block.
+    bp = bread(ip->dev, ip->ext[NEXTENT].start);
+    x = (struct extent*)bp->data;
+    n = ip->ext[NEXTENT].len;
+    for(i = 0; i < n; i++){
+      e = &x[i];
+      if(bn < e->len){
+        addr = e->start + bn;
+        brelse(bp);
+        return addr;
+      }
+      bn -= e->len;
     }
-    brelse(bp);
-    return addr;
   }
+  if(bn != 0)
+    panic("bmap: hole");
 
-  bn -= NINDIRECT;
-
-  if(bn < NINDIRECT * NINDIRECT){
-    // Load doubly-indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT+1]) == 0)
-      ip->addrs[NDIRECT+1] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn / NINDIRECT]) == 0){
-      a[bn / NINDIRECT] = addr = balloc(ip->dev);
+  if((addr = balloc_append(ip, e ? e->start + e->len : 0)) == 0){
+    if(bp)
+      brelse(bp);
+    return 0;
+  }
+  if(ip->type == T_FILE){
+    // File data goes to disk with the cached block (see
+    // log_writedata), so zeroing the cached copy suffices.
+    // Mark it dirty: a clean copy could be recycled, and a
+    // later bread() see the block's old contents on disk.
+    zp = bget(ip->dev, addr);
+    memset(zp->data, 0, BSIZE);
+    zp->flags |= B_VALID;
+    log_writedata(zp);
+    brelse(zp);
+  } else
+    bzero(ip->dev, addr);
+  if(e && addr == e->start + e->len){
+    e->len++;
+    if(bp)
       log_write(bp);
+  } else if(bp == 0 && i < NEXTENT){
+    ip->ext[i].start = addr;
+    ip->ext[i].len = 1;
+  } else {
+    if(bp == 0){
+      if((ip->ext[NEXTENT].start = balloc(ip->dev, 0, ip)) == 0){
+        bfree(ip->dev, addr);
+        return 0;
+      }
+      bzero(ip->dev, ip->ext[NEXTENT].start);
+      bp = bread(ip->dev, ip->ext[NEXTENT].start);
+      x = (struct extent*)bp->data;
     }
-    brelse(bp);
-    bn %= NINDIRECT;
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
+    if(n < NIEXTENT){
+      x[n].start = addr;
+      x[n].len = 1;
+      ip->ext[NEXTENT].len++;
       log_write(bp);
+    } else {
+      bfree(ip->dev, addr);
+      addr = 0;
     }
+  }
+  if(bp)
     brelse(bp);
-    return addr;
+  return addr;
+}
+
+// Return the disk block address of the nth block in inode ip,
+// and set *run to the number of blocks from there to the end
+// of its extent, which are contiguous on disk. Unlike bmap,
+// does not allocate: returns 0 if there is no such block.
+static uint
+bmaprun(struct inode *ip, uint bn, uint *run)
+{
+  struct extent *x;
+  struct buf *bp;
+  uint addr;
+  int i;
+
+  for(i = 0; i < NEXTENT && ip->ext[i].len > 0; i++){
+    if(bn < ip->ext[i].len){
+      *run = ip->ext[i].len - bn;
+      return ip->ext[i].start + bn;
+    }
+    bn -= ip->ext[i].len;
+  }
+  if(ip->ext[NEXTENT].start == 0)
+    return 0;
+
+  addr = 0;
+  bp = bread(ip->dev, ip->ext[NEXTENT].start);
+  x = (struct extent*)bp->data;
+  for(i = 0; i < ip->ext[NEXTENT].len; i++){
+    if(bn < x[i].len){
+      *run = x[i].len - bn;
+      addr = x[i].start + bn;
+      break;
+    }
+    bn -= x[i].len;
   }
+  brelse(bp);
+  return addr;
+}
 
-  panic("bmap: out of range");
+// Free the blocks of extent e.
+static void
+efree(uint dev, struct extent *e)
+{
+  uint b;
+
+  for(b = e->start; b < e->start + e->len; b++)
+    bfree(dev, b);
+  e->start = 0;
+  e->len = 0;
 }
 
 // Truncate inode (discard contents).
@@ -475,47 +987,28 @@ bmap(struct inode *ip, uint bn)
 static void
 itrunc(struct inode *ip)
 {
-  int i, j;
+  int i;
   struct buf *bp;
-  uint *a;
+  struct extent *x;
 
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
-    }
-  }
+  brsvdrop(ip);
+  for(i = 0; i < NEXTENT; i++)
+    efree(ip->dev, &ip->ext[i]);
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
-  }
-
-  if(ip->addrs[NDIRECT+1]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT+1]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j]){
-        struct buf *bp2 = bread(ip->dev, a[j]);
-        uint *a2 = (uint*)bp2->data;
-        for(int k = 0; k < NINDIRECT; k++){
-          if(a2[k])
-            bfree(ip->dev, a2[k]);
-        }
-        brelse(bp2);
-        bfree(ip->dev, a[j]);
-      }
-    }
+  if(ip->ext[NEXTENT].start){
+    bp = bread(ip->dev, ip->ext[NEXTENT].start);
+    x = (struct extent*)bp->data;
+    for(i = 0; i < ip->ext[NEXTENT].len; i++)
+      efree(ip->dev, &x[i]);
     brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT+1]);
-    ip->addrs[NDIRECT+1] = 0;
+    bfree(ip->dev, ip->ext[NEXTENT].start);
+    ip->ext[NEXTENT].start = 0;
+    ip->ext[NEXTENT].len = 0;
+  }
+
+  if(ip->index){
+    bfree(ip->dev, ip->index);
+    ip->index = 0;
   }
 
   ip->size = 0;
@@ -543,8 +1036,8 @@ stati(struct inode *ip, struct stat *st)
 int
 readi(struct inode *ip, char *dst, uint off, uint n)
 {
-  uint tot, m;
-  struct buf *bp;
+  uint tot, m, addr, run, nb, i;
+  struct buf *bp[NREADRUN];
 
   if(ip->type == T_DEV){
     if(ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].read)
@@ -557,11 +1050,22 @@ readi(struct inode *ip, char *dst, uint off, uint n)
   if(off + n > ip->size)
     n = ip->size - off;
 
-  for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
-    m = min(n - tot, BSIZE - off%BSIZE);
-    memmove(dst, bp->data + off%BSIZE, m);
-    brelse(bp);
+  // Read up to NREADRUN blocks that are contiguous on disk
+  // at a time, copying each straight to dst.
+  for(tot=0; tot<n; ){
+    if((addr = bmaprun(ip, off/BSIZE, &run)) == 0)
+      panic("readi: no block");
+    nb = (off%BSIZE + n - tot + BSIZE-1) / BSIZE;
+    nb = min(nb, min(run, NREADRUN));
+    breadn(ip->dev, addr, nb, bp);
+    for(i = 0; i < nb; i++){
+      m = min(n - tot, BSIZE - off%BSIZE);
+      memmove(dst, bp[i]->data + off%BSIZE, m);
+      brelse(bp[i]);
+      tot += m;
+      off += m;
+      dst += m;
+    }
   }
   return n;
 }
@@ -572,7 +1076,7 @@ readi(struct inode *ip, char *dst, uint off, uint n)
 int
 writei(struct inode *ip, char *src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr, run;
   struct buf *bp;
 
   if(ip->type == T_DEV){
@@ -586,19 +1090,39 @@ writei(struct inode *ip, char *src, uint off, uint n)
   if(off + n > MAXFILE*BSIZE)
     return -1;
 
+  run = 0;
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    // Walk the extents only at the start of each run.
+    if(run > 1){
+      addr++;
+      run--;
+    } else if((addr = bmaprun(ip, off/BSIZE, &run)) == 0){
+      if((addr = bmap(ip, off/BSIZE)) == 0)
+        break;
+      run = 1;
+    }
     m = min(n - tot, BSIZE - off%BSIZE);
-    memmove(bp->data + off%BSIZE, src, m);
-    log_write(bp);
+    if(m == BSIZE){
+      // Whole block: no need to read the old contents.
+      bp = bget(ip->dev, addr);
+      memmove(bp->data, src, m);
+      bp->flags |= B_VALID;
+    } else {
+      bp = bread(ip->dev, addr);
+      memmove(bp->data + off%BSIZE, src, m);
+    }
+    if(ip->type == T_FILE)
+      log_writedata(bp);
+    else
+      log_write(bp);
     brelse(bp);
   }
 
-  if(n > 0 && off > ip->size){
+  if(tot > 0 && off > ip->size){
     ip->size = off;
     iupdate(ip);
   }
-  return n;
+  return tot;
 }
 
 //PAGEBREAK!
@@ -610,17 +1134,415 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Directory name cache.
+//
+// The dcache remembers the result of recent directory lookups,
+// keyed by (device, directory inum, name): the inum and offset
+// of the entry, or inum 0 if the directory has no such name.
+// Entries are hashed for lookup and kept on an LRU list for
+// replacement, like the buffer cache.
+//
+// A directory's entries only change while the directory is
+// locked, and every change updates the dcache (dirlink, and
+// dcinval from unlink), so a locked directory and its dcache
+// entries always agree. Entries for a directory are purged
+// when its inode is freed, and for a whole device when it is
+// mounted or unmounted.
+
+#define NDCHASH 61
+
+struct dentry {
+  uint dev;
+  uint dinum;          // directory inode number, or 0 if unused
+  char name[DIRSIZ];
+  uint inum;           // 0 for a negative entry
+  uint off;            // offset of the entry in the directory
+  struct dentry *hnext;  // hash chain
+  struct dentry *prev;   // LRU list
+  struct dentry *next;
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry dent[NDCACHE];
+  struct dentry *hash[NDCHASH];
+  struct dentry head;  // head.next is most recently used
+} dcache;
+
+static void
+dcinit(void)
+{
+  struct dentry *d;
+
+  initlock(&dcache.lock, "dcache");
+  dcache.head.prev = &dcache.head;
+  dcache.head.next = &dcache.head;
+  for(d = dcache.dent; d < dcache.dent+NDCACHE; d++){
+    d->next = dcache.head.next;
+    d->prev = &dcache.head;
+    dcache.head.next->prev = d;
+    dcache.head.next = d;
+  }
+}
+
+static uint
+dchash(uint dev, uint dinum, char *name)
+{
+  uint h;
+  int i;
+
+  h = dev*31 + dinum;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h*31 + (uchar)name[i];
+  return h % NDCHASH;
+}
+
+// Find the entry for name in directory (dev, dinum).
+// Caller holds dcache.lock.
+static struct dentry*
+dcfind(uint dev, uint dinum, char *name)
+{
+  struct dentry *d;
+
+  for(d = dcache.hash[dchash(dev, dinum, name)]; d; d = d->hnext)
+    if(d->dinum == dinum && d->dev == dev && namecmp(name, d->name) == 0)
+      return d;
+  return 0;
+}
+
+// Remove d from its hash chain. Caller holds dcache.lock.
+static void
+dcunhash(struct dentry *d)
+{
+  struct dentry **pp;
+
+  if(d->dinum == 0)
+    return;
+  for(pp = &dcache.hash[dchash(d->dev, d->dinum, d->name)]; *pp; pp = &(*pp)->hnext){
+    if(*pp == d){
+      *pp = d->hnext;
+      break;
+    }
+  }
+  d->dinum = 0;
+}
+
+// Move d to the front of the LRU list. Caller holds dcache.lock.
+static void
+dctouch(struct dentry *d)
+{
+  d->next->prev = d->prev;
+  d->prev->next = d->next;
+  d->next = dcache.head.next;
+  d->prev = &dcache.head;
+  dcache.head.next->prev = d;
+  dcache.head.next = d;
+}
+
+// Record that name in directory dp has inode number inum
+// at offset off, or is absent if inum is 0.
+// Caller must hold dp->lock.
+static void
+dcenter(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dp->dev, dp->inum, name)) == 0){
+    // Recycle the least recently used entry.
+    d = dcache.head.prev;
+    dcunhash(d);
+    d->dev = dp->dev;
+    d->dinum = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+    d->hnext = dcache.hash[dchash(d->dev, d->dinum, d->name)];
+    dcache.hash[dchash(d->dev, d->dinum, d->name)] = d;
+  }
+  d->inum = inum;
+  d->off = off;
+  dctouch(d);
+  release(&dcache.lock);
+}
+
+// Name has been removed from directory dp.
+// Caller must hold dp->lock.
+void
+dcinval(struct inode *dp, char *name)
+{
+  dcenter(dp, name, 0, 0);
+}
+
+// Forget all entries for directory dinum on dev,
+// or for every directory on dev if dinum is 0.
+static void
+dcpurge(uint dev, uint dinum)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.dent; d < dcache.dent+NDCACHE; d++)
+    if(d->dinum != 0 && d->dev == dev && (dinum == 0 || d->dinum == dinum))
+      dcunhash(d);
+  release(&dcache.lock);
+}
+
+// Hashed directories.
+//
+// A directory starts out as a plain array of dirents. When
+// its first block fills up, dirlink() gives it a hash index
+// (see struct dxroot in fs.h) with a single entry covering
+// every hash, and from then on each name goes in the block
+// its hash selects. A block that fills up is split in two at
+// its median hash. Lookups then read the index block and one
+// directory block, however large the directory is.
+// Directories that grew past one block without an index
+// (made by older tools) are still read and extended linearly.
+
+// Return the hash of name.
+static uint
+dxhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 2166136261U;
+  for(i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619U;
+  }
+  return h;
+}
+
+// Return the entry of index r that covers hash h.
+static int
+dxfind(struct dxroot *r, uint h)
+{
+  int lo, hi, mid;
+
+  lo = 0;
+  hi = r->count - 1;
+  while(lo < hi){
+    mid = (lo + hi + 1) / 2;
+    if(r->e[mid].hash <= h)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+// Read the index block of hashed directory dp.
+static struct buf*
+dxread(struct inode *dp)
+{
+  struct buf *ib;
+
+  ib = bread(dp->dev, dp->index);
+  if(((struct dxroot*)ib->data)->magic != DXMAGIC)
+    panic("dxread: bad index");
+  return ib;
+}
+
+// Look for name in hashed directory dp.
+// If found, set *poff and return its inum, else return 0.
+static uint
+dxlookup(struct inode *dp, char *name, uint *poff)
+{
+  struct buf *ib, *bp;
+  struct dxroot *r;
+  struct dirent *de;
+  uint blk, inum;
+  int i;
+
+  ib = dxread(dp);
+  r = (struct dxroot*)ib->data;
+  blk = r->e[dxfind(r, dxhash(name))].block;
+  brelse(ib);
+
+  inum = 0;
+  bp = bread(dp->dev, bmap(dp, blk));
+  de = (struct dirent*)bp->data;
+  for(i = 0; i < DPB; i++){
+    if(de[i].inum != 0 && namecmp(name, de[i].name) == 0){
+      inum = de[i].inum;
+      *poff = blk*BSIZE + i*sizeof(*de);
+      break;
+    }
+  }
+  brelse(bp);
+  return inum;
+}
+
+// Split entry i of the index in ib, whose block is full:
+// move the names in the upper half of its hash range to
+// a new block at the end of dp.
+// Returns 0, or -1 if the block cannot be split.
+static int
+dxsplit(struct inode *dp, struct buf *ib, int i)
+{
+  struct dxroot *r;
+  struct buf *bp, *np;
+  struct dirent *de, *nde;
+  uint hs[DPB], h, mid, blk, nblk, addr;
+  int j, k, n;
+
+  r = (struct dxroot*)ib->data;
+  if(r->count >= NDXENTRY)
+    return -1;
+  blk = r->e[i].block;
+  nblk = dp->size / BSIZE;
+  if((addr = bmap(dp, nblk)) == 0)
+    return -1;
+  dp->size += BSIZE;
+  iupdate(dp);
+
+  // Sort the block's hashes. The first two slots of block 0
+  // hold "." and "..", which are not indexed and never move.
+  bp = bread(dp->dev, bmap(dp, blk));
+  de = (struct dirent*)bp->data;
+  n = 0;
+  for(j = (blk == 0 ? 2 : 0); j < DPB; j++){
+    if(de[j].inum == 0)
+      continue;
+    h = dxhash(de[j].name);
+    for(k = n++; k > 0 && hs[k-1] > h; k--)
+      hs[k] = hs[k-1];
+    hs[k] = h;
+  }
+
+  // Split at the median, keeping equal hashes together.
+  for(k = n/2; k < n && hs[k] == hs[0]; k++)
+    ;
+  if(k == n){
+    brelse(bp);
+    return -1;
+  }
+  mid = hs[k];
+
+  np = bread(dp->dev, addr);
+  nde = (struct dirent*)np->data;
+  k = 0;
+  for(j = (blk == 0 ? 2 : 0); j < DPB; j++){
+    if(de[j].inum == 0 || dxhash(de[j].name) < mid)
+      continue;
+    nde[k] = de[j];
+    dcenter(dp, de[j].name, de[j].inum, nblk*BSIZE + k*sizeof(*de));
+    memset(&de[j], 0, sizeof(de[j]));
+    k++;
+  }
+  log_write(np);
+  brelse(np);
+  log_write(bp);
+  brelse(bp);
+
+  memmove(&r->e[i+2], &r->e[i+1], (r->count - i - 1) * sizeof(r->e[0]));
+  r->e[i+1].hash = mid;
+  r->e[i+1].block = nblk;
+  r->count++;
+  log_write(ib);
+  return 0;
+}
+
+// Add (name, inum) to hashed directory dp.
+// Returns the offset of the new entry, or -1 if there is no room.
+static int
+dxadd(struct inode *dp, char *name, uint inum)
+{
+  struct buf *ib, *bp;
+  struct dxroot *r;
+  struct dirent *de;
+  uint h, blk;
+  int i, j, tries;
+
+  h = dxhash(name);
+  ib = dxread(dp);
+  r = (struct dxroot*)ib->data;
+  // One split always leaves room on both sides.
+  for(tries = 0; tries < 2; tries++){
+    i = dxfind(r, h);
+    blk = r->e[i].block;
+    bp = bread(dp->dev, bmap(dp, blk));
+    de = (struct dirent*)bp->data;
+    for(j = 0; j < DPB; j++){
+      if(de[j].inum == 0){
+        strncpy(de[j].name, name, DIRSIZ);
+        de[j].inum = inum;
+        log_write(bp);
+        brelse(bp);
+        brelse(ib);
+        return blk*BSIZE + j*sizeof(*de);
+      }
+    }
+    brelse(bp);
+    if(dxsplit(dp, ib, i) < 0)
+      break;
+  }
+  brelse(ib);
+  return -1;
+}
+
+// Give directory dp, whose one block is full, a hash index
+// that maps every hash to that block.
+// Returns 0, or -1 if the disk is full.
+static int
+dxconvert(struct inode *dp)
+{
+  struct buf *ib;
+  struct dxroot *r;
+
+  if((dp->index = balloc(dp->dev, 0, dp)) == 0)
+    return -1;
+  bzero(dp->dev, dp->index);
+  ib = bread(dp->dev, dp->index);
+  r = (struct dxroot*)ib->data;
+  r->magic = DXMAGIC;
+  r->count = 1;
+  r->e[0].hash = 0;
+  r->e[0].block = 0;
+  log_write(ib);
+  brelse(ib);
+  iupdate(dp);
+  return 0;
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// Caller must hold dp->lock.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
   uint off, inum;
   struct dirent de;
+  struct dentry *d;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  acquire(&dcache.lock);
+  if((d = dcfind(dp->dev, dp->inum, name)) != 0){
+    dctouch(d);
+    inum = d->inum;
+    off = d->off;
+    release(&dcache.lock);
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+  release(&dcache.lock);
+
+  if(dp->index && namecmp(name, ".") != 0 && namecmp(name, "..") != 0){
+    if((inum = dxlookup(dp, name, &off)) == 0){
+      dcenter(dp, name, 0, 0);
+      return 0;
+    }
+    if(poff)
+      *poff = off;
+    dcenter(dp, name, inum, off);
+    return iget(dp->dev, inum);
+  }
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -631,10 +1553,12 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcenter(dp, name, inum, off);
       return iget(dp->dev, inum);
     }
   }
 
+  dcenter(dp, name, 0, 0);
   return 0;
 }
 
@@ -652,19 +1576,31 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
+  if(dp->index == 0){
+    // Look for an empty dirent.
+    for(off = 0; off < dp->size; off += sizeof(de)){
+      if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirlink read");
+      if(de.inum == 0)
+        break;
+    }
+    if(off < BSIZE || dp->size > BSIZE){
+      strncpy(de.name, name, DIRSIZ);
+      de.inum = inum;
+      // Short only if the disk is full.
+      if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+        return -1;
+      dcenter(dp, name, inum, off);
+      return 0;
+    }
+    // The first block is full: index the directory.
+    if(dxconvert(dp) < 0)
+      return -1;
   }
 
-  strncpy(de.name, name, DIRSIZ);
-  de.inum = inum;
-  if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-    panic("dirlink");
-
+  if((off = dxadd(dp, name, inum)) < 0)
+    return -1;
+  dcenter(dp, name, inum, off);
   return 0;
 }
 
@@ -720,14 +1656,24 @@ mount(struct inode *ip, int dev)
   
   // Read the superblock before acquiring the lock (bread can sleep)
   readsb(dev, &sb_temp);
+  if(sb_temp.magic != FSMAGIC || sb_temp.version != FSVERSION){
+    iput(dup_ip);
+    return -1;
+  }
+  bsumreset(dev);
+  dcpurge(dev, 0);
+  iinval(dev);
 
+  // A slot with ip set is still being unmounted.
   acquire(&mount_lock);
   for(m = mounts; m < mounts + NMOUNT; m++){
-    if(!m->active){
-      m->active = 1;
+    if(!m->active && m->ip == 0){
       m->dev = dev;
       m->ip = dup_ip;
       m->sb = sb_temp;
+      // Publish the slot after filling it in.
+      __sync_synchronize();
+      m->active = 1;
       release(&mount_lock);
       return 0;
     }
@@ -744,14 +1690,23 @@ umount(struct inode *ip)
 {
   struct mount *m;
   struct inode *mount_ip = 0;
+  uint dev;
 
   acquire(&mount_lock);
   for(m = mounts; m < mounts + NMOUNT; m++){
     if(m->active && m->ip->dev == ip->dev && m->ip->inum == ip->inum){
        m->active = 0;
        mount_ip = m->ip;
+       dev = m->dev;
+       release(&mount_lock);
+       // Wait for lookups that may have seen the slot.
+       rcuwait(rcustamp());
+       acquire(&mount_lock);
        m->ip = 0;
        release(&mount_lock);
+       bsumreset(dev);
+       dcpurge(dev, 0);
+       iinval(dev);
        // Release the inode after releasing the lock
        iput(mount_ip);
        return 0;
@@ -788,17 +1743,17 @@ namex(char *path, int nameiparent, char *name)
       return ip;
     }
     if(namecmp(name, "..") == 0 && ip->inum == ROOTINO && ip->dev != ROOTDEV){
-       acquire(&mount_lock);
+       rcubegin();
        for(m = mounts; m < mounts + NMOUNT; m++){
          if(m->active && m->dev == ip->dev){
             struct inode *next_ip = idup(m->ip);
-            release(&mount_lock);
+            rcuend();
             iunlockput(ip);
             ip = next_ip;
             break;
          }
        }
-       if(m == mounts + NMOUNT) release(&mount_lock);
+       if(m == mounts + NMOUNT) rcuend();
     }
 
     if((next = dirlookup(ip, name, 0)) == 0){
@@ -811,17 +1766,17 @@ namex(char *path, int nameiparent, char *name)
     // Only check for mount points if we're going to continue traversing
     // (i.e., if path is not empty, meaning there are more components)
     if(*path != '\0'){
-      acquire(&mount_lock);
+      rcubegin();
       for(m = mounts; m < mounts + NMOUNT; m++){
         if(m->active && m->ip->dev == ip->dev && m->ip->inum == ip->inum){
            int dev = m->dev;
-           release(&mount_lock);
+           rcuend();
            iput(ip);
            ip = iget(dev, ROOTINO);
            break;
         }
       }
-      if(m == mounts + NMOUNT) release(&mount_lock);
+      if(m == mounts + NMOUNT) rcuend();
     }
   }
   if(nameiparent){
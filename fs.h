@@ -3,7 +3,10 @@
 
 
 #define ROOTINO 1  // root i-number
-#define BSIZE 512  // block size
+#define BSIZE 4096  // block size
+
+#define FSMAGIC   0x36767866  // "fxv6" in little endian
+#define FSVERSION 3           // 4 KB blocks, extents, hashed directories
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
@@ -19,11 +22,19 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint magic;        // FSMAGIC
+  uint version;      // FSVERSION
+};
+
+// A run of len contiguous disk blocks starting at start.
+struct extent {
+  uint start;
+  uint len;
 };
 
-#define NDIRECT 8
-#define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT + NINDIRECT * NINDIRECT)
+#define NEXTENT 11
+#define NIEXTENT (BSIZE / sizeof(struct extent))
+#define MAXFILE (1 << 18)  // max file size in blocks (1 GB)
 
 // On-disk inode structure
 struct dinode {
@@ -35,7 +46,9 @@ struct dinode {
   uint uid;             // Owner ID
   uint gid;             // Group ID
   uint mode;            // Protection/Permissions
-  uint addrs[NDIRECT+2];   // Data block addresses
+  struct extent ext[NEXTENT+1];  // Data extents, then indirect extent block
+  uint index;           // Hash index block (T_DIR only), or 0
+  uint spare;           // Reserved, zero
 };
 
 // Inodes per block.
@@ -51,10 +64,37 @@ struct dinode {
 #define BBLOCK(b, sb) (b/BPB + sb.bmapstart)
 
 // Directory is a file containing a sequence of dirent structures.
-#define DIRSIZ 14
+#define DIRSIZ 60
 
 struct dirent {
-  ushort inum;
+  uint inum;
   char name[DIRSIZ];
 };
 
+// Directory entries per block.
+#define DPB           (BSIZE / sizeof(struct dirent))
+
+// A large directory also has a hash index, like ext3's htree.
+// Each entry maps a range of name hashes to the block of the
+// directory that holds the names hashing into that range:
+// entry i covers hashes from e[i].hash up to e[i+1].hash.
+// e[0].hash is 0. "." and ".." always stay in the first two
+// slots of block 0 and are not indexed. The directory's
+// content is still a plain array of dirents, so programs can
+// read it like any other directory. Names are hashed with
+// 32-bit FNV-1a over their bytes, up to DIRSIZ or a NUL.
+#define DXMAGIC 0x78647864  // "dxdx"
+
+struct dxentry {
+  uint hash;   // lowest hash in this block
+  uint block;  // block number within the directory
+};
+
+#define NDXENTRY ((BSIZE - 2*sizeof(uint)) / sizeof(struct dxentry))
+
+struct dxroot {
+  uint magic;  // DXMAGIC
+  uint count;  // number of entries in e
+  struct dxentry e[NDXENTRY];
+};
+
@@ -22,8 +22,6 @@
 
 #define IDE_CMD_READ  0x20
 #define IDE_CMD_WRITE 0x30
-#define IDE_CMD_RDMUL 0xc4
-#define IDE_CMD_WRMUL 0xc5
 
 // idequeue points to the buf now being read/written to the disk.
 // idequeue->qnext points to the next buf to be processed.
@@ -31,6 +29,7 @@
 
 static struct spinlock idelock;
 static struct buf *idequeue;
+static int idesect;  // sectors of idequeue transferred so far
 
 static int havedisk[2];
 static void idestart(struct buf*);
@@ -135,39 +134,70 @@ ideinit(void)
   devsw[2].write = diskwrite;
 }
 
+// Number of sectors in the request headed by b.
+static int
+nsect(struct buf *b)
+{
+  int n;
+
+  for(n = 0; b; b = b->cnext)
+    n += BSIZE/SECTOR_SIZE;
+  return n;
+}
+
+// Data of sector i of the request headed by b.
+static uchar*
+sectdata(struct buf *b, int i)
+{
+  int sector_per_block = BSIZE/SECTOR_SIZE;
+  int j;
+
+  for(j = i/sector_per_block; j > 0; j--)
+    b = b->cnext;
+  return b->data + (i%sector_per_block)*SECTOR_SIZE;
+}
+
 // Start the request for b.  Caller must hold idelock.
+// b may head a chain of bufs (linked by cnext) for
+// consecutive blocks, transferred as one multi-sector
+// command with an interrupt per sector.
 static void
 idestart(struct buf *b)
 {
+  struct buf *c;
+
   if(b == 0)
     panic("idestart");
-  if(b->blockno >= FSSIZE && !(b->flags & B_RAW))
+  for(c = b; c->cnext; c = c->cnext)
+    if(c->cnext->blockno != c->blockno+1)
+      panic("idestart: chain not contiguous");
+  if(c->blockno >= FSSIZE && !(b->flags & B_RAW))
     panic("incorrect blockno");
   int sector_per_block =  BSIZE/SECTOR_SIZE;
-  int blockno = b->blockno;
-  
+  int sector = b->blockno * sector_per_block;
+  int n = nsect(b);
+
   // Add filesystem offset for disk 0 (unless raw disk access)
   if(b->dev == 0 && !(b->flags & B_RAW))
-    blockno += FSOFFSET;
-  
-  int sector = blockno * sector_per_block;
-  int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
-  int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
+    sector += FSOFFSET;
 
-  if (sector_per_block > 7) panic("idestart");
+  if (n > 256) panic("idestart");
 
   idewait(0);
   outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
+  outb(0x1f2, n & 0xff);  // number of sectors, 0 means 256
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
   outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
   if(b->flags & B_DIRTY){
-    outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE/4);
+    outb(0x1f7, IDE_CMD_WRITE);
+    idewait(0);
+    outsl(0x1f0, b->data, SECTOR_SIZE/4);
+    idesect = 1;
   } else {
-    outb(0x1f7, read_cmd);
+    outb(0x1f7, IDE_CMD_READ);
+    idesect = 0;
   }
 }
 
@@ -175,7 +205,7 @@ idestart(struct buf *b)
 void
 ideintr(void)
 {
-  struct buf *b;
+  struct buf *b, *c;
 
   // First queued buffer is the active request.
   acquire(&idelock);
@@ -184,16 +214,33 @@ ideintr(void)
     release(&idelock);
     return;
   }
-  idequeue = b->qnext;
 
-  // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
+  if(b->flags & B_DIRTY){
+    // The disk took the last sector; send the next one, if any.
+    if(idesect < nsect(b)){
+      idewait(0);
+      outsl(0x1f0, sectdata(b, idesect), SECTOR_SIZE/4);
+      idesect++;
+      release(&idelock);
+      return;
+    }
+  } else {
+    // Read data if needed.
+    if(idewait(1) >= 0)
+      insl(0x1f0, sectdata(b, idesect), SECTOR_SIZE/4);
+    if(++idesect < nsect(b)){
+      release(&idelock);
+      return;
+    }
+  }
+  idequeue = b->qnext;
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+  // Wake process waiting for this request.
+  for(c = b; c; c = c->cnext){
+    c->flags |= B_VALID;
+    c->flags &= ~B_DIRTY;
+  }
+  wqwakeup(&b->wq);
 
   // Start disk on next buf in queue.
   if(idequeue != 0)
@@ -202,18 +249,23 @@ ideintr(void)
   release(&idelock);
 }
 
-// Sync buf with disk.
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
+// Queue the request headed by b and return without waiting.
+// If B_DIRTY is set, write the chain to disk; else read it.
+// The caller holds the lock of every buf in the chain and
+// must call ideawait(b) before touching any of them.
 void
-iderw(struct buf *b)
+idesubmit(struct buf *b)
 {
-  struct buf **pp;
-
-  if(!holdingsleep(&b->lock))
-    panic("iderw: buf not locked");
-  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("iderw: nothing to do");
+  struct buf **pp, *c;
+
+  for(c = b; c; c = c->cnext){
+    if(!holdingsleep(&c->lock))
+      panic("iderw: buf not locked");
+    if((c->flags & (B_VALID|B_DIRTY)) == B_VALID)
+      panic("iderw: nothing to do");
+    if(c != b && (c->dev != b->dev || (c->flags & B_DIRTY) != (b->flags & B_DIRTY)))
+      panic("iderw: mixed chain");
+  }
   if(b->dev >= 2 || !havedisk[b->dev])
     panic("iderw: ide disk not present");
 
@@ -229,11 +281,26 @@ iderw(struct buf *b)
   if(idequeue == b)
     idestart(b);
 
-  // Wait for request to finish.
+  release(&idelock);
+}
+
+// Wait for the request headed by b to finish.
+void
+ideawait(struct buf *b)
+{
+  acquire(&idelock);
   while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
-    sleep(b, &idelock);
+    wqsleep(&b->wq, &idelock, 0);
   }
-
-
   release(&idelock);
 }
+
+// Sync buf with disk.
+// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from disk, set B_VALID.
+void
+iderw(struct buf *b)
+{
+  idesubmit(b);
+  ideawait(b);
+}
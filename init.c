@@ -3,6 +3,7 @@
 #include "user.h"
 #include "fcntl.h"
 #include "fs.h"
+#include "sched.h"
 
 char *login_argv[] = { "login", 0 };
 int sh_pid = 0;
@@ -20,33 +21,29 @@ get_service_name(char *path, char *name)
 void
 start_service(char *path)
 {
-  int pid = fork();
-  if(pid < 0){
-    printf(1, "init: fork failed\n");
-    return;
+  char name[64];
+  get_service_name(path, name);
+  char logpath[128];
+  strcpy(logpath, "/log/");
+  strcpy(logpath + 5, name);
+
+  // The service's stdout and stderr go to its log.
+  int logfd = open(logpath, O_CREATE|O_WRONLY);
+  if(logfd < 0){
+    mknod(logpath, 1, 1);
+    logfd = open(logpath, O_CREATE|O_WRONLY);
   }
-  if(pid == 0){
-    char name[64];
-    get_service_name(path, name);
-    char logpath[128];
-    strcpy(logpath, "/log/");
-    strcpy(logpath + 5, name);
-    
-    close(1);
-    close(2);
-    if(open(logpath, O_CREATE|O_WRONLY) < 0){
-       mknod(logpath, 1, 1);
-       open(logpath, O_CREATE|O_WRONLY);
-    }
-    dup(1); 
-    
-    exec(path, (char*[]){path, 0});
+  int fds[3] = { 0, logfd, logfd };
+  int pid = spawn(path, (char*[]){path, 0}, fds, 3);
+  if(logfd >= 0)
+    close(logfd);
+  if(pid < 0){
     printf(1, "init: exec %s failed\n", path);
-    exit();
+    return;
   }
+  // Services answer requests: let them ahead of batch work.
+  setpriority(pid, SCHED_NORMAL, -5);
   
-  char name[64];
-  get_service_name(path, name);
   char pidpath[128];
   strcpy(pidpath, "/var/run/");
   strcpy(pidpath + 9, name);
@@ -199,14 +196,11 @@ list_services()
 void
 start_login()
 {
+  int fds[3] = { 0, 1, 2 };
+
   printf(1, "init: starting login\n");
-  sh_pid = fork();
+  sh_pid = spawn("login", login_argv, fds, 3);
   if(sh_pid < 0){
-    printf(1, "init: fork failed\n");
-    exit();
-  }
-  if(sh_pid == 0){
-    exec("login", login_argv);
     printf(1, "init: exec login failed\n");
     exit();
   }
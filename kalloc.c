@@ -1,6 +1,22 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
 // and pipe buffers. Allocates 4096-byte pages.
+//
+// Each page has a reference count, so that fork() can share
+// user pages copy-on-write: kalloc() sets it to one, kref()
+// adds a reference, and kfree() frees the page only when the
+// last reference is dropped.
+//
+// Free memory is kept by a buddy allocator: a free block of
+// order k is 2^k pages, aligned to its size, on free list k.
+// kallocn() returns such a block for callers that need
+// physically contiguous memory; freeing a block merges it
+// with its buddy whenever the buddy is free too.
+//
+// Single pages go through a small cache per CPU, so that
+// kalloc() and kfree() normally do not take kmem.lock: a CPU
+// takes KBATCH pages from the buddy lists when its cache is
+// empty and gives KBATCH back when it holds KCACHE.
 
 #include "types.h"
 #include "defs.h"
@@ -15,12 +31,21 @@ extern char end[]; // first address after kernel loaded from ELF file
 
 struct run {
   struct run *next;
+  struct run *prev;  // on the buddy lists only
+};
+
+struct kcache {
+  struct run *list;
+  int n;
 };
 
 struct {
   struct spinlock lock;
   int use_lock;
-  struct run *freelist;
+  struct run *free[KMAXORDER+1];    // buddy lists, by order
+  uchar order[PHYSTOP/PGSIZE];      // order+1 of the free block starting here
+  uchar ref[PHYSTOP/PGSIZE];        // at most one per process
+  struct kcache cache[NCPU];
 } kmem;
 
 // Initialization happens in two phases.
@@ -28,6 +53,8 @@ struct {
 // the pages mapped by entrypgdir on free list.
 // 2. main() calls kinit2() with the rest of the physical pages
 // after installing a full page table that maps them on all cores.
+// The per-CPU caches are used only after kinit2(), once every
+// CPU is known to mycpu().
 void
 kinit1(void *vstart, void *vend)
 {
@@ -36,44 +63,151 @@ kinit1(void *vstart, void *vend)
   freerange(vstart, vend);
 }
 
+// kinit2() frees only the usable ranges of the BIOS's memory map.
 void
 kinit2(void *vstart, void *vend)
 {
-  freerange(vstart, vend);
+  uint start, stop;
+  int i;
+
+  for(i = 0; memrange(i, &start, &stop); i++){
+    if(P2V(start) < vstart)
+      start = V2P(vstart);
+    if(P2V(stop) > vend)
+      stop = V2P(vend);
+    if(start < stop)
+      freerange(P2V(start), P2V(stop));
+  }
   kmem.use_lock = 1;
 }
 
+static void buddyfree(char *v, int order);
+
 void
 freerange(void *vstart, void *vend)
 {
   char *p;
   p = (char*)PGROUNDUP((uint)vstart);
   for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
-    kfree(p);
+    buddyfree(p, 0);
+}
+
+//PAGEBREAK: 21
+// Buddy lists. Caller must hold kmem.lock (or be initializing).
+
+static void
+buddypush(char *v, int order)
+{
+  struct run *r;
+
+  r = (struct run*)v;
+  r->prev = 0;
+  r->next = kmem.free[order];
+  if(r->next)
+    r->next->prev = r;
+  kmem.free[order] = r;
+  kmem.order[V2P(v)/PGSIZE] = order+1;
+}
+
+static void
+buddyunlink(char *v, int order)
+{
+  struct run *r;
+
+  r = (struct run*)v;
+  if(r->prev)
+    r->prev->next = r->next;
+  else
+    kmem.free[order] = r->next;
+  if(r->next)
+    r->next->prev = r->prev;
+  kmem.order[V2P(v)/PGSIZE] = 0;
+}
+
+// Free the block of 2^order pages at v, merging it with
+// its buddy for as long as the buddy is free.
+static void
+buddyfree(char *v, int order)
+{
+  uint pa, bpa;
+
+  pa = V2P(v);
+  while(order < KMAXORDER){
+    bpa = pa ^ (PGSIZE << order);
+    if(bpa >= PHYSTOP || kmem.order[bpa/PGSIZE] != order+1)
+      break;
+    buddyunlink(P2V(bpa), order);
+    pa &= ~(PGSIZE << order);
+    order++;
+  }
+  buddypush(P2V(pa), order);
 }
+
+// Take a block of 2^order pages, splitting a larger one
+// if there is none that size. Returns 0 if there is none.
+static char*
+buddyalloc(int order)
+{
+  char *v;
+  int k;
+
+  for(k = order; k <= KMAXORDER && kmem.free[k] == 0; k++)
+    ;
+  if(k > KMAXORDER)
+    return 0;
+  v = (char*)kmem.free[k];
+  buddyunlink(v, k);
+  while(k > order){
+    k--;
+    buddypush(v + (PGSIZE << k), k);
+  }
+  return v;
+}
+
 //PAGEBREAK: 21
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the page of physical memory pointed
+// at by v, which normally should have been returned by a
+// call to kalloc(), and free it if that was the last one.
 void
 kfree(char *v)
 {
+  struct kcache *c;
   struct run *r;
 
   if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
     panic("kfree");
 
+  if(kmem.ref[V2P(v)/PGSIZE] == 0)
+    panic("kfree: free page");
+  if(__sync_sub_and_fetch(&kmem.ref[V2P(v)/PGSIZE], 1) > 0)
+    return;
+
+#ifdef KDEBUG
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
+#endif
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
+  if(!kmem.use_lock){
+    buddyfree(v, 0);
+    return;
+  }
+
+  pushcli();
+  c = &kmem.cache[cpuid()];
   r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  if(kmem.use_lock)
+  r->next = c->list;
+  c->list = r;
+  if(++c->n >= KCACHE){
+    acquire(&kmem.lock);
+    while(c->n > KCACHE - KBATCH){
+      r = c->list;
+      c->list = r->next;
+      c->n--;
+      buddyfree((char*)r, 0);
+    }
     release(&kmem.lock);
+  }
+  popcli();
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -82,15 +216,90 @@ kfree(char *v)
 char*
 kalloc(void)
 {
+  struct kcache *c;
   struct run *r;
+  char *v;
 
+  if(!kmem.use_lock)
+    return kallocn(0);
+
+  pushcli();
+  c = &kmem.cache[cpuid()];
+  if(c->n == 0){
+    acquire(&kmem.lock);
+    while(c->n < KBATCH && (v = buddyalloc(0)) != 0){
+      r = (struct run*)v;
+      r->next = c->list;
+      c->list = r;
+      c->n++;
+    }
+    release(&kmem.lock);
+  }
+  r = c->list;
+  if(r){
+    c->list = r->next;
+    c->n--;
+    kmem.ref[V2P(r)/PGSIZE] = 1;
+  }
+  popcli();
+  return (char*)r;
+}
+
+// Allocate 2^order physically contiguous pages, aligned to
+// their size. Returns 0 if the memory cannot be allocated.
+// The block is not reference counted page by page: free it
+// with kfreen() and the same order, never with kfree().
+char*
+kallocn(int order)
+{
+  char *v;
+
+  if(order < 0 || order > KMAXORDER)
+    return 0;
   if(kmem.use_lock)
     acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
+  v = buddyalloc(order);
+  if(v)
+    kmem.ref[V2P(v)/PGSIZE] = 1;
   if(kmem.use_lock)
     release(&kmem.lock);
-  return (char*)r;
+  return v;
 }
 
+// Free a block returned by kallocn(order).
+void
+kfreen(char *v, int order)
+{
+  if(order < 0 || order > KMAXORDER || (uint)v % (PGSIZE << order) ||
+     v < end || V2P(v) + (PGSIZE << order) > PHYSTOP)
+    panic("kfreen");
+  if(kmem.ref[V2P(v)/PGSIZE] != 1)
+    panic("kfreen: free block");
+  kmem.ref[V2P(v)/PGSIZE] = 0;
+#ifdef KDEBUG
+  memset(v, 1, PGSIZE << order);
+#endif
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  buddyfree(v, order);
+  if(kmem.use_lock)
+    release(&kmem.lock);
+}
+
+// Add a reference to the allocated page v.
+void
+kref(char *v)
+{
+  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+    panic("kref");
+  if(kmem.ref[V2P(v)/PGSIZE] == 0)
+    panic("kref: free page");
+  __sync_fetch_and_add(&kmem.ref[V2P(v)/PGSIZE], 1);
+}
+
+// Return the number of references to page v.
+int
+krefs(char *v)
+{
+  return kmem.ref[V2P(v)/PGSIZE];
+}
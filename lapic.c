@@ -32,6 +32,7 @@
 #define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
   #define X1         0x0000000B   // divide counts by 1
   #define PERIODIC   0x00020000   // Periodic
+  #define ONESHOT    0x00000000   // One-shot
 #define PCINT   (0x0340/4)   // Performance Counter LVT
 #define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
 #define LINT1   (0x0360/4)   // Local Vector Table 2 (LINT1)
@@ -42,6 +43,7 @@
 #define TDCR    (0x03E0/4)   // Timer Divide Configuration
 
 volatile uint *lapic;  // Initialized in mp.c
+uint lapicperus;       // Timer counts per microsecond, set by timerinit
 
 //PAGEBREAK!
 static void
@@ -60,13 +62,17 @@ lapicinit(void)
   // Enable local APIC; set spurious interrupt vector.
   lapicw(SVR, ENABLE | (T_IRQ0 + IRQ_SPURIOUS));
 
-  // The timer repeatedly counts down at bus frequency
-  // from lapic[TICR] and then issues an interrupt.
-  // If xv6 cared more about precise timekeeping,
-  // TICR would be calibrated using an external time source.
+  // The timer counts down once at bus frequency from
+  // lapic[TICR] and then issues an interrupt; timer.c
+  // sets TICR for the next thing this CPU must do (see
+  // lapicarm). Until timerinit() has measured the bus
+  // frequency, guess.
   lapicw(TDCR, X1);
-  lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
-  lapicw(TICR, 10000000);
+  lapicw(TIMER, ONESHOT | (T_IRQ0 + IRQ_TIMER));
+  if(lapicperus)
+    lapicarm(TICKUS);
+  else
+    lapicw(TICR, 10000000);
 
   // Disable logical interrupt lines.
   lapicw(LINT0, MASKED);
@@ -113,6 +119,52 @@ lapiceoi(void)
     lapicw(EOI, 0);
 }
 
+// Have the timer interrupt this CPU in us microseconds,
+// or stop it if us is 0.
+void
+lapicarm(uint us)
+{
+  if(!lapic || !lapicperus)
+    return;
+  if(us > 0xFFFFFFFF / lapicperus)
+    us = 0xFFFFFFFF / lapicperus;
+  lapicw(TICR, us * lapicperus);
+}
+
+// For timerinit() to measure the timer: start it counting
+// down from its largest count, without interrupting, and
+// return how far it has counted since.
+void
+lapictimerstart(void)
+{
+  lapicw(TIMER, MASKED | ONESHOT | (T_IRQ0 + IRQ_TIMER));
+  lapicw(TICR, 0xFFFFFFFF);
+}
+
+uint
+lapictimerstop(void)
+{
+  uint n;
+
+  n = 0xFFFFFFFF - lapic[TCCR];
+  lapicw(TICR, 0);
+  lapicw(TIMER, ONESHOT | (T_IRQ0 + IRQ_TIMER));
+  return n;
+}
+
+// Send interrupt vector to the CPU with APIC ID apicid.
+// Interrupts must be off.
+void
+lapicipi(int apicid, int vector)
+{
+  if(!lapic)
+    return;
+  lapicw(ICRHI, apicid<<24);
+  lapicw(ICRLO, FIXED | ASSERT | vector);
+  while(lapic[ICRLO] & DELIVS)
+    ;
+}
+
 // Spin for a given number of microseconds.
 // On real hardware would want to tune this dynamically.
 void
@@ -9,8 +9,8 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. The logging system only seals a transaction when there
+// are no FS system calls active in it. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
@@ -18,107 +18,229 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the running transaction has been sealed.
 //
-// The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
-//   block A
-//   block B
-//   block C
-//   ...
-// Log appends are synchronous.
-
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+// Group commit: the log keeps two in-memory transactions.
+// begin_op() joins the running one. When the last system call
+// in it ends, the transaction is sealed: its blocks are copied
+// into the log's private buffers and a fresh running transaction
+// is opened, so new system calls proceed while the sealed one
+// is written to disk. The end_op() that sealed a transaction
+// commits it; every other end_op() of that transaction waits
+// until the commit is durable. If other system calls were
+// active, the sealer may linger for up to log.latency ticks
+// to let more of them join, unless log.batch blocks are
+// already logged.
+//
+// The log is a physical re-do log containing disk blocks,
+// kept as a circular journal. Its size is chosen by mkfs and
+// recorded in the superblock. The on-disk log format:
+//   journal header block: ring position and seq of the tail
+//   ring of blocks holding, for each transaction:
+//     descriptor block, containing seq and block #s for A, B, C, ...
+//     block A
+//     block B
+//     block C
+//     ...
+//     commit block, containing a magic number and seq
+// A transaction is durable once its commit block is on disk,
+// and end_op() waits for no more than that. The checkpoint
+// thread later installs durable transactions to their home
+// locations and advances the tail to free their ring space.
+// Until then their cached blocks stay pinned and their sealed
+// copies stay in logbuf.
+//
+// The data blocks of regular files are not logged (ordered
+// mode): writei() marks them dirty in the buffer cache with
+// log_writedata(), and they go to their home locations when
+// the buffer cache writes them back, at the latest just before
+// the commit block of the next transaction. So after a crash a
+// file may hold newer data than its size says, but never
+// another file's old blocks. For that, a block must not get
+// file data written into it while the log may still write
+// it; balloc() asks log_busy().
+
+// Contents of the descriptor block, used for both the on-disk
+// descriptor and to keep track in memory of logged block# before commit.
 struct logheader {
+  int seq;
   int n;
   int block[LOGSIZE];
 };
 
+// Contents of the commit block.
+struct logcommit {
+  uint magic;
+  int seq;
+};
+#define LOGMAGIC 0x6c6f6721
+
+// Contents of the journal header block.
+struct logsb {
+  int tail;  // ring position of the oldest uninstalled transaction
+  int seq;   // its seq
+};
+
+// An in-memory transaction.
+struct trans {
+  int seq;          // sequence number, increases by one per transaction
+  int outstanding;  // how many FS sys calls are executing in it
+  int nops;         // how many FS sys calls have joined it
+  int claimed;      // an end_op() is going to seal it
+  int pos;          // ring position of its descriptor, once sealed
+  struct logheader lh;
+  struct buf *buf[LOGSIZE];  // pinned cache buffers of lh.block[]
+  uchar freed[FSSIZE/8];     // bitmap of blocks it frees
+};
+
 struct log {
   struct spinlock lock;
   int start;
-  int size;
-  int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int size;        // blocks in the ring, not counting the journal header
   int dev;
-  struct logheader lh;
+  int batch;       // seal without lingering once this many blocks are logged
+  int latency;     // max ticks to linger for more ops to join
+  int sealing;     // copying a sealed transaction; begin_op() must wait
+  int done;        // seq of the last durable transaction
+  int head;        // ring position for the next sealed transaction
+  int tail;        // ring position of the oldest uninstalled transaction
+  int used;        // ring blocks from tail to head
+  int durable;     // ring blocks from tail to the end of transaction done
+  int ckptwait;    // a sealer is waiting for ring space
+  struct trans trans[2];
+  struct trans *cur;     // running transaction
+  struct trans *commit;  // transaction being committed, or 0
 };
 struct log log;
 
+// Private copies of the blocks in the ring, one per ring position.
+// These are not in the buffer cache, so new transactions can keep
+// modifying the cached blocks while the sealed copies are written
+// to the log and later installed.
+static struct buf logbuf[LOGSIZE];
+
+// Per ring position: home block # of a logged block (0 for
+// descriptor and commit blocks) and its pinned cache buffer.
+static uint ringblock[LOGSIZE];
+static struct buf *ringbuf[LOGSIZE];
+
+// Disk requests being built from logbuf. Adjacent blocks are
+// chained into one multi-block request.
+struct logio {
+  struct buf *req[LOGSIZE];
+  int n;
+  int chainlen;  // bufs in req[n-1]'s chain
+};
+
 static void recover_from_log(void);
-static void commit();
+static void commit(struct trans*);
+static void checkpointer(void);
 
 void
 initlog(int dev)
 {
-  if (sizeof(struct logheader) >= BSIZE)
+  int i;
+
+  if (sizeof(struct logheader) > BSIZE)
     panic("initlog: too big logheader");
 
   struct superblock sb;
   initlock(&log.lock, "log");
   readsb(dev, &sb);
+  if(sb.nlog < 2)
+    panic("initlog: no log");
   log.start = sb.logstart;
-  log.size = sb.nlog;
+  log.size = sb.nlog - 1;
+  if(log.size > LOGSIZE)
+    log.size = LOGSIZE;
+  if(log.size < MAXOPBLOCKS+2)
+    panic("initlog: log too small");
   log.dev = dev;
-  recover_from_log();
-}
-
-// Copy committed blocks from log to their home location
-static void
-install_trans(void)
-{
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    brelse(lbuf);
-    brelse(dbuf);
+  log.batch = LOGBATCH;
+  log.latency = LOGLATENCY;
+  for(i = 0; i < LOGSIZE; i++){
+    initsleeplock(&logbuf[i].lock, "logbuf");
+    initwaitq(&logbuf[i].wq, "logbuf");
   }
+  log.cur = &log.trans[0];
+  recover_from_log();
+  kthread("logckpt", checkpointer);
+  kthread("bflush", bflusher);
 }
 
-// Read the log header from disk into the in-memory log header
+// Write the tail position and seq to the journal header.
 static void
-read_head(void)
+write_tail(int tail, int seq)
 {
   struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
-  }
+  struct logsb *jsb = (struct logsb *) (buf->data);
+  jsb->tail = tail;
+  jsb->seq = seq;
+  bwrite(buf);
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
-static void
-write_head(void)
+// Disk block of ring position pos.
+static uint
+ringaddr(int pos)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
-  }
-  bwrite(buf);
-  brelse(buf);
+  return log.start + 1 + pos % log.size;
 }
 
+// Replay committed transactions from the ring, starting at
+// the tail, to their home locations, stopping at the first
+// one whose descriptor or commit block does not match.
+// Only used at boot, before any transaction runs.
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  struct buf *buf, *dbuf, *lbuf, *cbuf;
+  struct logheader *lh;
+  struct logcommit *lc;
+  int pos, seq, used, n, ok, i;
+
+  buf = bread(log.dev, log.start);
+  pos = ((struct logsb *) (buf->data))->tail;
+  seq = ((struct logsb *) (buf->data))->seq;
+  brelse(buf);
+  if(pos < 0 || pos >= log.size)
+    pos = 0;
+  if(seq < 1)
+    seq = 1;
+
+  for(used = 0; ; used += n+2){
+    dbuf = bread(log.dev, ringaddr(pos));
+    lh = (struct logheader *) (dbuf->data);
+    n = lh->n;
+    if(lh->seq != seq || n < 0 || used + n + 2 > log.size){
+      brelse(dbuf);
+      break;
+    }
+    cbuf = bread(log.dev, ringaddr(pos+1+n));
+    lc = (struct logcommit *) (cbuf->data);
+    ok = lc->magic == LOGMAGIC && lc->seq == seq;
+    brelse(cbuf);
+    if(!ok){
+      brelse(dbuf);
+      break;
+    }
+    for (i = 0; i < n; i++) {
+      lbuf = bread(log.dev, ringaddr(pos+1+i)); // read log block
+      buf = bread(log.dev, lh->block[i]); // read dst
+      memmove(buf->data, lbuf->data, BSIZE);  // copy block to dst
+      bwrite(buf);  // write dst to disk
+      brelse(lbuf);
+      brelse(buf);
+    }
+    brelse(dbuf);
+    pos = (pos + n + 2) % log.size;
+    seq++;
+  }
+
+  write_tail(pos, seq); // clear the log
+  log.head = log.tail = pos;
+  log.done = seq - 1;
+  log.cur->seq = seq;
 }
 
 // called at the start of each FS system call.
@@ -127,83 +249,291 @@ begin_op(void)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.sealing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(log.cur->lh.n + (log.cur->outstanding+1)*MAXOPBLOCKS + 2 > log.size){
+      // this op might exhaust log space; wait for the
+      // running transaction to be sealed.
       sleep(&log, &log.lock);
     } else {
-      log.outstanding += 1;
+      log.cur->outstanding += 1;
+      log.cur->nops += 1;
       release(&log.lock);
       break;
     }
   }
 }
 
+// Wait until t can be sealed: no ops are active in it, the
+// previous transaction has finished committing, the ring has
+// room for it, and either a full batch is logged or the
+// latency window has passed. Then make t the committing
+// transaction, give it its ring space and open a new one.
+// Caller holds log.lock and has claimed t.
+static void
+seal(struct trans *t)
+{
+  struct trans *nt;
+  uint64 deadline;
+
+  deadline = usecs() + log.latency*TICKUS;
+  for(;;){
+    if(t->outstanding > 0 || log.commit){
+      sleep(&log, &log.lock);
+      continue;
+    }
+    if(log.used + t->lh.n + 2 > log.size){
+      // ring is full; have the checkpointer free some.
+      log.ckptwait = 1;
+      wakeup(&log.tail);
+      sleep(&log, &log.lock);
+      continue;
+    }
+    if(t->nops < 2 || t->lh.n >= log.batch || usecs() >= deadline)
+      break;
+    // Other ops were active in t recently; give more
+    // of them a chance to join before committing.
+    tsleep(&log, &log.lock, deadline);
+  }
+
+  t->pos = log.head;
+  log.head = (log.head + t->lh.n + 2) % log.size;
+  log.used += t->lh.n + 2;
+
+  nt = (t == &log.trans[0]) ? &log.trans[1] : &log.trans[0];
+  nt->seq = t->seq + 1;
+  nt->outstanding = 0;
+  nt->nops = 0;
+  nt->claimed = 0;
+  nt->lh.n = 0;
+  memset(nt->freed, 0, sizeof(nt->freed));
+  log.cur = nt;
+  log.commit = t;
+  log.sealing = 1;
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// the last outstanding operation seals and commits
+// the transaction; the others wait for that commit.
 void
 end_op(void)
 {
-  int do_commit = 0;
+  struct trans *t;
+  int seq;
 
   acquire(&log.lock);
-  log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
+  t = log.cur;
+  seq = t->seq;
+  if(t->outstanding < 1)
+    panic("end_op");
+  t->outstanding -= 1;
+  // begin_op() may be waiting for log space, and seal()
+  // may be waiting for the transaction to become idle.
+  wakeup(&log);
+  if(t->lh.n == 0){
+    // nothing logged (yet); no commit to wait for.
+    release(&log.lock);
+    return;
   }
-  release(&log.lock);
 
-  if(do_commit){
+  if(t->outstanding == 0 && !t->claimed){
+    t->claimed = 1;
+    seal(t);
+    release(&log.lock);
+
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
-    commit();
+    commit(t);
+
     acquire(&log.lock);
-    log.committing = 0;
+    log.done = t->seq;
+    log.durable = log.used;
+    log.commit = 0;
     wakeup(&log);
-    release(&log.lock);
+    if(log.durable*2 >= log.size)
+      wakeup(&log.tail);
   }
+
+  while(log.done < seq)
+    sleep(&log, &log.lock);
+  release(&log.lock);
+}
+
+// Copy the sealed transaction's blocks from the cache into
+// the logbufs of its ring space, and fill in its descriptor
+// and commit blocks. New transactions may not modify any
+// block until this is done, so begin_op() waits for log.sealing.
+static void
+snapshot(struct trans *t)
+{
+  struct logcommit *lc;
+  int i, p;
+
+  t->lh.seq = t->seq;
+  p = t->pos;
+  memmove(logbuf[p].data, &t->lh, sizeof(t->lh));
+  ringblock[p] = 0;
+  for (i = 0; i < t->lh.n; i++) {
+    p = (t->pos + 1 + i) % log.size;
+    acquiresleep(&t->buf[i]->lock);
+    memmove(logbuf[p].data, t->buf[i]->data, BSIZE);
+    releasesleep(&t->buf[i]->lock);
+    ringblock[p] = t->lh.block[i];
+    ringbuf[p] = t->buf[i];
+  }
+  p = (t->pos + 1 + t->lh.n) % log.size;
+  memset(logbuf[p].data, 0, BSIZE);
+  lc = (struct logcommit *) (logbuf[p].data);
+  lc->magic = LOGMAGIC;
+  lc->seq = t->seq;
+  ringblock[p] = 0;
+
+  acquire(&log.lock);
+  log.sealing = 0;
+  wakeup(&log);
+  release(&log.lock);
+}
+
+// Lock logbuf[i] and add it to the pending requests in io,
+// to be written to block blockno.
+static void
+logbuf_add(struct logio *io, int i, uint blockno)
+{
+  struct buf *b = &logbuf[i];
+  struct buf *last;
+
+  acquiresleep(&b->lock);
+  b->dev = log.dev;
+  b->blockno = blockno;
+  b->flags = B_DIRTY;
+  b->cnext = 0;
+  if(io->n > 0 && io->chainlen < MAXCHAIN){
+    for(last = io->req[io->n-1]; last->cnext; last = last->cnext)
+      ;
+    if(last->blockno+1 == blockno){
+      last->cnext = b;
+      io->chainlen++;
+      return;
+    }
+  }
+  io->req[io->n++] = b;
+  io->chainlen = 1;
 }
 
-// Copy modified blocks from cache to log.
+// Submit all pending requests in io at once, in the order they
+// were added, then wait for all of them and unlock the bufs.
 static void
-write_log(void)
+logbuf_flush(struct logio *io)
 {
-  int tail;
+  struct buf *b, *next;
+  int i;
+
+  for(i = 0; i < io->n; i++)
+    idesubmit(io->req[i]);
+  for(i = 0; i < io->n; i++){
+    ideawait(io->req[i]);
+    for(b = io->req[i]; b; b = next){
+      next = b->cnext;
+      b->cnext = 0;
+      releasesleep(&b->lock);
+    }
+  }
+  io->n = 0;
+}
+
+// Write the descriptor and data blocks from the snapshot to
+// the log, then the commit block -- the real commit.
+static void
+commit(struct trans *t)
+{
+  static struct logio io;
+  int i, p;
+
+  snapshot(t);
+  // Ordered mode: file data written by t must be on disk
+  // before t's commit block.
+  bflush(log.dev);
+  for (i = 0; i <= t->lh.n; i++) {
+    p = (t->pos + i) % log.size;
+    logbuf_add(&io, p, ringaddr(p));
+  }
+  logbuf_flush(&io);
+  p = (t->pos + 1 + t->lh.n) % log.size;
+  logbuf_add(&io, p, ringaddr(p));
+  logbuf_flush(&io);
+}
+
+// Install the durable transactions between the tail and
+// log.done to their home locations, then advance the tail
+// past them. The writes are issued together in block order
+// so adjacent blocks coalesce; of several logged copies of a
+// block only the newest is written. The cached copies may
+// already hold newer updates, so they are left alone.
+static void
+checkpoint(void)
+{
+  static struct logio io;
+  static int order[LOGSIZE];
+  int count, seq, end, n, i, j, p;
+
+  acquire(&log.lock);
+  count = log.durable;
+  seq = log.done + 1;
+  release(&log.lock);
+  end = (log.tail + count) % log.size;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  n = 0;
+  for (i = 0; i < count; i++) {
+    p = (log.tail + i) % log.size;
+    if(ringblock[p] == 0)
+      continue;
+    for (j = n; j > 0 && ringblock[order[j-1]] > ringblock[p]; j--)
+      order[j] = order[j-1];
+    order[j] = p;
+    n++;
+  }
+  for (i = 0; i < n; i++) {
+    if(i+1 < n && ringblock[order[i+1]] == ringblock[order[i]])
+      continue;  // a newer copy follows
+    logbuf_add(&io, order[i], ringblock[order[i]]);
   }
+  logbuf_flush(&io);
+  write_tail(end, seq);
+
+  for (i = 0; i < n; i++) {
+    p = order[i];
+    bunpin(ringbuf[p]);
+    ringblock[p] = 0;
+    ringbuf[p] = 0;
+  }
+
+  acquire(&log.lock);
+  log.tail = end;
+  log.used -= count;
+  log.durable -= count;
+  log.ckptwait = 0;
+  wakeup(&log);
+  release(&log.lock);
 }
 
+// The checkpoint thread. Installs lazily: once half the ring
+// holds durable transactions, or when a sealer needs space.
 static void
-commit()
+checkpointer(void)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  acquire(&log.lock);
+  for(;;){
+    while(log.durable == 0 || (!log.ckptwait && log.durable*2 < log.size))
+      sleep(&log.tail, &log.lock);
+    release(&log.lock);
+    checkpoint();
+    acquire(&log.lock);
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
-// Record the block number and pin in the cache with B_DIRTY.
-// commit()/write_log() will do the disk write.
+// Record the block number and pin the buffer in the cache.
+// commit()/checkpoint() will do the disk writes.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -213,22 +543,88 @@ commit()
 void
 log_write(struct buf *b)
 {
+  struct trans *t;
   int i;
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if(b->dev != log.dev){
+    // Only the root device has a log; write other
+    // devices' blocks through to disk.
+    bwrite(b);
+    return;
+  }
+
+  acquire(&log.lock);
+  b->flags &= ~B_DIRTY;  // the log writes it now
+  t = log.cur;
+  if (t->lh.n + 2 >= log.size)
     panic("too big a transaction");
-  if (log.outstanding < 1)
+  if (t->outstanding < 1)
     panic("log_write outside of trans");
 
-  acquire(&log.lock);
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorbtion
+  for (i = 0; i < t->lh.n; i++) {
+    if (t->lh.block[i] == b->blockno)   // log absorbtion
       break;
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n)
-    log.lh.n++;
-  b->flags |= B_DIRTY; // prevent eviction
+  if (i == t->lh.n) {
+    t->lh.block[i] = b->blockno;
+    t->buf[i] = b;
+    bpin(b);  // prevent eviction until installed
+    t->lh.n++;
+  }
   release(&log.lock);
 }
 
+
+// Caller has modified b->data, a regular file's data block,
+// and is done with the buffer. Unlike log_write(), leave it
+// dirty in the cache for bflush() or bget() to write back;
+// commit() flushes it before the next commit block.
+void
+log_writedata(struct buf *b)
+{
+  if(b->dev != log.dev){
+    bwrite(b);
+    return;
+  }
+  b->flags |= B_DIRTY;
+}
+
+// Note that the running transaction frees block b.
+void
+log_bfree(uint dev, uint b)
+{
+  if(dev != log.dev || b >= FSSIZE)
+    return;
+  acquire(&log.lock);
+  log.cur->freed[b/8] |= 1 << (b%8);
+  release(&log.lock);
+}
+
+// Whether file data must not be written to block b yet:
+// either the log holds a copy of b that it may still install
+// or replay over it, or b was freed by a transaction that is
+// not yet durable, so after a crash b would still belong to
+// its old owner.
+int
+log_busy(uint dev, uint b)
+{
+  struct trans *t;
+  int i, busy;
+
+  if(dev != log.dev)
+    return 0;
+  busy = 0;
+  acquire(&log.lock);
+  for(t = log.trans; t < log.trans + 2 && !busy; t++){
+    if(b < FSSIZE && (t->freed[b/8] & (1 << (b%8))))
+      busy = 1;
+    for(i = 0; i < t->lh.n && !busy; i++)
+      if(t->lh.block[i] == b)
+        busy = 1;
+  }
+  for(i = 0; i < log.size && !busy; i++)
+    if(ringblock[i] == b)
+      busy = 1;
+  release(&log.lock);
+  return busy;
+}
@@ -3,6 +3,8 @@
 #include "user.h"
 #include "fs.h"
 
+#define NAMECOL 14  // width of the name column
+
 char*
 fmtname(char *path)
 {
@@ -15,10 +17,11 @@ fmtname(char *path)
   p++;
 
   // Return blank-padded name.
-  if(strlen(p) >= DIRSIZ)
+  if(strlen(p) >= NAMECOL)
     return p;
   memmove(buf, p, strlen(p));
-  memset(buf+strlen(p), ' ', DIRSIZ-strlen(p));
+  memset(buf+strlen(p), ' ', NAMECOL-strlen(p));
+  buf[NAMECOL] = 0;
   return buf;
 }
 
@@ -26,11 +26,13 @@ main(void)
   timerinit();     // programmable interval timer
   ioapicinit();    // another interrupt controller
   consoleinit();   // console hardware
+  lockstatinit();  // lock statistics device
   uartinit();      // serial port
   cprintf("xv6 kernel starting (LBA mode)...\n");
   vga_init();      // vga
   mouse_init();    // mouse
   pinit();         // process table
+  vmspaceinit();   // address spaces
   tvinit();        // trap vectors
   binit();         // buffer cache
   fileinit();      // file table
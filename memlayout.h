@@ -1,7 +1,9 @@
 // Memory layout
-#define MEMSZ 256                   // Size of memory in MB
+#define MEMSZ 1024                  // Most memory the kernel maps, in MB
 #define EXTMEM  0x100000            // Start of extended memory
 #define PHYSTOP (1024*1024*MEMSZ)   // Top physical memory
+#define E820MAP 0x8000              // BIOS memory map left by bootasm.S
+#define E820MAX 32                  // Most entries in it
 #define DEVSPACE 0xF0000000         // Other devices are at high addresses
 
 // Key addresses for address space layout (see kmap in vm.c for layout)
@@ -22,7 +22,9 @@
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+// journal header block plus a ring of up to LOGSIZE blocks,
+// or about 1/64 of the disk on small file systems.
+int nlog = (FSSIZE/64 < LOGSIZE ? FSSIZE/64 : LOGSIZE) + 1;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -40,6 +42,7 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void dirfinish(uint inum);
 
 // convert to intel byte order
 ushort
@@ -68,7 +71,7 @@ int
 main(int argc, char *argv[])
 {
   int i, cc, fd;
-  uint rootino, inum, off;
+  uint rootino, inum;
   struct dirent de;
   char buf[BSIZE];
   struct dinode din;
@@ -90,7 +93,6 @@ main(int argc, char *argv[])
     exit(1);
   }
 
-  // 1 fs block = 1 disk sector
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
   nblocks = FSSIZE - nmeta;
 
@@ -101,6 +103,8 @@ main(int argc, char *argv[])
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.magic = xint(FSMAGIC);
+  sb.version = xint(FSVERSION);
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
          nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
@@ -118,91 +122,91 @@ main(int argc, char *argv[])
   assert(rootino == ROOTINO);
 
   bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
+  de.inum = xint(rootino);
   strcpy(de.name, ".");
   iappend(rootino, &de, sizeof(de));
 
   bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
+  de.inum = xint(rootino);
   strcpy(de.name, "..");
   iappend(rootino, &de, sizeof(de));
 
   // Create /bin
   uint binino = ialloc(T_DIR);
   bzero(&de, sizeof(de));
-  de.inum = xshort(binino);
+  de.inum = xint(binino);
   strcpy(de.name, ".");
   iappend(binino, &de, sizeof(de));
 
   bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
+  de.inum = xint(rootino);
   strcpy(de.name, "..");
   iappend(binino, &de, sizeof(de));
 
   // Add bin to root
   bzero(&de, sizeof(de));
-  de.inum = xshort(binino);
+  de.inum = xint(binino);
   strcpy(de.name, "bin");
   iappend(rootino, &de, sizeof(de));
 
   // Create /home
   uint homeino = ialloc(T_DIR);
   bzero(&de, sizeof(de));
-  de.inum = xshort(homeino);
+  de.inum = xint(homeino);
   strcpy(de.name, ".");
   iappend(homeino, &de, sizeof(de));
 
   bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
+  de.inum = xint(rootino);
   strcpy(de.name, "..");
   iappend(homeino, &de, sizeof(de));
 
   // Add home to root
   bzero(&de, sizeof(de));
-  de.inum = xshort(homeino);
+  de.inum = xint(homeino);
   strcpy(de.name, "home");
   iappend(rootino, &de, sizeof(de));
 
   // Create /log
   uint logino = ialloc(T_DIR);
   bzero(&de, sizeof(de));
-  de.inum = xshort(logino);
+  de.inum = xint(logino);
   strcpy(de.name, ".");
   iappend(logino, &de, sizeof(de));
 
   bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
+  de.inum = xint(rootino);
   strcpy(de.name, "..");
   iappend(logino, &de, sizeof(de));
 
   // Add log to root
   bzero(&de, sizeof(de));
-  de.inum = xshort(logino);
+  de.inum = xint(logino);
   strcpy(de.name, "log");
   iappend(rootino, &de, sizeof(de));
 
   // Create /etc
   uint etcino = ialloc(T_DIR);
   bzero(&de, sizeof(de));
-  de.inum = xshort(etcino);
+  de.inum = xint(etcino);
   strcpy(de.name, ".");
   iappend(etcino, &de, sizeof(de));
 
   bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
+  de.inum = xint(rootino);
   strcpy(de.name, "..");
   iappend(etcino, &de, sizeof(de));
 
   // Add etc to root
   bzero(&de, sizeof(de));
-  de.inum = xshort(etcino);
+  de.inum = xint(etcino);
   strcpy(de.name, "etc");
   iappend(rootino, &de, sizeof(de));
 
   // Create /etc/passwd file with root user
   uint passwdino = ialloc(T_FILE);
   bzero(&de, sizeof(de));
-  de.inum = xshort(passwdino);
+  de.inum = xint(passwdino);
   strcpy(de.name, "passwd");
   iappend(etcino, &de, sizeof(de));
 
@@ -214,79 +218,79 @@ main(int argc, char *argv[])
   // Create /etc/services
   uint servicesino = ialloc(T_FILE);
   bzero(&de, sizeof(de));
-  de.inum = xshort(servicesino);
+  de.inum = xint(servicesino);
   strcpy(de.name, "services");
   iappend(etcino, &de, sizeof(de));
 
   // Create /root (home directory for root user)
   uint roothomeino = ialloc(T_DIR);
   bzero(&de, sizeof(de));
-  de.inum = xshort(roothomeino);
+  de.inum = xint(roothomeino);
   strcpy(de.name, ".");
   iappend(roothomeino, &de, sizeof(de));
 
   bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
+  de.inum = xint(rootino);
   strcpy(de.name, "..");
   iappend(roothomeino, &de, sizeof(de));
 
   // Add root to root directory
   bzero(&de, sizeof(de));
-  de.inum = xshort(roothomeino);
+  de.inum = xint(roothomeino);
   strcpy(de.name, "root");
   iappend(rootino, &de, sizeof(de));
 
   // Create /var
   uint varino = ialloc(T_DIR);
   bzero(&de, sizeof(de));
-  de.inum = xshort(varino);
+  de.inum = xint(varino);
   strcpy(de.name, ".");
   iappend(varino, &de, sizeof(de));
 
   bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
+  de.inum = xint(rootino);
   strcpy(de.name, "..");
   iappend(varino, &de, sizeof(de));
 
   // Add var to root
   bzero(&de, sizeof(de));
-  de.inum = xshort(varino);
+  de.inum = xint(varino);
   strcpy(de.name, "var");
   iappend(rootino, &de, sizeof(de));
 
   // Create /var/run
   uint runino = ialloc(T_DIR);
   bzero(&de, sizeof(de));
-  de.inum = xshort(runino);
+  de.inum = xint(runino);
   strcpy(de.name, ".");
   iappend(runino, &de, sizeof(de));
 
   bzero(&de, sizeof(de));
-  de.inum = xshort(varino);
+  de.inum = xint(varino);
   strcpy(de.name, "..");
   iappend(runino, &de, sizeof(de));
 
   // Add run to var
   bzero(&de, sizeof(de));
-  de.inum = xshort(runino);
+  de.inum = xint(runino);
   strcpy(de.name, "run");
   iappend(varino, &de, sizeof(de));
 
   // Create /dev
   uint devino = ialloc(T_DIR);
   bzero(&de, sizeof(de));
-  de.inum = xshort(devino);
+  de.inum = xint(devino);
   strcpy(de.name, ".");
   iappend(devino, &de, sizeof(de));
 
   bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
+  de.inum = xint(rootino);
   strcpy(de.name, "..");
   iappend(devino, &de, sizeof(de));
 
   // Add dev to root
   bzero(&de, sizeof(de));
-  de.inum = xshort(devino);
+  de.inum = xint(devino);
   strcpy(de.name, "dev");
   iappend(rootino, &de, sizeof(de));
 
@@ -298,7 +302,7 @@ main(int argc, char *argv[])
   winode(consoleino, &din);
 
   bzero(&de, sizeof(de));
-  de.inum = xshort(consoleino);
+  de.inum = xint(consoleino);
   strcpy(de.name, "console");
   iappend(devino, &de, sizeof(de));
 
@@ -310,7 +314,7 @@ main(int argc, char *argv[])
   winode(hd0ino, &din);
 
   bzero(&de, sizeof(de));
-  de.inum = xshort(hd0ino);
+  de.inum = xint(hd0ino);
   strcpy(de.name, "hd0");
   iappend(devino, &de, sizeof(de));
 
@@ -322,7 +326,7 @@ main(int argc, char *argv[])
   winode(hd1ino, &din);
 
   bzero(&de, sizeof(de));
-  de.inum = xshort(hd1ino);
+  de.inum = xint(hd1ino);
   strcpy(de.name, "hd1");
   iappend(devino, &de, sizeof(de));
 
@@ -334,61 +338,73 @@ main(int argc, char *argv[])
   winode(mouseino, &din);
 
   bzero(&de, sizeof(de));
-  de.inum = xshort(mouseino);
+  de.inum = xint(mouseino);
   strcpy(de.name, "mouse");
   iappend(devino, &de, sizeof(de));
 
+  // Create /dev/lockstat
+  uint lockstatino = ialloc(T_DEV);
+  rinode(lockstatino, &din);
+  din.major = xshort(4);
+  din.minor = xshort(0);
+  winode(lockstatino, &din);
+
+  bzero(&de, sizeof(de));
+  de.inum = xint(lockstatino);
+  strcpy(de.name, "lockstat");
+  iappend(devino, &de, sizeof(de));
+
   // Create /usr
   uint usrino = ialloc(T_DIR);
   bzero(&de, sizeof(de));
-  de.inum = xshort(usrino);
+  de.inum = xint(usrino);
   strcpy(de.name, ".");
   iappend(usrino, &de, sizeof(de));
 
   bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
+  de.inum = xint(rootino);
   strcpy(de.name, "..");
   iappend(usrino, &de, sizeof(de));
 
   // Add usr to root
   bzero(&de, sizeof(de));
-  de.inum = xshort(usrino);
+  de.inum = xint(usrino);
   strcpy(de.name, "usr");
   iappend(rootino, &de, sizeof(de));
 
   // Create /usr/include
   uint incino = ialloc(T_DIR);
   bzero(&de, sizeof(de));
-  de.inum = xshort(incino);
+  de.inum = xint(incino);
   strcpy(de.name, ".");
   iappend(incino, &de, sizeof(de));
 
   bzero(&de, sizeof(de));
-  de.inum = xshort(usrino);
+  de.inum = xint(usrino);
   strcpy(de.name, "..");
   iappend(incino, &de, sizeof(de));
 
   // Add include to usr
   bzero(&de, sizeof(de));
-  de.inum = xshort(incino);
+  de.inum = xint(incino);
   strcpy(de.name, "include");
   iappend(usrino, &de, sizeof(de));
 
   // Create /usr/lib
   uint libino = ialloc(T_DIR);
   bzero(&de, sizeof(de));
-  de.inum = xshort(libino);
+  de.inum = xint(libino);
   strcpy(de.name, ".");
   iappend(libino, &de, sizeof(de));
 
   bzero(&de, sizeof(de));
-  de.inum = xshort(usrino);
+  de.inum = xint(usrino);
   strcpy(de.name, "..");
   iappend(libino, &de, sizeof(de));
 
   // Add lib to usr
   bzero(&de, sizeof(de));
-  de.inum = xshort(libino);
+  de.inum = xint(libino);
   strcpy(de.name, "lib");
   iappend(usrino, &de, sizeof(de));
 
@@ -420,7 +436,7 @@ main(int argc, char *argv[])
     inum = ialloc(T_FILE);
 
     bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
+    de.inum = xint(inum);
     strncpy(de.name, argv[i], DIRSIZ);
     iappend(target_ino, &de, sizeof(de));
 
@@ -432,82 +448,18 @@ main(int argc, char *argv[])
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
-
-  // fix size of bin inode dir
-  rinode(binino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(binino, &din);
-
-  // fix size of usr inode dir
-  rinode(usrino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(usrino, &din);
-
-  // fix size of include inode dir
-  rinode(incino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(incino, &din);
-
-  // fix size of lib inode dir
-  rinode(libino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(libino, &din);
-
-  // fix size of log inode dir
-  rinode(logino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(logino, &din);
-
-  // fix size of etc inode dir
-  rinode(etcino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(etcino, &din);
-
-  // fix size of root home inode dir
-  rinode(roothomeino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(roothomeino, &din);
-
-  // fix size of var inode dir
-  rinode(varino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(varino, &din);
-
-  // fix size of run inode dir
-  rinode(runino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(runino, &din);
-
-  // fix size of dev inode dir
-  rinode(devino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(devino, &din);
+  // index large directories, and fix size of the rest
+  dirfinish(rootino);
+  dirfinish(binino);
+  dirfinish(usrino);
+  dirfinish(incino);
+  dirfinish(libino);
+  dirfinish(logino);
+  dirfinish(etcino);
+  dirfinish(roothomeino);
+  dirfinish(varino);
+  dirfinish(runino);
+  dirfinish(devino);
 
   balloc(freeblock);
 
@@ -605,6 +557,63 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the disk block of block fbn of inode din, allocating
+// it if fbn is just past the end. Files are written one at a
+// time from freeblock on, so their blocks are contiguous and
+// most files need a single extent.
+uint
+emap(struct dinode *din, uint fbn)
+{
+  struct extent iext[NIEXTENT];
+  struct extent *e;
+  uint i, nd, ni;
+
+  for(nd = 0; nd < NEXTENT && xint(din->ext[nd].len) > 0; nd++){
+    e = &din->ext[nd];
+    if(fbn < xint(e->len))
+      return xint(e->start) + fbn;
+    fbn -= xint(e->len);
+  }
+  ni = 0;
+  if(xint(din->ext[NEXTENT].start) != 0){
+    rsect(xint(din->ext[NEXTENT].start), (char*)iext);
+    ni = xint(din->ext[NEXTENT].len);
+    for(i = 0; i < ni; i++){
+      if(fbn < xint(iext[i].len))
+        return xint(iext[i].start) + fbn;
+      fbn -= xint(iext[i].len);
+    }
+  }
+  assert(fbn == 0);
+
+  // Grow the last extent, or start a new one.
+  if(ni > 0)
+    e = &iext[ni-1];
+  else if(nd > 0)
+    e = &din->ext[nd-1];
+  else
+    e = 0;
+  if(e == 0 || xint(e->start) + xint(e->len) != freeblock){
+    if(nd < NEXTENT)
+      e = &din->ext[nd];
+    else {
+      if(ni == 0){
+        din->ext[NEXTENT].start = xint(freeblock++);
+        bzero(iext, sizeof(iext));
+      }
+      assert(ni < NIEXTENT);
+      e = &iext[ni++];
+      din->ext[NEXTENT].len = xint(ni);
+    }
+    e->start = xint(freeblock);
+    e->len = xint(0);
+  }
+  e->len = xint(xint(e->len) + 1);
+  if(ni > 0)
+    wsect(xint(din->ext[NEXTENT].start), (char*)iext);
+  return freeblock++;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -612,7 +621,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -621,38 +629,7 @@ iappend(uint inum, void *xp, int n)
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else if(fbn < NDIRECT + NINDIRECT){
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    } else {
-      if(xint(din.addrs[NDIRECT+1]) == 0){
-        din.addrs[NDIRECT+1] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT+1]), (char*)indirect);
-      if(indirect[(fbn - NDIRECT - NINDIRECT) / NINDIRECT] == 0){
-        indirect[(fbn - NDIRECT - NINDIRECT) / NINDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT+1]), (char*)indirect);
-      }
-      x = xint(indirect[(fbn - NDIRECT - NINDIRECT) / NINDIRECT]);
-      rsect(x, (char*)indirect);
-      if(indirect[(fbn - NDIRECT - NINDIRECT) % NINDIRECT] == 0){
-        indirect[(fbn - NDIRECT - NINDIRECT) % NINDIRECT] = xint(freeblock++);
-        wsect(x, (char*)indirect);
-      }
-      x = xint(indirect[(fbn - NDIRECT - NINDIRECT) % NINDIRECT]);
-    }
+    x = emap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -664,3 +641,122 @@ iappend(uint inum, void *xp, int n)
   din.size = xint(off);
   winode(inum, &din);
 }
+
+// Same hash as the kernel's dxhash().
+uint
+dxhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 2166136261U;
+  for(i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619U;
+  }
+  return h;
+}
+
+struct dxname {
+  uint hash;
+  struct dirent de;
+};
+
+int
+dxcmp(const void *a, const void *b)
+{
+  uint x = ((struct dxname*)a)->hash, y = ((struct dxname*)b)->hash;
+
+  return x < y ? -1 : x > y;
+}
+
+// Rewrite directory inum, which is more than a block, as a
+// hashed directory (see struct dxroot in fs.h). Blocks are
+// filled to 3/4 so that the kernel can add names to them
+// before it has to split one.
+void
+dxbuild(uint inum)
+{
+  static struct dxroot root;
+  struct dinode din;
+  struct dirent *de;
+  struct dxname *names;
+  char *old, *leaves;
+  uint size, nold, nleaf, n, i, k, j, blk;
+
+  rinode(inum, &din);
+  size = xint(din.size);
+  nold = (size + BSIZE - 1) / BSIZE;
+  old = calloc(nold, BSIZE);
+  for(blk = 0; blk < nold; blk++)
+    rsect(emap(&din, blk), old + blk*BSIZE);
+  de = (struct dirent*)old;
+
+  // Everything but "." and "..", sorted by hash.
+  names = calloc(size / sizeof(*de), sizeof(*names));
+  n = 0;
+  for(i = 2; i < size / sizeof(*de); i++){
+    if(de[i].inum == 0)
+      continue;
+    names[n].hash = dxhash(de[i].name);
+    names[n++].de = de[i];
+  }
+  qsort(names, n, sizeof(*names), dxcmp);
+
+  leaves = calloc(n / (DPB/2) + 1, BSIZE);
+  memmove(leaves, de, 2*sizeof(*de));
+  memset(&root, 0, sizeof(root));
+  root.magic = xint(DXMAGIC);
+  root.count = xint(1);
+  blk = 0;
+  j = 2;
+  for(i = 0; i < n; i = k){
+    // Names with equal hashes go in the same block.
+    for(k = i; k < n && names[k].hash == names[i].hash; k++)
+      ;
+    assert(k - i <= DPB);
+    if(j + (k - i) > DPB*3/4 && j > (blk == 0 ? 2 : 0)){
+      blk++;
+      j = 0;
+      assert(blk < NDXENTRY);
+      root.e[blk].hash = xint(names[i].hash);
+      root.e[blk].block = xint(blk);
+      root.count = xint(blk + 1);
+    }
+    for(; i < k; i++)
+      ((struct dirent*)(leaves + blk*BSIZE))[j++] = names[i].de;
+  }
+  nleaf = blk + 1;
+
+  // Reuse the directory's blocks, zeroing any left over,
+  // and append more if needed.
+  for(blk = 0; blk < nold; blk++)
+    wsect(emap(&din, blk), blk < nleaf ? leaves + blk*BSIZE : zeroes);
+  din.size = xint(nold*BSIZE);
+  din.index = xint(freeblock++);
+  wsect(xint(din.index), &root);
+  winode(inum, &din);
+  for(blk = nold; blk < nleaf; blk++)
+    iappend(inum, leaves + blk*BSIZE, BSIZE);
+
+  free(old);
+  free(names);
+  free(leaves);
+}
+
+// Finish directory inum once all its entries are in: give it
+// a hash index if it has outgrown a block, else make it a
+// full block so that there is room to add names.
+void
+dirfinish(uint inum)
+{
+  struct dinode din;
+
+  rinode(inum, &din);
+  if(xint(din.size) > BSIZE){
+    dxbuild(inum);
+    return;
+  }
+  din.size = xint(BSIZE);
+  winode(inum, &din);
+}
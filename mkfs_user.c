@@ -7,12 +7,17 @@
 
 #define NINODES 200
 
+// Block buffers are static: a block is as big as the
+// one-page user stack.
+
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+// journal header block plus a ring of up to LOGSIZE blocks,
+// or about 1/64 of the disk on small file systems.
+int nlog = (FSSIZE/64 < LOGSIZE ? FSSIZE/64 : LOGSIZE) + 1;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -49,7 +54,7 @@ main(int argc, char *argv[])
   int i, cc, fd;
   uint rootino, inum, off;
   struct dirent de;
-  char buf[BSIZE];
+  static char buf[BSIZE];
   struct dinode din;
 
   if(argc < 2){
@@ -63,7 +68,6 @@ main(int argc, char *argv[])
     exit();
   }
 
-  // 1 fs block = 1 disk sector
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
   nblocks = FSSIZE - nmeta;
 
@@ -74,6 +78,8 @@ main(int argc, char *argv[])
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.magic = xint(FSMAGIC);
+  sb.version = xint(FSVERSION);
 
   printf(1, "nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
          nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
@@ -90,66 +96,66 @@ main(int argc, char *argv[])
   rootino = ialloc(T_DIR);
 
   memset(&de, 0, sizeof(de));
-  de.inum = xshort(rootino);
+  de.inum = xint(rootino);
   strcpy(de.name, ".");
   iappend(rootino, &de, sizeof(de));
 
   memset(&de, 0, sizeof(de));
-  de.inum = xshort(rootino);
+  de.inum = xint(rootino);
   strcpy(de.name, "..");
   iappend(rootino, &de, sizeof(de));
 
   // Create /bin
   uint binino = ialloc(T_DIR);
   memset(&de, 0, sizeof(de));
-  de.inum = xshort(binino);
+  de.inum = xint(binino);
   strcpy(de.name, ".");
   iappend(binino, &de, sizeof(de));
 
   memset(&de, 0, sizeof(de));
-  de.inum = xshort(rootino);
+  de.inum = xint(rootino);
   strcpy(de.name, "..");
   iappend(binino, &de, sizeof(de));
 
   // Add bin to root
   memset(&de, 0, sizeof(de));
-  de.inum = xshort(binino);
+  de.inum = xint(binino);
   strcpy(de.name, "bin");
   iappend(rootino, &de, sizeof(de));
 
   // Create /log
   uint logino = ialloc(T_DIR);
   memset(&de, 0, sizeof(de));
-  de.inum = xshort(logino);
+  de.inum = xint(logino);
   strcpy(de.name, ".");
   iappend(logino, &de, sizeof(de));
 
   memset(&de, 0, sizeof(de));
-  de.inum = xshort(rootino);
+  de.inum = xint(rootino);
   strcpy(de.name, "..");
   iappend(logino, &de, sizeof(de));
 
   // Add log to root
   memset(&de, 0, sizeof(de));
-  de.inum = xshort(logino);
+  de.inum = xint(logino);
   strcpy(de.name, "log");
   iappend(rootino, &de, sizeof(de));
 
   // Create /dev
   uint devino = ialloc(T_DIR);
   memset(&de, 0, sizeof(de));
-  de.inum = xshort(devino);
+  de.inum = xint(devino);
   strcpy(de.name, ".");
   iappend(devino, &de, sizeof(de));
 
   memset(&de, 0, sizeof(de));
-  de.inum = xshort(rootino);
+  de.inum = xint(rootino);
   strcpy(de.name, "..");
   iappend(devino, &de, sizeof(de));
 
   // Add dev to root
   memset(&de, 0, sizeof(de));
-  de.inum = xshort(devino);
+  de.inum = xint(devino);
   strcpy(de.name, "dev");
   iappend(rootino, &de, sizeof(de));
 
@@ -161,7 +167,7 @@ main(int argc, char *argv[])
   winode(consoleino, &din);
 
   memset(&de, 0, sizeof(de));
-  de.inum = xshort(consoleino);
+  de.inum = xint(consoleino);
   strcpy(de.name, "console");
   iappend(devino, &de, sizeof(de));
 
@@ -173,7 +179,7 @@ main(int argc, char *argv[])
   winode(hd0ino, &din);
 
   memset(&de, 0, sizeof(de));
-  de.inum = xshort(hd0ino);
+  de.inum = xint(hd0ino);
   strcpy(de.name, "hd0");
   iappend(devino, &de, sizeof(de));
 
@@ -185,7 +191,7 @@ main(int argc, char *argv[])
   winode(hd1ino, &din);
 
   memset(&de, 0, sizeof(de));
-  de.inum = xshort(hd1ino);
+  de.inum = xint(hd1ino);
   strcpy(de.name, "hd1");
   iappend(devino, &de, sizeof(de));
 
@@ -209,7 +215,7 @@ main(int argc, char *argv[])
     inum = ialloc(T_FILE);
 
     memset(&de, 0, sizeof(de));
-    de.inum = xshort(inum);
+    de.inum = xint(inum);
     strcpy(de.name, name);
     iappend(target_ino, &de, sizeof(de));
 
@@ -261,7 +267,7 @@ wsect(uint sec, void *buf)
 void
 winode(uint inum, struct dinode *ip)
 {
-  char buf[BSIZE];
+  static char buf[BSIZE];
   uint bn;
   struct dinode *dip;
 
@@ -275,7 +281,7 @@ winode(uint inum, struct dinode *ip)
 void
 rinode(uint inum, struct dinode *ip)
 {
-  char buf[BSIZE];
+  static char buf[BSIZE];
   uint bn;
   struct dinode *dip;
 
@@ -318,7 +324,7 @@ ialloc(ushort type)
 void
 balloc(int used)
 {
-  uchar buf[BSIZE];
+  static uchar buf[BSIZE];
   int i;
 
   printf(1, "balloc: first %d blocks have been allocated\n", used);
@@ -332,52 +338,79 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the disk block of block fbn of inode din, allocating
+// it if fbn is just past the end. Files are written one at a
+// time from freeblock on, so their blocks are contiguous and
+// most files need a single extent.
+uint
+emap(struct dinode *din, uint fbn)
+{
+  static struct extent iext[NIEXTENT];
+  struct extent *e;
+  uint i, nd, ni;
+
+  for(nd = 0; nd < NEXTENT && xint(din->ext[nd].len) > 0; nd++){
+    e = &din->ext[nd];
+    if(fbn < xint(e->len))
+      return xint(e->start) + fbn;
+    fbn -= xint(e->len);
+  }
+  ni = 0;
+  if(xint(din->ext[NEXTENT].start) != 0){
+    rsect(xint(din->ext[NEXTENT].start), (char*)iext);
+    ni = xint(din->ext[NEXTENT].len);
+    for(i = 0; i < ni; i++){
+      if(fbn < xint(iext[i].len))
+        return xint(iext[i].start) + fbn;
+      fbn -= xint(iext[i].len);
+    }
+  }
+
+  // Grow the last extent, or start a new one.
+  if(ni > 0)
+    e = &iext[ni-1];
+  else if(nd > 0)
+    e = &din->ext[nd-1];
+  else
+    e = 0;
+  if(e == 0 || xint(e->start) + xint(e->len) != freeblock){
+    if(nd < NEXTENT)
+      e = &din->ext[nd];
+    else {
+      if(ni == 0){
+        din->ext[NEXTENT].start = xint(freeblock++);
+        memset(iext, 0, sizeof(iext));
+      }
+      if(ni == NIEXTENT){
+        printf(2, "mkfs: file too fragmented\n");
+        exit();
+      }
+      e = &iext[ni++];
+      din->ext[NEXTENT].len = xint(ni);
+    }
+    e->start = xint(freeblock);
+    e->len = xint(0);
+  }
+  e->len = xint(xint(e->len) + 1);
+  if(ni > 0)
+    wsect(xint(din->ext[NEXTENT].start), (char*)iext);
+  return freeblock++;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
   char *p = (char*)xp;
   uint fbn, off, n1;
   struct dinode din;
-  char buf[BSIZE];
-  uint indirect[NINDIRECT];
+  static char buf[BSIZE];
   uint x;
 
   rinode(inum, &din);
   off = xint(din.size);
   while(n > 0){
     fbn = off / BSIZE;
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else if(fbn < NDIRECT + NINDIRECT){
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    } else {
-      if(xint(din.addrs[NDIRECT+1]) == 0){
-        din.addrs[NDIRECT+1] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT+1]), (char*)indirect);
-      if(indirect[(fbn - NDIRECT - NINDIRECT) / NINDIRECT] == 0){
-        indirect[(fbn - NDIRECT - NINDIRECT) / NINDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT+1]), (char*)indirect);
-      }
-      x = xint(indirect[(fbn - NDIRECT - NINDIRECT) / NINDIRECT]);
-      rsect(x, (char*)indirect);
-      if(indirect[(fbn - NDIRECT - NINDIRECT) % NINDIRECT] == 0){
-        indirect[(fbn - NDIRECT - NINDIRECT) % NINDIRECT] = xint(freeblock++);
-        wsect(x, (char*)indirect);
-      }
-      x = xint(indirect[(fbn - NDIRECT - NINDIRECT) % NINDIRECT]);
-    }
+    x = emap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     memmove(buf + off - (fbn * BSIZE), p, n1);
@@ -0,0 +1,529 @@
+// Memory-mapped files and anonymous memory.
+//
+// mmap() only records a region in the process's vma table.
+// Pages are allocated when first touched, by vmfault() from
+// the page fault handler; pages of a file are filled from the
+// buffer cache with readi(). exec() maps the program's
+// segments the same way, as VMA_IMAGE regions below sz.
+// fork() shares a MAP_PRIVATE page copy-on-write, and a
+// MAP_SHARED page as it is, so that parent and child see each
+// other's writes to it. There is no page cache, though: a page
+// faulted in after the fork, or by an unrelated process, is a
+// copy of its own. The pages a process has written (PTE_D) are
+// written back to the file when they are unmapped, by munmap()
+// or when exec() or exit() frees the address space
+// (vmspaceput).
+//
+// Mappings are placed top-down from KERNBASE, above the heap;
+// growproc() does not let the heap grow into them.
+//
+// Since pages appear on demand, system calls must not touch
+// user memory without checking it with vmacheck() first (as
+// argptr() and fetchstr() do), which faults the pages in.
+// Another thread may still unmap them, or fork() make them
+// copy-on-write, before the system call touches them; trap()
+// then faults them in again, which may sleep, so the kernel
+// must not touch user memory while it holds a spin lock.
+//
+// The regions, sz and page table belong to a struct vmspace,
+// which the threads of a process share. Faults and changes to
+// it are made with vmlock() held, and pages unmapped or made
+// read-only are flushed from the TLBs of the other CPUs
+// running its threads (vmflush).
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "stat.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "x86.h"
+#include "proc.h"
+#include "fs.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+
+#define UNMAPBATCH 32  // pages vmaunmap() frees per TLB flush
+
+struct {
+  struct spinlock lock;
+  struct vmspace vm[NPROC];
+} vmspaces;
+
+static void vmadrop(struct vma*);
+static void vmaunmap(struct vmspace*, struct vma*, uint, uint);
+
+void
+vmspaceinit(void)
+{
+  initlock(&vmspaces.lock, "vmspaces");
+}
+
+// Allocate an address space with page table pgdir, which it
+// takes over, no regions and a reference count of one.
+// Returns 0 if there is none.
+struct vmspace*
+vmspacealloc(pde_t *pgdir)
+{
+  struct vmspace *vm;
+
+  acquire(&vmspaces.lock);
+  for(vm = vmspaces.vm; vm < &vmspaces.vm[NPROC]; vm++)
+    if(vm->ref == 0)
+      goto found;
+  release(&vmspaces.lock);
+  return 0;
+
+found:
+  vm->ref = 1;
+  release(&vmspaces.lock);
+  vm->pgdir = pgdir;
+  vm->locked = 0;
+  vm->sz = 0;
+  memset(vm->vma, 0, sizeof(vm->vma));
+  return vm;
+}
+
+// Add a reference to vm, for a new thread.
+struct vmspace*
+vmspacedup(struct vmspace *vm)
+{
+  acquire(&vmspaces.lock);
+  vm->ref++;
+  release(&vmspaces.lock);
+  return vm;
+}
+
+// Drop a reference to vm. The last one unmaps its regions,
+// writing shared file pages back, and frees its memory.
+// The caller must not be running on vm's page table.
+void
+vmspaceput(struct vmspace *vm)
+{
+  struct vma *v;
+
+  acquire(&vmspaces.lock);
+  if(vm->ref > 1){
+    vm->ref--;
+    release(&vmspaces.lock);
+    return;
+  }
+  release(&vmspaces.lock);
+
+  // No one else can reach vm now.
+  for(v = vm->vma; v < &vm->vma[NVMA]; v++){
+    if(v->end && !(v->flags & VMA_IMAGE))
+      vmaunmap(vm, v, v->start, v->end);
+    if(v->end)
+      vmadrop(v);
+  }
+  freevm(vm->pgdir);
+  vm->pgdir = 0;
+
+  acquire(&vmspaces.lock);
+  vm->ref = 0;
+  release(&vmspaces.lock);
+}
+
+// Lock vm against faults and changes by other threads.
+// Sleeps, so the caller must not hold spinlocks.
+void
+vmlock(struct vmspace *vm)
+{
+  acquire(&vmspaces.lock);
+  while(vm->locked)
+    sleep(vm, &vmspaces.lock);
+  vm->locked = 1;
+  release(&vmspaces.lock);
+}
+
+void
+vmunlock(struct vmspace *vm)
+{
+  acquire(&vmspaces.lock);
+  vm->locked = 0;
+  wakeup(vm);
+  release(&vmspaces.lock);
+}
+
+// Return the region of vm containing va, or 0.
+static struct vma*
+vmafind(struct vmspace *vm, uint va)
+{
+  struct vma *v;
+
+  for(v = vm->vma; v < &vm->vma[NVMA]; v++)
+    if(v->start <= va && va < v->end)
+      return v;
+  return 0;
+}
+
+// Lowest mapped address of vm: the heap may grow up to here.
+uint
+mmapbase(struct vmspace *vm)
+{
+  struct vma *v;
+  uint base;
+
+  base = KERNBASE;
+  for(v = vm->vma; v < &vm->vma[NVMA]; v++)
+    if(v->end && !(v->flags & VMA_IMAGE) && v->start < base)
+      base = v->start;
+  return base;
+}
+
+// Release v's inode and free the slot.
+static void
+vmadrop(struct vma *v)
+{
+  if(v->ip){
+    begin_op();
+    iput(v->ip);
+    end_op();
+  }
+  memset(v, 0, sizeof(*v));
+}
+
+// Find len bytes of unmapped address space above the heap,
+// as high as possible. Returns 0 if there are none.
+static uint
+vmaplace(struct vmspace *vm, uint len)
+{
+  struct vma *v;
+  uint top, a;
+
+  top = KERNBASE;
+  for(;;){
+    if(top < len || top - len < PGROUNDUP(vm->sz))
+      return 0;
+    a = top - len;
+    for(v = vm->vma; v < &vm->vma[NVMA]; v++)
+      if(v->end && v->start < top && a < v->end)
+        break;
+    if(v == &vm->vma[NVMA])
+      return a;
+    top = v->start;
+  }
+}
+
+// Map len bytes of f from offset off, or anonymous memory if
+// f is 0, into the current process.
+// Returns the address of the mapping, or 0 on failure.
+uint
+mmap(struct file *f, uint len, int prot, int flags, uint off)
+{
+  struct vmspace *vm = myproc()->vm;
+  struct vma *v, *slot;
+  uint a;
+
+  if(len == 0 || off % PGSIZE != 0)
+    return 0;
+  if((flags & (MAP_SHARED|MAP_PRIVATE)) == 0 ||
+     (flags & (MAP_SHARED|MAP_PRIVATE)) == (MAP_SHARED|MAP_PRIVATE))
+    return 0;
+  if(f){
+    if(f->type != FD_INODE || f->ip->type != T_FILE || !f->readable)
+      return 0;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return 0;
+  }
+  len = PGROUNDUP(len);
+
+  vmlock(vm);
+  slot = 0;
+  for(v = vm->vma; v < &vm->vma[NVMA]; v++)
+    if(v->end == 0){
+      slot = v;
+      break;
+    }
+  if(slot == 0 || (a = vmaplace(vm, len)) == 0){
+    vmunlock(vm);
+    return 0;
+  }
+  slot->start = a;
+  slot->end = a + len;
+  slot->prot = prot;
+  slot->flags = flags;
+  slot->ip = f ? idup(f->ip) : 0;
+  slot->off = off;
+  slot->filesz = len;
+  vmunlock(vm);
+  return a;
+}
+
+// Handle a page fault at va in vm: copy a copy-on-write page
+// on a write, or, if va is in a mapped region that allows the
+// access, allocate and fill its page. Another thread may have
+// done so already. write is non-zero for a write fault.
+// Caller must hold vmlock(vm).
+// Returns 0 on success, -1 if the fault is an error.
+static int
+fault(struct vmspace *vm, uint va, int write)
+{
+  struct vma *v;
+  pte_t *pte;
+  char *mem;
+  uint n;
+  int perm;
+
+  pte = walkpgdir(vm->pgdir, (char*)va, 0);
+  if(write && pte && (*pte & PTE_P) && (*pte & PTE_COW)){
+    if(cowfault(vm->pgdir, va) < 0)
+      return -1;
+    vmflush(vm);  // other threads may have the old page
+    return 0;
+  }
+  if(pte && (*pte & PTE_P) && (!write || (*pte & PTE_W)))
+    return 0;  // another thread's fault brought it in
+  if((v = vmafind(vm, va)) == 0)
+    return -1;
+  if((v->prot & (PROT_READ|PROT_WRITE)) == 0)
+    return -1;
+  if(write && (v->prot & PROT_WRITE) == 0)
+    return -1;
+  va = PGROUNDDOWN(va);
+  if(pte && (*pte & PTE_P))
+    return -1;  // present, so a protection violation
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  if(v->ip && va - v->start < v->filesz){
+    // Past filesz or the end of the file the page stays zero.
+    n = v->filesz - (va - v->start);
+    if(n > PGSIZE)
+      n = PGSIZE;
+    ilock(v->ip);
+    readi(v->ip, mem, v->off + (va - v->start), n);
+    iunlock(v->ip);
+  }
+  perm = PTE_U;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_W;
+  if(mappages(vm->pgdir, (char*)va, PGSIZE, V2P(mem), perm) < 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Handle a page fault at va in the current process; see fault().
+int
+vmfault(uint va, int write)
+{
+  struct vmspace *vm = myproc()->vm;
+  int r;
+
+  if(vm == 0)
+    return -1;
+  vmlock(vm);
+  r = fault(vm, va, write);
+  vmunlock(vm);
+  return r;
+}
+
+// The kernel faulted on user address va in a system call and
+// vmfault() could not fix it: since vmacheck() passed va,
+// another thread has unmapped it or taken away write access.
+// Kill the process, and give va a private zeroed page so that
+// the system call can finish before its threads exit.
+void
+vmkill(uint va)
+{
+  struct vmspace *vm = myproc()->vm;
+  pte_t *pte;
+  char *mem;
+
+  myproc()->killed = 1;
+  killthreads(vm);
+  if((mem = kalloc()) == 0)
+    panic("vmkill: out of memory");
+  memset(mem, 0, PGSIZE);
+  vmlock(vm);
+  if((pte = walkpgdir(vm->pgdir, (char*)PGROUNDDOWN(va), 1)) == 0)
+    panic("vmkill: out of memory");
+  if(*pte & PTE_P)
+    kfree(P2V(PTE_ADDR(*pte)));
+  *pte = V2P(mem) | PTE_P | PTE_W | PTE_U;
+  vmflush(vm);
+  vmunlock(vm);
+}
+
+// Check that a system call may read [addr, addr+len) of the
+// current process, or write it if write is set: it must lie
+// below sz or in one mapped region that allows the access.
+// Its pages are faulted in, and for a write copied if they
+// are copy-on-write, now, so that the kernel never takes a
+// page fault on user memory.
+// Returns 0 if so, -1 if not.
+int
+vmacheck(uint addr, uint len, int write)
+{
+  struct vmspace *vm = myproc()->vm;
+  struct vma *v;
+  pte_t *pte;
+  uint a;
+
+  if(addr + len < addr)
+    return -1;
+  vmlock(vm);
+  if(addr >= vm->sz || addr + len > vm->sz){
+    if((v = vmafind(vm, addr)) == 0 || addr + len > v->end)
+      goto bad;
+    if((v->prot & (PROT_READ|PROT_WRITE)) == 0)
+      goto bad;
+    if(write && (v->prot & PROT_WRITE) == 0)
+      goto bad;
+  }
+  for(a = PGROUNDDOWN(addr); a < addr + len; a += PGSIZE){
+    pte = walkpgdir(vm->pgdir, (char*)a, 0);
+    if(pte && (*pte & PTE_P) && !(write && (*pte & PTE_COW)))
+      continue;
+    if(fault(vm, a, write) < 0)
+      goto bad;
+  }
+  vmunlock(vm);
+  return 0;
+
+bad:
+  vmunlock(vm);
+  return -1;
+}
+
+// Write the dirty pages of v in [start, end) back to its file,
+// if it is a shared file mapping, and free all its pages there.
+static void
+vmaunmap(struct vmspace *vm, struct vma *v, uint start, uint end)
+{
+  struct inode *ip;
+  pte_t *pte;
+  uint a, off, n;
+  char *mem, *freed[UNMAPBATCH];
+  int nfreed, i;
+
+  nfreed = 0;
+  for(a = start; a < end; a += PGSIZE){
+    pte = walkpgdir(vm->pgdir, (char*)a, 0);
+    if(pte == 0 || (*pte & PTE_P) == 0)
+      continue;
+    mem = P2V(PTE_ADDR(*pte));
+    if(v->ip && (v->flags & MAP_SHARED) && (*pte & PTE_D)){
+      ip = v->ip;
+      off = v->off + (a - v->start);
+      begin_op();
+      ilock(ip);
+      // Never grow the file.
+      if(off < ip->size){
+        n = ip->size - off;
+        if(n > PGSIZE)
+          n = PGSIZE;
+        writei(ip, mem, off, n);
+      }
+      iunlock(ip);
+      end_op();
+    }
+    // Free pages only once no TLB maps them, a batch at a
+    // time, so that no thread writes a freed page.
+    *pte = 0;
+    freed[nfreed++] = mem;
+    if(nfreed == UNMAPBATCH){
+      vmflush(vm);
+      for(i = 0; i < nfreed; i++)
+        kfree(freed[i]);
+      nfreed = 0;
+    }
+  }
+  if(nfreed){
+    vmflush(vm);
+    for(i = 0; i < nfreed; i++)
+      kfree(freed[i]);
+  }
+}
+
+// Unmap [addr, addr+len) in the current process. Regions
+// partly in the range shrink; one that the range splits in
+// two needs a free vma slot. The program image stays.
+// Returns 0 on success, -1 on failure.
+int
+munmap(uint addr, uint len)
+{
+  struct vmspace *vm = myproc()->vm;
+  struct vma *v, *nv;
+  uint start, end;
+
+  if(addr % PGSIZE != 0 || len == 0 || addr + len < addr)
+    return -1;
+  len = PGROUNDUP(len);
+  vmlock(vm);
+  for(v = vm->vma; v < &vm->vma[NVMA]; v++){
+    if(v->end == 0 || v->end <= addr || addr + len <= v->start)
+      continue;
+    if(v->flags & VMA_IMAGE)
+      continue;
+    start = addr > v->start ? addr : v->start;
+    end = addr + len < v->end ? addr + len : v->end;
+    if(start > v->start && end < v->end){
+      // Split: the part above the hole goes to a new slot.
+      for(nv = vm->vma; nv < &vm->vma[NVMA]; nv++)
+        if(nv->end == 0)
+          break;
+      if(nv == &vm->vma[NVMA]){
+        vmunlock(vm);
+        return -1;
+      }
+      *nv = *v;
+      nv->start = end;
+      nv->off = v->off + (end - v->start);
+      nv->filesz = nv->end - nv->start;
+      if(nv->ip)
+        idup(nv->ip);
+      v->end = end;
+    }
+    vmaunmap(vm, v, start, end);
+    if(start == v->start && end == v->end){
+      vmadrop(v);
+    } else if(start == v->start){
+      v->off += end - v->start;
+      v->filesz -= end - v->start;
+      v->start = end;
+    } else {
+      v->end = start;
+      v->filesz = v->end - v->start;
+    }
+  }
+  vmunlock(vm);
+  return 0;
+}
+
+// Give nvm copies of vm's regions and share their pages, those
+// of MAP_PRIVATE regions copy-on-write, except the image's,
+// which copyuvm() shares.
+// Caller must hold vmlock(vm) and flush vm's TLBs.
+// Returns 0 on success, -1 on failure (nvm then has none).
+int
+vmacopy(struct vmspace *nvm, struct vmspace *vm)
+{
+  struct vma *v, *nv;
+
+  for(v = vm->vma, nv = nvm->vma; v < &vm->vma[NVMA]; v++, nv++){
+    *nv = *v;
+    if(v->end == 0)
+      continue;
+    if(nv->ip)
+      idup(nv->ip);
+    if(v->flags & VMA_IMAGE)
+      continue;
+    if(uvmshare(nvm->pgdir, vm->pgdir, v->start, v->end,
+                !(v->flags & MAP_SHARED)) < 0)
+      goto bad;
+  }
+  return 0;
+
+bad:
+  // The caller's freevm() drops the pages shared so far.
+  for(v = nvm->vma; v <= nv; v++)
+    vmadrop(v);
+  return -1;
+}
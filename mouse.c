@@ -91,10 +91,17 @@ mouseintr(void)
   release(&mouseq.lock);
 }
 
+// Gathers the bytes in buf and copies them out to the user
+// without mouseq.lock (see trap).
 int
 mouseread(struct inode *ip, char *dst, int n, int off)
 {
-  int target = n;
+  uchar buf[sizeof(mouseq.buf)];
+  int target;
+
+  if(n > sizeof(buf))
+    n = sizeof(buf);
+  target = n;
   acquire(&mouseq.lock);
   while(n > 0){
     while(mouseq.r == mouseq.w){
@@ -104,9 +111,10 @@ mouseread(struct inode *ip, char *dst, int n, int off)
       }
       sleep(&mouseq.r, &mouseq.lock);
     }
-    *dst++ = mouseq.buf[mouseq.r++ % sizeof(mouseq.buf)];
+    buf[target - n] = mouseq.buf[mouseq.r++ % sizeof(mouseq.buf)];
     n--;
   }
   release(&mouseq.lock);
+  memmove(dst, buf, target - n);
   return target - n;
 }
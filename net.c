@@ -151,6 +151,16 @@ void arp_rx(struct mbuf *m) {
 // Socket table (defined here for use in icmp_rx)
 #define MAX_SOCKETS 16
 extern struct socket sockets[MAX_SOCKETS];
+extern struct rwlock socklock;
+
+// Wake the processes waiting on sock, after its rxq or state
+// changed. Taking sock->lock orders this after any waiter's
+// check of them.
+static void sockwake(struct socket *sock) {
+  acquire(&sock->lock);
+  wqwakeup(&sock->wq);
+  release(&sock->lock);
+}
 
 void icmp_rx(struct mbuf *m) {
   struct icmp *icmpheader;
@@ -186,6 +196,7 @@ void icmp_rx(struct mbuf *m) {
           if (sockets[i].rxq)
             mbuffree(sockets[i].rxq);
           sockets[i].rxq = m;
+          sockwake(&sockets[i]);
           cprintf("Queued ICMP reply to socket %d\n", i);
           return; // Don't free m
         }
@@ -267,7 +278,10 @@ void ip_rx(struct mbuf *m) {
   
   mbufpull(m, sizeof(struct ip)); // Advance to transport header
   
-  // Dispatch based on protocol
+  // Dispatch based on protocol. The receivers look up and
+  // fill in sockets, which must not be opened or closed
+  // meanwhile; packets for other sockets may arrive at once.
+  racquire(&socklock);
   if (iphdr->p == IP_PROTO_ICMP) {
     icmp_rx(m);
   } else if (iphdr->p == IP_PROTO_UDP) {
@@ -277,6 +291,7 @@ void ip_rx(struct mbuf *m) {
   } else {
     mbuffree(m);
   }
+  rrelease(&socklock);
 }
 
 void icmp_send(uint dip, ushort id, ushort seq, char *data, int len) {
@@ -326,16 +341,21 @@ void icmp_send(uint dip, ushort id, ushort seq, char *data, int len) {
   e1000_transmit(m);
 }
 
-// Socket table
+// Socket table. sys_socket() and sys_close_socket() change
+// used holding socklock for writing, ip_rx() reads it.
 struct socket sockets[MAX_SOCKETS];
+struct rwlock socklock;
 
 uint tcp_seq = 1000; // Global sequence number
 
 void socket_init(void) {
   int i;
+  initrwlock(&socklock, "sockets");
   for (i = 0; i < MAX_SOCKETS; i++) {
     sockets[i].used = 0;
     sockets[i].state = TCP_CLOSED;
+    initlock(&sockets[i].lock, "socket");
+    initwaitq(&sockets[i].wq, "socket");
   }
 }
 
@@ -482,6 +502,7 @@ void tcp_rx(struct mbuf *m) {
             sock->irs = seq;
             sock->snd_una = ack;
             sock->state = TCP_ESTABLISHED;
+            sockwake(sock);
             tcp_send(sock, TCP_ACK, 0, 0);
           } else if (flags & TCP_SYN) {
             sock->rcv_nxt = seq + 1;
@@ -516,6 +537,7 @@ void tcp_rx(struct mbuf *m) {
                 mbuffree(sock->rxq);
               sock->rxq = m;
               sock->rcv_nxt += data_len;
+              sockwake(sock);
               
               // Send ACK
               tcp_send(sock, TCP_ACK, 0, 0);
@@ -607,6 +629,7 @@ void udp_rx(struct mbuf *m) {
       sockets[i].rxq = m;
       sockets[i].remote_ip = iphdr->src;
       sockets[i].remote_port = sport;
+      sockwake(&sockets[i]);
       return;
     }
   }
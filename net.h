@@ -137,6 +137,11 @@ struct socket {
   uint rcv_wnd;      // Receive window
   uint iss;          // Initial send sequence
   uint irs;          // Initial receive sequence
+
+  // A process waiting for rxq or state holds lock while it
+  // checks them and sleeps on wq; see sockwake().
+  struct spinlock lock;
+  struct waitq wq;
 };
 
 // TCP States (RFC 793)
@@ -0,0 +1,51 @@
+// nice: run a command with another scheduling class.
+//   nice [-n nice] cmd args...   SCHED_NORMAL, nice 10 by default
+//   nice -r prio cmd args...     SCHED_RT
+//   nice -i cmd args...          SCHED_IDLE
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "sched.h"
+
+static void
+usage(void)
+{
+  printf(2, "usage: nice [-n nice | -r prio | -i] cmd args...\n");
+  exit();
+}
+
+int
+main(int argc, char *argv[])
+{
+  int class, prio, i;
+
+  class = SCHED_NORMAL;
+  prio = 10;
+  i = 1;
+  if(i < argc && strcmp(argv[i], "-i") == 0){
+    class = SCHED_IDLE;
+    prio = 0;
+    i++;
+  } else if(i + 1 < argc && (strcmp(argv[i], "-n") == 0 ||
+                             strcmp(argv[i], "-r") == 0)){
+    if(argv[i][1] == 'r')
+      class = SCHED_RT;
+    // atoi() takes no sign.
+    if(argv[i+1][0] == '-')
+      prio = -atoi(argv[i+1] + 1);
+    else
+      prio = atoi(argv[i+1]);
+    i += 2;
+  }
+  if(i >= argc)
+    usage();
+
+  if(setpriority(0, class, prio) < 0){
+    printf(2, "nice: cannot set priority\n");
+    exit();
+  }
+  exec(argv[i], argv + i);
+  printf(2, "nice: exec %s failed\n", argv[i]);
+  exit();
+}
@@ -1,16 +1,34 @@
 #define NPROC        64  // maximum number of processes
 #define KSTACKSIZE 4096  // size of per-process kernel stack
 #define NCPU          8  // maximum number of CPUs
+#define NSLEEPQ      64  // hash buckets of sleeping processes
+#define TIMESLICE     4  // ticks a process runs before it is preempted
+#define TICKUS    10000  // microseconds per clock tick
+#define KMAXORDER    10  // largest kallocn() block is 2^KMAXORDER pages
+#define KCACHE       64  // max free pages cached per CPU
+#define KBATCH       16  // pages moved between a CPU cache and the buddy lists
 #define NOFILE       16  // open files per process
+#define PIPEORDER     2  // a pipe's buffer grows to 2^PIPEORDER pages
+#define NVMA         16  // mapped regions per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE     1000  // maximum number of cached i-nodes
 #define NDEV         10  // maximum major device number
+#define NLOCKSTAT    64  // lock names counted by make LOCKSTAT=1
 #define ROOTDEV       0  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
+#define NEXECPREFETCH 4  // pages of code exec reads in before main
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       20000  // size of file system in blocks
+#define LOGSIZE      64   // max blocks in the log ring (descriptor fits one block)
+#define LOGBATCH     (MAXOPBLOCKS*2)  // group commit: blocks worth committing at once
+#define LOGLATENCY   1    // group commit: max ticks to wait for a batch
+#define NREADRUN     8  // max blocks readi reads with one request
+#define MAXOPDATA   32  // max file data blocks filewrite writes per FS op
+#define NBUF         (LOGSIZE*2+64)  // size of disk block cache
+#define FSSIZE       2560   // size of file system in blocks
 #define NMOUNT       10     // maximum number of mounted filesystems
-#define FSOFFSET     1000   // filesystem offset on disk 0 (in blocks)
+#define NPREALLOC     8     // blocks preallocated ahead of an appending file
+#define NRSV         16     // files with preallocated blocks at once
+#define NDCACHE     128     // entries in the directory name cache
+#define BFLUSHTICKS 300     // ticks between write-backs of dirty file data
+#define FSOFFSET     1000   // filesystem offset on disk 0 (in sectors)
 
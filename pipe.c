@@ -8,15 +8,23 @@
 #include "sleeplock.h"
 #include "file.h"
 
-#define PIPESIZE 512
+// A pipe's data is a ring buffer of size bytes, starting at one
+// page. A writer that finds it full doubles it, up to
+// 2^PIPEORDER pages, before waiting for the reader.
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data;     // kallocn(order)
+  int order;
+  uint size;      // PGSIZE << order
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  int reading;    // a reader is copying out (see pipewrite)
+  int writing;    // a writer is copying in
+  struct waitq rwait;  // readers waiting for data
+  struct waitq wwait;  // writers waiting for room
 };
 
 int
@@ -30,11 +38,22 @@ pipealloc(struct file **f0, struct file **f1)
     goto bad;
   if((p = (struct pipe*)kalloc()) == 0)
     goto bad;
+  if((p->data = kallocn(0)) == 0){
+    kfree((char*)p);
+    p = 0;
+    goto bad;
+  }
+  p->order = 0;
+  p->size = PGSIZE;
   p->readopen = 1;
   p->writeopen = 1;
   p->nwrite = 0;
   p->nread = 0;
+  p->reading = 0;
+  p->writing = 0;
   initlock(&p->lock, "pipe");
+  initwaitq(&p->rwait, "pipe");
+  initwaitq(&p->wwait, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
   (*f0)->writable = 0;
@@ -47,8 +66,10 @@ pipealloc(struct file **f0, struct file **f1)
 
 //PAGEBREAK: 20
  bad:
-  if(p)
+  if(p){
+    kfreen(p->data, p->order);
     kfree((char*)p);
+  }
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -62,60 +83,183 @@ pipeclose(struct pipe *p, int writable)
   acquire(&p->lock);
   if(writable){
     p->writeopen = 0;
-    wakeup(&p->nread);
+    wqwakeup(&p->rwait);
   } else {
     p->readopen = 0;
-    wakeup(&p->nwrite);
+    wqwakeup(&p->wwait);
   }
   if(p->readopen == 0 && p->writeopen == 0){
     release(&p->lock);
+    kfreen(p->data, p->order);
     kfree((char*)p);
   } else
     release(&p->lock);
 }
 
+// Double p's buffer, if it may grow. Caller holds p->lock.
+// Returns 0 on success, -1 if not.
+static int
+pipegrow(struct pipe *p)
+{
+  char *d;
+  uint n, off;
+
+  if(p->order >= PIPEORDER || (d = kallocn(p->order + 1)) == 0)
+    return -1;
+  // Unwrap the contents to the start of the new buffer.
+  n = p->nwrite - p->nread;
+  off = p->nread & (p->size - 1);
+  if(off + n <= p->size)
+    memmove(d, p->data + off, n);
+  else {
+    memmove(d, p->data + off, p->size - off);
+    memmove(d + p->size - off, p->data, n - (p->size - off));
+  }
+  kfreen(p->data, p->order);
+  p->data = d;
+  p->order++;
+  p->size <<= 1;
+  p->nread = 0;
+  p->nwrite = n;
+  return 0;
+}
+
 //PAGEBREAK: 40
+// Readers and writers copy to and from user memory without
+// p->lock, since that may fault (see trap). One reader and
+// one writer copy at a time, marked by p->reading and
+// p->writing: a writer fills only free space and a reader
+// drains only data, and the buffer does not grow while a
+// reader copies out of it.
 int
 pipewrite(struct pipe *p, char *addr, int n)
 {
+  uint m, off;
+  char *d;
   int i;
 
   acquire(&p->lock);
-  for(i = 0; i < n; i++){
-    while(p->nwrite == p->nread + PIPESIZE){  //DOC: pipewrite-full
+  while(p->writing){
+    if(p->readopen == 0 || myproc()->killed){
+      release(&p->lock);
+      return -1;
+    }
+    wqsleep(&p->wwait, &p->lock, 0);
+  }
+  p->writing = 1;
+  for(i = 0; i < n; i += m){
+    while(p->nwrite == p->nread + p->size){  //DOC: pipewrite-full
       if(p->readopen == 0 || myproc()->killed){
+        p->writing = 0;
+        wqwakeup(&p->wwait);
         release(&p->lock);
         return -1;
       }
-      wakeup(&p->nread);
-      sleep(&p->nwrite, &p->lock);  //DOC: pipewrite-sleep
+      if(!p->reading && pipegrow(p) == 0)
+        break;
+      wqwakeup(&p->rwait);
+      wqsleep(&p->wwait, &p->lock, 0);  //DOC: pipewrite-sleep
     }
-    p->data[p->nwrite++ % PIPESIZE] = addr[i];
+    // Copy as much as there is room for before the
+    // buffer wraps.
+    off = p->nwrite & (p->size - 1);
+    m = n - i;
+    if(m > p->size - (p->nwrite - p->nread))
+      m = p->size - (p->nwrite - p->nread);
+    if(m > p->size - off)
+      m = p->size - off;
+    d = p->data + off;
+    release(&p->lock);
+    memmove(d, addr + i, m);
+    acquire(&p->lock);
+    p->nwrite += m;
   }
-  wakeup(&p->nread);  //DOC: pipewrite-wakeup1
+  p->writing = 0;
+  wqwakeup(&p->rwait);  //DOC: pipewrite-wakeup1
+  wqwakeup(&p->wwait);
   release(&p->lock);
   return n;
 }
 
-int
-piperead(struct pipe *p, char *addr, int n)
+// Finish a read, letting other readers and writers in.
+// Caller holds p->lock.
+static void
+readdone(struct pipe *p)
 {
+  p->reading = 0;
+  // A writer waits for a full buffer to drain. Wake it once
+  // half is free, not for every few bytes read: the reader
+  // empties the pipe, so passes this point, before it waits.
+  // A writer waiting to grow the buffer needs it now.
+  if(p->nwrite - p->nread <= p->size / 2 ||
+     (p->nwrite == p->nread + p->size && p->order < PIPEORDER))
+    wqwakeup(&p->wwait);  //DOC: piperead-wakeup
+  wqwakeup(&p->rwait);
+}
+
+// Copy up to n bytes out of p. Unless peek is set they are
+// consumed as they are copied; see pipepeek.
+static int
+pipecopyout(struct pipe *p, char *addr, int n, int peek)
+{
+  uint m, off, nr;
+  char *d;
   int i;
 
   acquire(&p->lock);
-  while(p->nread == p->nwrite && p->writeopen){  //DOC: pipe-empty
+  while(p->reading || (p->nread == p->nwrite && p->writeopen)){  //DOC: pipe-empty
     if(myproc()->killed){
       release(&p->lock);
       return -1;
     }
-    sleep(&p->nread, &p->lock); //DOC: piperead-sleep
+    wqsleep(&p->rwait, &p->lock, 0); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(p->nread == p->nwrite)
-      break;
-    addr[i] = p->data[p->nread++ % PIPESIZE];
+  p->reading = 1;
+  nr = p->nread;
+  for(i = 0; i < n && nr != p->nwrite; i += m){  //DOC: piperead-copy
+    off = nr & (p->size - 1);
+    m = n - i;
+    if(m > p->nwrite - nr)
+      m = p->nwrite - nr;
+    if(m > p->size - off)
+      m = p->size - off;
+    d = p->data + off;
+    release(&p->lock);
+    memmove(addr + i, d, m);
+    acquire(&p->lock);
+    nr += m;
+    if(!peek)
+      p->nread = nr;
   }
-  wakeup(&p->nwrite);  //DOC: piperead-wakeup
+  if(!peek || i == 0)
+    readdone(p);
   release(&p->lock);
   return i;
 }
+
+int
+piperead(struct pipe *p, char *addr, int n)
+{
+  return pipecopyout(p, addr, n, 0);
+}
+
+// Like piperead, but leave the data in the pipe. If it returns
+// more than 0, p stays marked reading, so that no one else
+// reads the data, until pipeskip() consumes what was used of it.
+int
+pipepeek(struct pipe *p, char *addr, int n)
+{
+  return pipecopyout(p, addr, n, 1);
+}
+
+// Consume n bytes that pipepeek() returned.
+void
+pipeskip(struct pipe *p, int n)
+{
+  acquire(&p->lock);
+  if(!p->reading)
+    panic("pipeskip");
+  p->nread += n;
+  readdone(p);
+  release(&p->lock);
+}
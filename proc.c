@@ -6,24 +6,88 @@
 #include "x86.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "sched.h"
+#include "traps.h"
+
+// Locking.
+// ptable.lock protects allocation of proc slots and the
+// parent/child links that exit() and wait() use.
+// Each CPU has a run queue of RUNNABLE processes with its own
+// lock, held across the swtch() between a process and the
+// CPU's scheduler, as ptable.lock once was; a process that
+// gives up the CPU locks its CPU's queue and sched() returns
+// with it released. Sleeping processes are on a wait queue
+// (see wqsleep). Locks are taken in the order ptable.lock,
+// a wait queue's, a run queue's.
+//
+// Scheduling classes (see sched.h).
+// A CPU runs its SCHED_RT processes first, highest priority
+// first, then its SCHED_NORMAL ones, then SCHED_IDLE ones.
+// A process runs for TIMESLICE ticks, or until a process of a
+// better class or one owed more CPU wakes up on its CPU, before
+// it is preempted; real-time processes of equal priority take
+// turns. SCHED_NORMAL processes are kept in order of vruntime,
+// the ticks each has run scaled by the weight of its nice
+// value, so each gets CPU in proportion to its weight, and a
+// process that wakes after sleeping runs ahead of CPU hogs.
 
 struct {
   struct spinlock lock;
   struct proc proc[NPROC];
 } ptable;
 
+struct runq {
+  struct spinlock lock;
+  struct proc *rt;        // SCHED_RT, highest priority first
+  struct proc *fair;      // SCHED_NORMAL, lowest vruntime first
+  struct proc *idle;      // SCHED_IDLE, in arrival order
+  uint minvruntime;       // vruntime of the last one run
+  int n;                  // length; read without the lock by steal()
+} runq[NCPU];
+
+// Weight of each nice value, from NICE_MIN to NICE_MAX: each
+// step is worth about 10% of CPU against a process one apart.
+static int niceweight[] = {
+  88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705,
+  14949, 11916,  9548,  7620,  6100,  4904,  3906,  3121,
+   2501,  1991,  1586,  1277,  1024,   820,   655,   526,
+    423,   335,   272,   215,   172,   137,   110,    87,
+     70,    56,    45,    36,    29,    23,    18,    15,
+};
+#define NICE0       1024            // weight of nice value 0
+#define VTICK(p)    (NICE0*NICE0 / niceweight[(p)->prio - NICE_MIN])
+#define WAKEBONUS   (TIMESLICE*NICE0 / 2)
+
+// Whether vruntime a is before b, allowing for wraparound.
+#define VBEFORE(a, b)  ((int)((a) - (b)) < 0)
+
+struct waitq sleepq[NSLEEPQ];
+static struct spinlock futexlock[NSLEEPQ];  // see futexwait
+static struct waitq futexq[NSLEEPQ];
+
+#define SLEEPQ(chan) (&sleepq[((uint)(chan) >> 3) % NSLEEPQ])
+
 static struct proc *initproc;
 
 int nextpid = 1;
 extern void forkret(void);
 extern void trapret(void);
 
-static void wakeup1(void *chan);
+static void killthreads1(struct vmspace*);
 
 void
 pinit(void)
 {
+  int i;
+
   initlock(&ptable.lock, "ptable");
+  for(i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(i = 0; i < NSLEEPQ; i++){
+    initwaitq(&sleepq[i], "sleepq");
+    initlock(&futexlock[i], "futex");
+    initwaitq(&futexq[i], "futex");
+  }
 }
 
 // Must be called with interrupts disabled
@@ -70,29 +134,54 @@ myproc(void) {
 // If found, change state to EMBRYO and initialize
 // state required to run in the kernel.
 // Otherwise return 0.
+// kill() looks procs up without ptable.lock, so a proc
+// is not reused until the grace period of its freeing
+// is done (see rcu.c).
 static struct proc*
 allocproc(void)
 {
   struct proc *p;
   char *sp;
+  int pending;
+  uint e;
 
+again:
   acquire(&ptable.lock);
 
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == UNUSED)
-      goto found;
+  pending = 0;
+  e = 0;
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    if(p->state == UNUSED){
+      if(rcudone(p->freed))
+        goto found;
+      pending = 1;
+      e = p->freed;
+    }
+  }
 
   release(&ptable.lock);
+  if(pending && myproc()){
+    rcuwait(e);
+    goto again;
+  }
   return 0;
 
 found:
   p->state = EMBRYO;
   p->pid = nextpid++;
+  p->killed = 0;
+  p->cpu = cpuid();  // interrupts are off
+  p->class = SCHED_NORMAL;
+  p->prio = 0;
+  p->vruntime = 0;
+  p->tgid = p->pid;
 
   release(&ptable.lock);
 
   // Allocate kernel stack.
   if((p->kstack = kalloc()) == 0){
+    p->pid = 0;
+    p->freed = rcustamp();
     p->state = UNUSED;
     return 0;
   }
@@ -115,6 +204,214 @@ found:
   return p;
 }
 
+//PAGEBREAK: 21
+// Run queues.
+
+// Whether p should run before q, of the same class.
+static int
+runsbefore(struct proc *p, struct proc *q)
+{
+  switch(p->class){
+  case SCHED_RT:
+    return p->prio > q->prio;
+  case SCHED_NORMAL:
+    return VBEFORE(p->vruntime, q->vruntime);
+  }
+  return 0;
+}
+
+// Whether p should preempt q, which is running.
+static int
+preempts(struct proc *p, struct proc *q)
+{
+  if(p->class != q->class)
+    return p->class == SCHED_RT || q->class == SCHED_IDLE;
+  if(p->class == SCHED_NORMAL)
+    return VBEFORE(p->vruntime + NICE0, q->vruntime);
+  return runsbefore(p, q);
+}
+
+// Add p to q, which must be locked, behind the processes
+// that should run no later than it. A SCHED_NORMAL process
+// that has been away is not owed more than WAKEBONUS.
+static void
+enqueue(struct runq *q, struct proc *p)
+{
+  struct proc **pp;
+
+  p->cpu = q - runq;
+  switch(p->class){
+  case SCHED_RT:
+    pp = &q->rt;
+    break;
+  case SCHED_NORMAL:
+    if(VBEFORE(p->vruntime, q->minvruntime - WAKEBONUS))
+      p->vruntime = q->minvruntime - WAKEBONUS;
+    pp = &q->fair;
+    break;
+  default:
+    pp = &q->idle;
+  }
+  while(*pp && !runsbefore(p, *pp))
+    pp = &(*pp)->qnext;
+  p->qnext = *pp;
+  *pp = p;
+  q->n++;
+}
+
+// Take the process that should run next off q, which must be
+// locked.
+static struct proc*
+dequeue(struct runq *q)
+{
+  struct proc **pp, *p;
+
+  if(q->rt)
+    pp = &q->rt;
+  else if(q->fair)
+    pp = &q->fair;
+  else if(q->idle)
+    pp = &q->idle;
+  else
+    return 0;
+  p = *pp;
+  *pp = p->qnext;
+  p->qnext = 0;
+  q->n--;
+  if(p->class == SCHED_NORMAL && VBEFORE(q->minvruntime, p->vruntime))
+    q->minvruntime = p->vruntime;
+  return p;
+}
+
+// Take p off q, which must be locked, if it is there.
+static void
+unqueue(struct runq *q, struct proc *p)
+{
+  struct proc **pp;
+
+  pp = p->class == SCHED_RT ? &q->rt :
+       p->class == SCHED_NORMAL ? &q->fair : &q->idle;
+  for(; *pp; pp = &(*pp)->qnext){
+    if(*pp == p){
+      *pp = p->qnext;
+      p->qnext = 0;
+      q->n--;
+      return;
+    }
+  }
+}
+
+// Lock and return this CPU's run queue.
+static struct runq*
+lockrunq(void)
+{
+  struct runq *q;
+
+  pushcli();
+  q = &runq[cpuid()];
+  acquire(&q->lock);
+  popcli();
+  return q;
+}
+
+// Interrupt CPU c, if it is not this one, so that it looks at
+// its run queue (see scheduler) or preempts its process.
+// Interrupts must be off.
+static void
+kick(struct cpu *c)
+{
+  if(c != mycpu())
+    lapicipi(c->apicid, T_IRQ0 + IRQ_RESCHED);
+}
+
+// Make p RUNNABLE on the run queue of the CPU it last ran on,
+// and have that CPU preempt its process if p should.
+// If p is still switching away from that CPU, the queue is
+// locked until it is done.
+static void
+makerunnable(struct proc *p)
+{
+  struct runq *q;
+  struct cpu *c;
+
+  q = &runq[p->cpu];
+  acquire(&q->lock);
+  p->state = RUNNABLE;
+  enqueue(q, p);
+  c = &cpus[p->cpu];
+  if(c->proc && preempts(p, c->proc)){
+    c->resched = 1;
+    kick(c);
+  } else if(c->idle)
+    kick(c);
+  else {
+    // Let an idle CPU steal it.
+    for(c = cpus; c < &cpus[ncpu]; c++){
+      if(c->idle){
+        kick(c);
+        break;
+      }
+    }
+  }
+  release(&q->lock);
+}
+
+// Move a process from the queue of the busiest other CPU to q
+// if that has at least two more than q, or any at all if q is
+// empty, so that idle CPUs find work and the load evens out.
+// Both queues are locked, in index order, while it moves, so
+// that it is on one or the other throughout.
+static void
+steal(struct runq *q)
+{
+  struct runq *o, *busiest;
+  struct proc *p;
+  int min;
+
+  busiest = 0;
+  min = q->n ? q->n + 1 : 0;
+  for(o = runq; o < &runq[ncpu]; o++){
+    if(o != q && o->n > min){
+      busiest = o;
+      min = o->n;
+    }
+  }
+  if(busiest == 0)
+    return;
+  if(busiest < q){
+    acquire(&busiest->lock);
+    acquire(&q->lock);
+  } else {
+    acquire(&q->lock);
+    acquire(&busiest->lock);
+  }
+  if((p = dequeue(busiest)) != 0){
+    // Keep its place relative to the others on its new CPU.
+    p->vruntime += q->minvruntime - busiest->minvruntime;
+    enqueue(q, p);
+  }
+  release(&busiest->lock);
+  release(&q->lock);
+}
+
+// Give back np, from allocproc(), after failing to set it up.
+static void
+unalloc(struct proc *np)
+{
+  if(np->vm)
+    vmspaceput(np->vm);
+  if(np->files)
+    filesput(np->files);
+  np->vm = 0;
+  np->pgdir = 0;
+  np->files = 0;
+  kfree(np->kstack);
+  np->kstack = 0;
+  np->pid = 0;
+  np->freed = rcustamp();
+  np->state = UNUSED;
+}
+
 //PAGEBREAK: 32
 // Set up first user process.
 void
@@ -126,10 +423,11 @@ userinit(void)
   p = allocproc();
   
   initproc = p;
-  if((p->pgdir = setupkvm()) == 0)
+  if((p->pgdir = setupkvm()) == 0 || (p->vm = vmspacealloc(p->pgdir)) == 0 ||
+     (p->files = filesalloc()) == 0)
     panic("userinit: out of memory?");
   inituvm(p->pgdir, _binary_initcode_start, (int)_binary_initcode_size);
-  p->sz = PGSIZE;
+  p->vm->sz = PGSIZE;
   memset(p->tf, 0, sizeof(*p->tf));
   p->tf->cs = (SEG_UCODE << 3) | DPL_USER;
   p->tf->ds = (SEG_UDATA << 3) | DPL_USER;
@@ -144,36 +442,59 @@ userinit(void)
   p->uid = 0;
   p->gid = 0;
 
-  // this assignment to p->state lets other cores
-  // run this process. the acquire forces the above
-  // writes to be visible, and the lock is also needed
-  // because the assignment might not be atomic.
-  acquire(&ptable.lock);
+  // this lets other cores run this process. the run queue's
+  // lock forces the above writes to be visible.
+  makerunnable(p);
+}
 
-  p->state = RUNNABLE;
+// Start a kernel thread that runs fn, which must never return.
+// It has a kernel page table only and never enters user space.
+void
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
 
-  release(&ptable.lock);
+  if((p = allocproc()) == 0)
+    panic("kthread: no proc");
+  if((p->pgdir = setupkvm()) == 0)
+    panic("kthread: out of memory?");
+
+  // Have forkret return into fn instead of trapret.
+  *(uint*)((char*)p->context + sizeof(*p->context)) = (uint)fn;
+
+  p->parent = initproc;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  makerunnable(p);
 }
 
 // Grow current process's memory by n bytes.
-// Return 0 on success, -1 on failure.
+// Return the old size on success, -1 on failure.
 int
 growproc(int n)
 {
-  uint sz;
-  struct proc *curproc = myproc();
+  uint sz, oldsz;
+  struct vmspace *vm = myproc()->vm;
 
-  sz = curproc->sz;
+  vmlock(vm);
+  sz = oldsz = vm->sz;
   if(n > 0){
-    if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
-      return -1;
+    if(sz + n < sz || sz + n > mmapbase(vm))
+      goto bad;
+    if((sz = allocuvm(vm->pgdir, sz, sz + n)) == 0)
+      goto bad;
   } else if(n < 0){
-    if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
-      return -1;
+    if((sz = deallocuvm(vm->pgdir, sz, sz + n)) == 0)
+      goto bad;
+    vmflush(vm);
   }
-  curproc->sz = sz;
-  switchuvm(curproc);
-  return 0;
+  vm->sz = sz;
+  vmunlock(vm);
+  return oldsz;
+
+bad:
+  vmunlock(vm);
+  return -1;
 }
 
 // Create a new process copying p as the parent.
@@ -183,6 +504,7 @@ int
 fork(void)
 {
   int i, pid;
+  pde_t *pgdir;
   struct proc *np;
   struct proc *curproc = myproc();
 
@@ -192,59 +514,174 @@ fork(void)
   }
 
   // Copy process state from proc.
-  if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
-    kfree(np->kstack);
-    np->kstack = 0;
-    np->state = UNUSED;
-    return -1;
+  if((np->files = filesalloc()) == 0)
+    goto bad;
+  vmlock(curproc->vm);
+  if((pgdir = copyuvm(curproc->pgdir, curproc->vm->sz)) == 0){
+    vmunlock(curproc->vm);
+    goto bad;
+  }
+  if((np->vm = vmspacealloc(pgdir)) == 0){
+    freevm(pgdir);
+    vmunlock(curproc->vm);
+    goto bad;
+  }
+  np->pgdir = pgdir;
+  np->vm->sz = curproc->vm->sz;
+  if(vmacopy(np->vm, curproc->vm) < 0){
+    vmunlock(curproc->vm);
+    goto bad;
   }
-  np->sz = curproc->sz;
+  // The parent's pages are read-only now; drop stale
+  // writable TLB entries.
+  vmflush(curproc->vm);
+  vmunlock(curproc->vm);
   np->parent = curproc;
   *np->tf = *curproc->tf;
 
   // Clear %eax so that fork returns 0 in the child.
   np->tf->eax = 0;
 
+  // A thread sharing the table may be closing files.
   for(i = 0; i < NOFILE; i++)
-    if(curproc->ofile[i])
-      np->ofile[i] = filedup(curproc->ofile[i]);
+    np->files->ofile[i] = fileget(curproc->files, i);
   np->cwd = idup(curproc->cwd);
   np->uid = curproc->uid;
   np->gid = curproc->gid;
+  np->class = curproc->class;
+  np->prio = curproc->prio;
+  np->vruntime = curproc->vruntime;
+  np->tls = curproc->tls;
 
   safestrcpy(np->name, curproc->name, sizeof(curproc->name));
 
   pid = np->pid;
 
-  acquire(&ptable.lock);
+  makerunnable(np);
 
-  np->state = RUNNABLE;
+  return pid;
 
-  release(&ptable.lock);
+bad:
+  unalloc(np);
+  return -1;
+}
+
+// Create a thread of the current process, sharing its memory
+// and open files, that starts in fn(arg) with its stack
+// pointer at stack and %fs based at tls (see SEG_UTLS).
+// fn must not return; the thread ends with exit().
+// Returns the new thread's pid, or -1.
+int
+clone(uint fn, uint arg, uint stack, uint tls)
+{
+  struct proc *np;
+  struct proc *curproc = myproc();
+  uint sp, ustack[2];
+
+  // Push arg and a fake return PC on the new stack.
+  sp = (stack & ~3) - sizeof(ustack);
+  if(sp >= stack || vmacheck(sp, sizeof(ustack), 1) < 0)
+    return -1;
+  ustack[0] = 0xffffffff;
+  ustack[1] = arg;
+  memmove((void*)sp, ustack, sizeof(ustack));
+
+  if((np = allocproc()) == 0)
+    return -1;
+  np->vm = vmspacedup(curproc->vm);
+  np->pgdir = curproc->pgdir;
+  np->files = filesdup(curproc->files);
+  np->tgid = curproc->tgid;
+  np->parent = curproc;
+  *np->tf = *curproc->tf;
+  np->tf->eip = fn;
+  np->tf->esp = sp;
+  np->tls = tls;
+  np->tf->fs = (SEG_UTLS << 3) | DPL_USER;
+
+  np->cwd = idup(curproc->cwd);
+  np->uid = curproc->uid;
+  np->gid = curproc->gid;
+  np->class = curproc->class;
+  np->prio = curproc->prio;
+  np->vruntime = curproc->vruntime;
+  safestrcpy(np->name, curproc->name, sizeof(curproc->name));
+
+  makerunnable(np);
+
+  return np->pid;
+}
+
+// Create a new process running the program at path with
+// arguments argv, like fork() followed by exec() in the child
+// but without copying the caller's memory. The child's fd i
+// is a duplicate of the caller's fd fds[i] for i < nfds, or
+// closed if fds[i] is negative; fds from nfds on are closed.
+// fds is in kernel memory.
+// Returns the child's pid, or -1.
+int
+spawn(char *path, char **argv, int *fds, int nfds)
+{
+  int i, pid;
+  struct proc *np;
+  struct proc *curproc = myproc();
+
+  if(nfds < 0 || nfds > NOFILE)
+    return -1;
+
+  // Allocate process.
+  if((np = allocproc()) == 0)
+    return -1;
+  if((np->files = filesalloc()) == 0)
+    goto bad;
+  // Take the files before execinto() sleeps, in case a thread
+  // sharing the caller's table closes them meanwhile.
+  for(i = 0; i < nfds; i++){
+    if(fds[i] < 0)
+      continue;
+    if((np->files->ofile[i] = fileget(curproc->files, fds[i])) == 0)
+      goto bad;
+  }
+  *np->tf = *curproc->tf;
+  if(execinto(np, path, argv) < 0)
+    goto bad;
+  np->parent = curproc;
+
+  np->cwd = idup(curproc->cwd);
+  np->uid = curproc->uid;
+  np->gid = curproc->gid;
+  np->class = curproc->class;
+  np->prio = curproc->prio;
+  np->vruntime = curproc->vruntime;
+
+  pid = np->pid;
+
+  makerunnable(np);
 
   return pid;
+
+bad:
+  unalloc(np);
+  return -1;
 }
 
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait() to find out it exited.
+// The first thread of a process kills the others when it
+// exits; the last one to be waited for frees the memory.
 void
 exit(void)
 {
   struct proc *curproc = myproc();
   struct proc *p;
-  int fd;
 
   if(curproc == initproc)
     panic("init exiting");
 
   // Close all open files.
-  for(fd = 0; fd < NOFILE; fd++){
-    if(curproc->ofile[fd]){
-      fileclose(curproc->ofile[fd]);
-      curproc->ofile[fd] = 0;
-    }
-  }
+  filesput(curproc->files);
+  curproc->files = 0;
 
   begin_op();
   iput(curproc->cwd);
@@ -253,20 +690,27 @@ exit(void)
 
   acquire(&ptable.lock);
 
+  if(curproc->tgid == curproc->pid)
+    killthreads1(curproc->vm);
+
   // Parent might be sleeping in wait().
-  wakeup1(curproc->parent);
+  wakeup(curproc->parent);
 
   // Pass abandoned children to init.
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
     if(p->parent == curproc){
       p->parent = initproc;
       if(p->state == ZOMBIE)
-        wakeup1(initproc);
+        wakeup(initproc);
     }
   }
 
-  // Jump into the scheduler, never to return.
+  // Jump into the scheduler, never to return. wait() cannot
+  // free our stack until our run queue is unlocked, after
+  // the switch.
+  lockrunq();
   curproc->state = ZOMBIE;
+  release(&ptable.lock);
   sched();
   panic("zombie exit");
 }
@@ -277,6 +721,7 @@ int
 wait(void)
 {
   struct proc *p;
+  struct vmspace *vm;
   int havekids, pid;
   struct proc *curproc = myproc();
   
@@ -289,17 +734,26 @@ wait(void)
         continue;
       havekids = 1;
       if(p->state == ZOMBIE){
-        // Found one.
+        // Found one. Make sure it is off its CPU.
+        acquire(&runq[p->cpu].lock);
+        release(&runq[p->cpu].lock);
         pid = p->pid;
         kfree(p->kstack);
         p->kstack = 0;
-        freevm(p->pgdir);
+        vm = p->vm;
+        p->vm = 0;
+        p->pgdir = 0;
         p->pid = 0;
         p->parent = 0;
         p->name[0] = 0;
         p->killed = 0;
+        p->tls = 0;
+        p->freed = rcustamp();
         p->state = UNUSED;
         release(&ptable.lock);
+        // Freeing the memory may write to files, and sleep.
+        if(vm)
+          vmspaceput(vm);
         return pid;
       }
     }
@@ -310,7 +764,7 @@ wait(void)
       return -1;
     }
 
-    // Wait for children to exit.  (See wakeup1 call in proc_exit.)
+    // Wait for children to exit.  (See wakeup call in exit.)
     sleep(curproc, &ptable.lock);  //DOC: wait-sleep
   }
 }
@@ -319,7 +773,9 @@ wait(void)
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run
+//  - take work from a busier CPU, if there is one
+//  - choose the first process on this CPU's run queue,
+//      or halt until an interrupt if there is none
 //  - swtch to start running that process
 //  - eventually that process transfers control
 //      via swtch back to the scheduler.
@@ -328,39 +784,55 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  struct runq *q = &runq[c - cpus];
   c->proc = 0;
   
   for(;;){
     // Enable interrupts on this processor.
     sti();
 
-    // Loop over process table looking for process to run.
-    acquire(&ptable.lock);
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->state != RUNNABLE)
-        continue;
-
-      // Switch to chosen process.  It is the process's job
-      // to release ptable.lock and then reacquire it
-      // before jumping back to us.
-      c->proc = p;
-      switchuvm(p);
-      p->state = RUNNING;
-
-      swtch(&(c->scheduler), p->context);
-      switchkvm();
-
-      // Process is done running for now.
-      // It should have changed its p->state before coming back.
-      c->proc = 0;
+    steal(q);
+
+    // With interrupts off until hlt, a CPU that queues a
+    // process after we find none sees c->idle and kicks us.
+    cli();
+    rcuquiesce();
+    acquire(&q->lock);
+    if((p = dequeue(q)) == 0){
+      c->idle = 1;
+      release(&q->lock);
+      timerarm();
+      c->qidle = 1;
+      stihlt();
+      c->idle = 0;
+      continue;
     }
-    release(&ptable.lock);
 
+    // Switch to chosen process.  It is the process's job
+    // to release q->lock and then reacquire it
+    // before jumping back to us.
+    c->proc = p;
+    c->resched = 0;
+    c->nexttick = usecs() + TICKUS;
+    timerarm();
+    p->slice = TIMESLICE;
+    switchuvm(p);
+    p->state = RUNNING;
+
+    swtch(&(c->scheduler), p->context);
+    switchkvm();
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&q->lock);
   }
 }
 
-// Enter scheduler.  Must hold only ptable.lock
-// and have changed proc->state. Saves and restores
+// Enter scheduler.  Must hold only this CPU's run queue
+// lock (see lockrunq) and have changed proc->state.
+// Returns with the lock released: by then the process may
+// be on another CPU. Saves and restores
 // intena because intena is a property of this
 // kernel thread, not this CPU. It should
 // be proc->intena and proc->ncli, but that would
@@ -372,8 +844,8 @@ sched(void)
   int intena;
   struct proc *p = myproc();
 
-  if(!holding(&ptable.lock))
-    panic("sched ptable.lock");
+  if(!holding(&runq[cpuid()].lock))
+    panic("sched runq lock");
   if(mycpu()->ncli != 1)
     panic("sched locks");
   if(p->state == RUNNING)
@@ -383,16 +855,52 @@ sched(void)
   intena = mycpu()->intena;
   swtch(&p->context, mycpu()->scheduler);
   mycpu()->intena = intena;
+  release(&runq[cpuid()].lock);
 }
 
 // Give up the CPU for one scheduling round.
 void
 yield(void)
 {
-  acquire(&ptable.lock);  //DOC: yieldlock
-  myproc()->state = RUNNABLE;
+  struct runq *q;
+  struct proc *p = myproc();
+
+  q = lockrunq();
+  p->state = RUNNABLE;
+  enqueue(q, p);
   sched();
-  release(&ptable.lock);
+}
+
+// Charge the current process for a clock tick, and have it
+// preempted on its way out of the trap when its slice is used.
+// Called from the timer interrupt on every CPU.
+void
+schedtick(void)
+{
+  struct cpu *c = mycpu();
+  struct proc *p = c->proc;
+
+  if(p == 0 || p->state != RUNNING)
+    return;
+  if(p->class == SCHED_NORMAL)
+    p->vruntime += VTICK(p);
+  if(--p->slice <= 0)
+    c->resched = 1;
+}
+
+// Give up the CPU if the current process should be preempted
+// (see schedtick and makerunnable). Called on the way out of
+// a trap.
+void
+preempt(void)
+{
+  int resched;
+
+  pushcli();
+  resched = mycpu()->resched;
+  popcli();
+  if(resched)
+    yield();
 }
 
 // A fork child's very first scheduling by scheduler()
@@ -401,8 +909,8 @@ void
 forkret(void)
 {
   static int first = 1;
-  // Still holding ptable.lock from scheduler.
-  release(&ptable.lock);
+  // Still holding the run queue lock from scheduler.
+  release(&runq[cpuid()].lock);
 
   if (first) {
     // Some initialization functions must be run in the context
@@ -416,90 +924,411 @@ forkret(void)
   // Return to "caller", actually trapret (see allocproc).
 }
 
-// Atomically release lock and sleep on chan.
-// Reacquires lock when awakened.
+//PAGEBREAK!
+// Wait queues.
+// A process waiting for an event sleeps on the wait queue of
+// the object the event happens to, such as a buf or a pipe,
+// and whoever causes the event wakes that queue, so waking
+// looks only at processes waiting for it. A queue's lock
+// orders sleeping against waking: a waiter holds the lock that
+// protects the condition it waits for, lk, until it is on the
+// queue, and a waker must hold lk to change the condition.
+// The old sleep(chan) and wakeup(chan) use one of NSLEEPQ
+// shared queues, chosen by hashing chan.
+//
+// The timer and kill() wake a process by pointer, not by
+// queue, so they find its queue through p->wq. They pin p
+// while they do, and p does not leave wqsleep() until it is
+// unpinned, so the queue (part of an object that p's caller
+// keeps alive while it sleeps) is not freed under them.
+
 void
-sleep(void *chan, struct spinlock *lk)
+initwaitq(struct waitq *wq, char *name)
+{
+  initlock(&wq->lock, name);
+  wq->head = 0;
+}
+
+// Sleep on wq as chan, atomically releasing lk, until woken,
+// or, if deadline is not 0, until usecs() reaches deadline.
+// Reacquires lk.
+static void
+waiton(struct waitq *wq, void *chan, struct spinlock *lk, uint64 deadline)
 {
   struct proc *p = myproc();
-  
+  struct proc **pp;
+
   if(p == 0)
     panic("sleep");
 
   if(lk == 0)
     panic("sleep without lk");
 
-  // Must acquire ptable.lock in order to
-  // change p->state and then call sched.
-  // Once we hold ptable.lock, we can be
-  // guaranteed that we won't miss any wakeup
-  // (wakeup runs with ptable.lock locked),
+  // Must acquire wq->lock in order to go on the queue.
+  // Once we are on it, we can be guaranteed that we won't
+  // miss any wakeup (wakeup runs with it locked),
   // so it's okay to release lk.
-  if(lk != &ptable.lock){  //DOC: sleeplock0
-    acquire(&ptable.lock);  //DOC: sleeplock1
-    release(lk);
-  }
-  // Go to sleep.
+  acquire(&wq->lock);  //DOC: sleeplock1
+  p->wq = wq;
   p->chan = chan;
   p->state = SLEEPING;
+  p->qnext = 0;
+  for(pp = &wq->head; *pp; pp = &(*pp)->qnext)
+    ;
+  *pp = p;
+  release(lk);
+
+  // Go to sleep, last in line. The run queue lock, held
+  // until we are off this CPU, keeps a waker from running
+  // us before.
+  if(deadline){
+    p->deadline = deadline;
+    timeradd(p);
+  }
+  lockrunq();
+  release(&wq->lock);
 
   sched();
 
-  // Tidy up.
-  p->chan = 0;
+  if(deadline)
+    timerdel(p);
+  while(p->pin)
+    ;
 
   // Reacquire original lock.
-  if(lk != &ptable.lock){  //DOC: sleeplock2
-    release(&ptable.lock);
-    acquire(lk);
+  acquire(lk);  //DOC: sleeplock2
+}
+
+// Wake the processes on wq sleeping on chan, and using vm
+// if vm is not 0, or only the first n of them if n is not 0.
+// Caller must hold wq->lock. Returns how many it woke.
+static int
+wakeq(struct waitq *wq, void *chan, struct vmspace *vm, int n)
+{
+  struct proc *p, **pp;
+  int woken;
+
+  woken = 0;
+  for(pp = &wq->head; (p = *pp) != 0; ){
+    if(p->chan == chan && (vm == 0 || p->vm == vm)){
+      *pp = p->qnext;
+      p->wq = 0;
+      p->chan = 0;
+      makerunnable(p);
+      if(++woken == n)
+        break;
+    } else
+      pp = &p->qnext;
   }
+  return woken;
+}
+
+// Sleep on wq, releasing lk, until wqwakeup() or wqwakeone()
+// on wq, or until usecs() reaches deadline if it is not 0.
+// The caller must check its condition again when it returns.
+void
+wqsleep(struct waitq *wq, struct spinlock *lk, uint64 deadline)
+{
+  waiton(wq, wq, lk, deadline);
+}
+
+// Wake all the processes sleeping on wq.
+void
+wqwakeup(struct waitq *wq)
+{
+  // A sleeper is on wq before it releases the lock that
+  // the caller holds, so this cannot miss one.
+  if(wq->head == 0)
+    return;
+  acquire(&wq->lock);
+  wakeq(wq, wq, 0, 0);
+  release(&wq->lock);
+}
+
+// Wake the process that has slept on wq longest.
+void
+wqwakeone(struct waitq *wq)
+{
+  if(wq->head == 0)
+    return;
+  acquire(&wq->lock);
+  wakeq(wq, wq, 0, 1);
+  release(&wq->lock);
+}
+
+// Atomically release lock and sleep on chan.
+// Reacquires lock when awakened.
+void
+sleep(void *chan, struct spinlock *lk)
+{
+  waiton(SLEEPQ(chan), chan, lk, 0);
+}
+
+// Like sleep(), but wake by usecs() reaching deadline as well,
+// if deadline is not 0.
+void
+tsleep(void *chan, struct spinlock *lk, uint64 deadline)
+{
+  waiton(SLEEPQ(chan), chan, lk, deadline);
 }
 
-//PAGEBREAK!
 // Wake up all processes sleeping on chan.
-// The ptable lock must be held.
+void
+wakeup(void *chan)
+{
+  wakeupn(chan, 0);
+}
+
+// Wake up the n processes that have slept on chan longest,
+// or all of them if n is 0. Returns how many it woke.
+int
+wakeupn(void *chan, int n)
+{
+  struct waitq *wq;
+  int woken;
+
+  wq = SLEEPQ(chan);
+  acquire(&wq->lock);
+  woken = wakeq(wq, chan, 0, n);
+  release(&wq->lock);
+  return woken;
+}
+
+// Pin p so that it stays in wqsleep() (see above).
+// p must be sleeping, or the caller must hold ptable.lock
+// or be in a read section that found p (see rcu.c).
+void
+pinproc(struct proc *p)
+{
+  __sync_fetch_and_add(&p->pin, 1);
+}
+
+void
+unpinproc(struct proc *p)
+{
+  __sync_fetch_and_sub(&p->pin, 1);
+}
+
+// Wake pinned p if it is sleeping, whatever it sleeps on.
+void
+wakeproc(struct proc *p)
+{
+  struct waitq *wq;
+  struct proc **pp;
+
+  if((wq = p->wq) == 0)
+    return;
+  acquire(&wq->lock);
+  if(p->wq == wq){
+    for(pp = &wq->head; *pp != p; pp = &(*pp)->qnext)
+      ;
+    *pp = p->qnext;
+    p->wq = 0;
+    p->chan = 0;
+    makerunnable(p);
+  }
+  release(&wq->lock);
+}
+
+//PAGEBREAK!
+// Futexes.
+// A thread waits on a word of user memory until another thread
+// of the process changes the word and wakes it. A futex is
+// known by the vmspace and the word's user address, since the
+// page under the address may change (copy-on-write, munmap).
+// The waiter sleeps on futexq with the address as its channel.
+// It reads the word through the page table with the vmspace
+// locked and the futex's futexlock held; a waker holds the
+// futexlock too, so it cannot come between the check and the
+// sleep.
+
+#define FUTEXHASH(vm, addr) ((((uint)(vm) >> 4) ^ ((addr) >> 2)) % NSLEEPQ)
+
+// Sleep until futexwake() on addr, if the word at addr is val.
+// Returns 0 when woken, -1 if the word is not val or the
+// process is killed.
+int
+futexwait(uint addr, int val)
+{
+  struct proc *p = myproc();
+  struct vmspace *vm = p->vm;
+  struct spinlock *lk;
+  pte_t *pte;
+  int h, same;
+
+  if(addr % sizeof(int) != 0 || vmacheck(addr, sizeof(int), 0) < 0)
+    return -1;
+  h = FUTEXHASH(vm, addr);
+  lk = &futexlock[h];
+  vmlock(vm);
+  acquire(lk);
+  pte = walkpgdir(vm->pgdir, (char*)addr, 0);
+  same = pte && (*pte & PTE_P) &&
+         *(int*)(P2V(PTE_ADDR(*pte)) + addr % PGSIZE) == val;
+  vmunlock(vm);
+  if(!same || p->killed){
+    release(lk);
+    return -1;
+  }
+  waiton(&futexq[h], (void*)addr, lk, 0);
+  release(lk);
+  return 0;
+}
+
+// Wake at most n threads waiting on the word at addr.
+// Returns how many it woke, or -1 if addr is bad.
+int
+futexwake(uint addr, int n)
+{
+  struct vmspace *vm = myproc()->vm;
+  struct waitq *wq;
+  struct spinlock *lk;
+  int h, woken;
+
+  if(n <= 0)
+    return 0;
+  if(addr % sizeof(int) != 0 || vmacheck(addr, sizeof(int), 0) < 0)
+    return -1;
+  h = FUTEXHASH(vm, addr);
+  lk = &futexlock[h];
+  wq = &futexq[h];
+  acquire(lk);
+  acquire(&wq->lock);
+  woken = wakeq(wq, (void*)addr, vm, n);
+  release(&wq->lock);
+  release(lk);
+  return woken;
+}
+
+// Mark p killed and wake it if it sleeps.
+// Caller must hold ptable.lock, or be in the read
+// section that found p.
 static void
-wakeup1(void *chan)
+killproc(struct proc *p)
+{
+  p->killed = 1;
+  pinproc(p);
+  wakeproc(p);
+  unpinproc(p);
+}
+
+// Kill the threads other than the current one that use vm.
+// Caller must hold ptable.lock.
+static void
+killthreads1(struct vmspace *vm)
 {
   struct proc *p;
 
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == SLEEPING && p->chan == chan)
-      p->state = RUNNABLE;
+    if(p != myproc() && p->vm == vm && p->state != ZOMBIE)
+      killproc(p);
 }
 
-// Wake up all processes sleeping on chan.
 void
-wakeup(void *chan)
+killthreads(struct vmspace *vm)
 {
   acquire(&ptable.lock);
-  wakeup1(chan);
+  killthreads1(vm);
   release(&ptable.lock);
 }
 
 // Kill the process with the given pid.
 // Process won't exit until it returns
 // to user space (see trap in trap.c).
+// The lookup takes no lock: a proc it finds is not
+// reused before the read section ends (see allocproc).
 int
 kill(int pid)
 {
   struct proc *p;
 
-  acquire(&ptable.lock);
+  rcubegin();
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
     if(p->pid == pid){
-      p->killed = 1;
-      // Wake process from sleep if necessary.
-      if(p->state == SLEEPING)
-        p->state = RUNNABLE;
-      release(&ptable.lock);
+      killproc(p);
+      rcuend();
       return 0;
     }
   }
-  release(&ptable.lock);
+  rcuend();
   return -1;
 }
 
+// Set the scheduling class of process pid (0 for the caller)
+// to class with priority prio: a nice value for SCHED_NORMAL,
+// a real-time priority for SCHED_RT, 0 for SCHED_IDLE.
+// Only root may choose SCHED_RT, lower a nice value, or change
+// another user's process.
+// Returns 0 on success, -1 on failure.
+int
+setpriority(int pid, int class, int prio)
+{
+  struct proc *curproc = myproc();
+  struct proc *p;
+  struct runq *q;
+  int curnice;
+
+  switch(class){
+  case SCHED_NORMAL:
+    if(prio < NICE_MIN || prio > NICE_MAX)
+      return -1;
+    break;
+  case SCHED_RT:
+    if(prio < RTPRIO_MIN || prio > RTPRIO_MAX)
+      return -1;
+    break;
+  case SCHED_IDLE:
+    if(prio != 0)
+      return -1;
+    break;
+  default:
+    return -1;
+  }
+
+  acquire(&ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+    if(p->state != UNUSED && p->state != ZOMBIE &&
+       (pid == 0 ? p == curproc : p->pid == pid))
+      break;
+  // A SCHED_IDLE process counts as the nicest SCHED_NORMAL one,
+  // so that going through SCHED_IDLE lowers no nice value.
+  curnice = NICE_MAX;
+  if(p < &ptable.proc[NPROC] && p->class == SCHED_NORMAL)
+    curnice = p->prio;
+  if(p == &ptable.proc[NPROC] ||
+     (curproc->uid != 0 &&
+      (p->uid != curproc->uid || class == SCHED_RT ||
+       p->class == SCHED_RT ||
+       (class == SCHED_NORMAL && prio < curnice)))){
+    release(&ptable.lock);
+    return -1;
+  }
+  // Requeue p if it is waiting to run, in its new place.
+  // Another CPU may steal it until its queue is locked.
+  for(;;){
+    q = &runq[p->cpu];
+    acquire(&q->lock);
+    if(q == &runq[p->cpu])
+      break;
+    release(&q->lock);
+  }
+  if(p->state == RUNNABLE)
+    unqueue(q, p);
+  if(p->class != SCHED_NORMAL && class == SCHED_NORMAL)
+    p->vruntime = q->minvruntime;
+  p->class = class;
+  p->prio = prio;
+  if(p->state == RUNNABLE){
+    enqueue(q, p);
+    if(cpus[p->cpu].proc && preempts(p, cpus[p->cpu].proc))
+      cpus[p->cpu].resched = 1;
+  } else if(p->state == RUNNING)
+    cpus[p->cpu].resched = 1;  // let it find its new place
+  release(&q->lock);
+  release(&ptable.lock);
+  return 0;
+}
+
 static char *states[] = {
   [UNUSED]    "unused",
   [EMBRYO]    "embryo",
@@ -8,6 +8,12 @@ struct cpu {
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
   struct proc *proc;           // The process running on this cpu or null
+  int resched;                 // Preempt proc on its way out of a trap
+  int idle;                    // Halted in scheduler(), nothing to run
+  volatile int tlbflush;       // Set until it has flushed its TLB (vmflush)
+  volatile uint qepoch;        // rcuepoch when last quiescent (see rcu.c)
+  volatile int qidle;          // Halted, so quiescent until interrupted
+  uint64 nexttick;             // When to charge proc for a tick (usecs)
 };
 
 extern struct cpu cpus[NCPU];
@@ -32,25 +38,68 @@ struct context {
   uint eip;
 };
 
+// A region of the address space whose pages are faulted in
+// on demand: mapped by mmap(), or a program segment (see mmap.c).
+struct vma {
+  uint start;                  // First address, page-aligned
+  uint end;                    // End address; 0 if the slot is unused
+  int prot;                    // PROT_READ, PROT_WRITE
+  int flags;                   // MAP_SHARED or MAP_PRIVATE, MAP_ANONYMOUS
+  struct inode *ip;            // Mapped file, 0 if anonymous
+  uint off;                    // File offset of start
+  uint filesz;                 // Bytes from start backed by the file
+};
+#define VMA_IMAGE 0x100        // flags: segment of the program image
+
+// A user address space, shared by the threads of a process
+// (see clone). Faults and changes to sz or vma are made with
+// vmlock() held.
+struct vmspace {
+  int ref;                     // Processes using it; 0 if the slot is free
+  int locked;                  // Held by vmlock()
+  pde_t* pgdir;                // Page table
+  uint sz;                     // Size of process memory (bytes)
+  struct vma vma[NVMA];        // Mapped regions
+};
+
+// Open files, shared by the threads of a process.
+struct files {
+  int ref;                     // Processes using it; 0 if the slot is free
+  struct file *ofile[NOFILE];  // Open files, by fd
+};
+
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
 struct proc {
-  uint sz;                     // Size of process memory (bytes)
-  pde_t* pgdir;                // Page table
+  struct vmspace *vm;          // Address space; 0 for a kernel thread
+  pde_t* pgdir;                // Page table, vm->pgdir if there is vm
   char *kstack;                // Bottom of kernel stack for this process
   enum procstate state;        // Process state
   int pid;                     // Process ID
   struct proc *parent;         // Parent process
   struct trapframe *tf;        // Trap frame for current syscall
   struct context *context;     // swtch() here to run process
-  void *chan;                  // If non-zero, sleeping on chan
+  struct waitq *wq;            // If non-zero, sleeping on wq
+  void *chan;                  // Channel it sleeps on, in wq
   int killed;                  // If non-zero, have been killed
-  struct file *ofile[NOFILE];  // Open files
+  struct files *files;         // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
   uint uid;                    // User ID
   uint gid;                    // Group ID
+  int tgid;                    // pid of the first thread of its process
+  uint tls;                    // Base of its %fs segment (SEG_UTLS)
+  int cpu;                     // CPU whose run queue it is on, or ran on
+  struct proc *qnext;          // Next on its run queue or wait queue
+  int class;                   // SCHED_NORMAL, SCHED_RT or SCHED_IDLE
+  int prio;                    // Nice value, or real-time priority
+  uint vruntime;               // Ticks run, weighted by nice value
+  int slice;                   // Ticks left before it is preempted
+  uint64 deadline;             // If on the timer list, when to wake (usecs)
+  struct proc *tnext;          // Next on the timer list
+  int pin;                     // Being woken by pointer (see wakeproc)
+  uint freed;                  // rcustamp() when last freed (see allocproc)
 };
 
 // Process memory is laid out contiguously, low addresses first:
@@ -58,3 +107,4 @@ struct proc {
 //   original data and bss
 //   fixed-size stack
 //   expandable heap
+//   regions mapped by mmap(), up to KERNBASE
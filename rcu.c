@@ -0,0 +1,94 @@
+// Read-copy update, for read-mostly tables.
+//
+// A reader looks an entry up without the table's lock, between
+// rcubegin() and rcuend(). The read section runs with
+// interrupts off and must not sleep, so a CPU that takes an
+// interrupt, or is in scheduler(), has no read section in
+// progress: it is quiescent.
+//
+// A writer, holding the table's lock, unpublishes an entry and
+// calls rcustamp(). It may reuse the entry once rcudone()
+// says every CPU has been quiescent since the stamp, so that
+// no reader can still be looking at it; rcuwait() sleeps until
+// then. Entries freed this way record their stamp, and the
+// allocator passes over those whose grace period is not done.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+
+static volatile uint rcuepoch;  // grace periods started
+
+// Start a read section.
+void
+rcubegin(void)
+{
+  pushcli();
+}
+
+void
+rcuend(void)
+{
+  popcli();
+}
+
+// Note that this CPU is in no read section.
+// Interrupts must be off.
+void
+rcuquiesce(void)
+{
+  struct cpu *c = mycpu();
+
+  c->qepoch = rcuepoch;
+  if(c->qidle){
+    // An interrupt that wakes a halted CPU may read; a writer
+    // must not see qidle set after the reader's first load.
+    c->qidle = 0;
+    __sync_synchronize();
+  }
+}
+
+// Start a grace period, after unpublishing an entry.
+// Returns the stamp to pass to rcudone().
+uint
+rcustamp(void)
+{
+  return __sync_add_and_fetch(&rcuepoch, 1);
+}
+
+// Whether every CPU other than this one has been quiescent
+// since stamp e. The caller must not be in a read section.
+int
+rcudone(uint e)
+{
+  struct cpu *c, *me;
+  int done;
+
+  pushcli();
+  me = mycpu();
+  done = 1;
+  for(c = cpus; c < cpus+ncpu; c++){
+    if(c != me && !c->qidle && (int)(c->qepoch - e) < 0){
+      done = 0;
+      break;
+    }
+  }
+  popcli();
+  return done;
+}
+
+// Sleep until the grace period of stamp e is done.
+// A CPU running a process is quiescent at its next
+// clock tick, so this rarely takes more than one.
+void
+rcuwait(uint e)
+{
+  while(!rcudone(e)){
+    if(sleepuntil(usecs() + TICKUS) < 0)
+      yield();
+  }
+}
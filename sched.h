@@ -0,0 +1,9 @@
+// Scheduling classes, for setpriority().
+#define SCHED_NORMAL  0   // fair share, weighted by nice value
+#define SCHED_RT      1   // real time: fixed priority, before all others
+#define SCHED_IDLE    2   // only when nothing else is runnable
+
+#define NICE_MIN    -20   // SCHED_NORMAL: most CPU
+#define NICE_MAX     19   // SCHED_NORMAL: least CPU
+#define RTPRIO_MIN    1   // SCHED_RT: lowest priority
+#define RTPRIO_MAX   99   // SCHED_RT: highest priority
@@ -52,6 +52,8 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
+int spawnable(struct cmd*);
+int spawncmd(struct cmd*, int*);
 
 // Execute cmd.  Never returns.
 void
@@ -125,6 +127,14 @@ runcmd(struct cmd *cmd)
 
   case PIPE:
     pcmd = (struct pipecmd*)cmd;
+    if(spawnable(cmd)){
+      // Start the stages directly, without forking.
+      int fds[3] = { 0, 1, 2 };
+      int n = spawncmd(cmd, fds);
+      while(n-- > 0)
+        wait();
+      break;
+    }
     if(pipe(p) < 0)
       panic("pipe");
     if(fork1() == 0){
@@ -497,6 +507,81 @@ panic(char *s)
   exit();
 }
 
+// Whether cmd is made only of pipes and redirections of
+// simple commands, so spawncmd can run it.
+int
+spawnable(struct cmd *cmd)
+{
+  switch(cmd->type){
+  case EXEC:
+    return ((struct execcmd*)cmd)->argv[0] != 0;
+  case REDIR:
+    return spawnable(((struct redircmd*)cmd)->cmd);
+  case PIPE:
+    return spawnable(((struct pipecmd*)cmd)->left) &&
+           spawnable(((struct pipecmd*)cmd)->right);
+  }
+  return 0;
+}
+
+// Start the processes of spawnable cmd with spawn(), with
+// stdin, stdout and stderr taken from fds[0..2].
+// Returns the number of processes started.
+int
+spawncmd(struct cmd *cmd, int *fds)
+{
+  struct execcmd *ecmd;
+  struct redircmd *rcmd;
+  struct pipecmd *pcmd;
+  char *sh_argv[MAXARGS];
+  int p[2], nfds[3], fd, i, n;
+
+  switch(cmd->type){
+  case EXEC:
+    ecmd = (struct execcmd*)cmd;
+    if(spawn(ecmd->argv[0], ecmd->argv, fds, 3) >= 0)
+      return 1;
+    // Might be a shell script; as in runcmd.
+    for(i = 0; ecmd->argv[i] && i+2 < MAXARGS; i++)
+      sh_argv[i+1] = ecmd->argv[i];
+    if(ecmd->argv[i] == 0){
+      sh_argv[0] = "sh";
+      sh_argv[i+1] = 0;
+      if(spawn("sh", sh_argv, fds, 3) >= 0)
+        return 1;
+    }
+    printf(2, "exec %s failed\n", ecmd->argv[0]);
+    return 0;
+
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    if((fd = open(rcmd->file, rcmd->mode)) < 0){
+      printf(2, "open %s failed\n", rcmd->file);
+      return 0;
+    }
+    memmove(nfds, fds, sizeof(nfds));
+    nfds[rcmd->fd] = fd;
+    n = spawncmd(rcmd->cmd, nfds);
+    close(fd);
+    return n;
+
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    if(pipe(p) < 0)
+      panic("pipe");
+    memmove(nfds, fds, sizeof(nfds));
+    nfds[1] = p[1];
+    n = spawncmd(pcmd->left, nfds);
+    memmove(nfds, fds, sizeof(nfds));
+    nfds[0] = p[0];
+    n += spawncmd(pcmd->right, nfds);
+    close(p[0]);
+    close(p[1]);
+    return n;
+  }
+  return 0;
+}
+
 int
 fork1(void)
 {
@@ -14,6 +14,7 @@ void
 initsleeplock(struct sleeplock *lk, char *name)
 {
   initlock(&lk->lk, "sleep lock");
+  initwaitq(&lk->wq, "sleep lock");
   lk->name = name;
   lk->locked = 0;
   lk->pid = 0;
@@ -24,7 +25,7 @@ acquiresleep(struct sleeplock *lk)
 {
   acquire(&lk->lk);
   while (lk->locked) {
-    sleep(lk, &lk->lk);
+    wqsleep(&lk->wq, &lk->lk, 0);
   }
   lk->locked = 1;
   lk->pid = myproc()->pid;
@@ -37,7 +38,7 @@ releasesleep(struct sleeplock *lk)
   acquire(&lk->lk);
   lk->locked = 0;
   lk->pid = 0;
-  wakeup(lk);
+  wqwakeone(&lk->wq);
   release(&lk->lk);
 }
 
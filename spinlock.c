@@ -1,4 +1,9 @@
 // Mutual exclusion spin locks.
+//
+// Built with make LOCKSTAT=1, every lock counts, per CPU and
+// under its name, how often it was acquired, how often and how
+// long the acquirer had to wait, and how long it was held.
+// /dev/lockstat reports the counts; writing to it clears them.
 
 #include "types.h"
 #include "defs.h"
@@ -8,13 +13,51 @@
 #include "mmu.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+
+#ifdef LOCKSTAT
+struct lockstat {
+  char *name;
+  struct {
+    uint acquired;    // acquisitions
+    uint contended;   // acquisitions that had to wait
+    uint64 spins;     // times round the wait loop
+    uint64 held;      // TSC cycles held
+  } cpu[NCPU];
+};
+
+static struct lockstat lockstats[NLOCKSTAT];
+
+// The counts for locks called name. Locks are initialized
+// before there are CPUs to take a lock on, so slots are
+// claimed with compare-and-swap. Returns 0 if all are taken.
+static struct lockstat*
+lockstatfind(char *name)
+{
+  struct lockstat *s;
+
+  for(s = lockstats; s < &lockstats[NLOCKSTAT]; s++){
+    if(s->name == 0)
+      (void)__sync_val_compare_and_swap(&s->name, 0, name);
+    if(s->name == name || strncmp(s->name, name, 32) == 0)
+      return s;
+  }
+  return 0;
+}
+#endif
 
 void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
-  lk->locked = 0;
+  lk->next = 0;
+  lk->owner = 0;
   lk->cpu = 0;
+#ifdef LOCKSTAT
+  lk->stat = lockstatfind(name);
+#endif
 }
 
 // Acquire the lock.
@@ -24,13 +67,25 @@ initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
+  uint ticket;
+#ifdef LOCKSTAT
+  uint spins = 0;
+#endif
+
   pushcli(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
 
-  // The xchg is atomic.
-  while(xchg(&lk->locked, 1) != 0)
-    ;
+  // Take a ticket (the add is atomic) and wait for our turn,
+  // reading owner but not writing it, so the waiters share
+  // its cache line until the holder releases the lock.
+  ticket = __sync_fetch_and_add(&lk->next, 1);
+  while(lk->owner != ticket){
+    pause();
+#ifdef LOCKSTAT
+    spins++;
+#endif
+  }
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -39,7 +94,20 @@ acquire(struct spinlock *lk)
 
   // Record info about lock acquisition for debugging.
   lk->cpu = mycpu();
+#ifdef KDEBUG
   getcallerpcs(&lk, lk->pcs);
+#endif
+#ifdef LOCKSTAT
+  if(lk->stat){
+    ticket = cpuid();
+    lk->stat->cpu[ticket].acquired++;
+    if(spins){
+      lk->stat->cpu[ticket].contended++;
+      lk->stat->cpu[ticket].spins += spins;
+    }
+    lk->start = rdtsc();
+  }
+#endif
 }
 
 // Release the lock.
@@ -49,7 +117,13 @@ release(struct spinlock *lk)
   if(!holding(lk))
     panic("release");
 
+#ifdef LOCKSTAT
+  if(lk->stat)
+    lk->stat->cpu[cpuid()].held += rdtsc() - lk->start;
+#endif
+#ifdef KDEBUG
   lk->pcs[0] = 0;
+#endif
   lk->cpu = 0;
 
   // Tell the C compiler and the processor to not move loads or stores
@@ -59,14 +133,67 @@ release(struct spinlock *lk)
   // stores; __sync_synchronize() tells them both not to.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code can't use a C assignment, since it might
-  // not be atomic. A real OS would use C atomics here.
-  asm volatile("movl $0, %0" : "+m" (lk->locked) : );
+  // Release the lock by handing it to the next ticket. Only
+  // the holder writes owner, and an aligned 32-bit store is
+  // atomic, so this needs no locked instruction.
+  lk->owner = lk->owner + 1;
+
+  popcli();
+}
+
+// Reader-writer locks.
+
+void
+initrwlock(struct rwlock *lk, char *name)
+{
+  initlock(&lk->lock, name);
+  lk->writer = 0;
+  lk->readers = 0;
+}
 
+// Acquire lk shared. Readers announce themselves before
+// looking for a writer, and a writer before looking for
+// readers; the locked add and the fence order each pair.
+void
+racquire(struct rwlock *lk)
+{
+  pushcli();
+  for(;;){
+    __sync_fetch_and_add(&lk->readers, 1);
+    if(!lk->writer)
+      break;
+    __sync_fetch_and_sub(&lk->readers, 1);
+    while(lk->writer)
+      pause();
+  }
+}
+
+void
+rrelease(struct rwlock *lk)
+{
+  __sync_fetch_and_sub(&lk->readers, 1);
   popcli();
 }
 
+// Acquire lk exclusive.
+void
+wacquire(struct rwlock *lk)
+{
+  acquire(&lk->lock);
+  lk->writer = 1;
+  __sync_synchronize();
+  while(lk->readers)
+    pause();
+}
+
+void
+wrelease(struct rwlock *lk)
+{
+  __sync_synchronize();
+  lk->writer = 0;
+  release(&lk->lock);
+}
+
 // Record the current call stack in pcs[] by following the %ebp chain.
 void
 getcallerpcs(void *v, uint pcs[])
@@ -91,7 +218,7 @@ holding(struct spinlock *lock)
 {
   int r;
   pushcli();
-  r = lock->locked && lock->cpu == mycpu();
+  r = lock->owner != lock->next && lock->cpu == mycpu();
   popcli();
   return r;
 }
@@ -124,3 +251,101 @@ popcli(void)
     sti();
 }
 
+
+//PAGEBREAK: 30
+// /dev/lockstat.
+
+#ifdef LOCKSTAT
+static char*
+putstr(char *p, char *e, char *s, int width)
+{
+  for(; *s && p < e; width--)
+    *p++ = *s++;
+  for(; width > 0 && p < e; width--)
+    *p++ = ' ';
+  return p;
+}
+
+static char*
+putnum(char *p, char *e, uint64 n, int width)
+{
+  char buf[24];
+  int i;
+
+  i = sizeof(buf);
+  do {
+    buf[--i] = '0' + (n - div64(n, 10) * 10);
+    n = div64(n, 10);
+  } while(n);
+  for(width -= sizeof(buf) - i; width > 0 && p < e; width--)
+    *p++ = ' ';
+  for(; i < sizeof(buf) && p < e; i++)
+    *p++ = buf[i];
+  return p;
+}
+
+// One line per lock name: acquisitions, contended acquisitions,
+// wait loop spins, and microseconds held, summed over CPUs.
+static int
+lockstatread(struct inode *ip, char *dst, int n, int off)
+{
+  struct lockstat *s;
+  char *buf, *p, *e;
+  uint acquired, contended;
+  uint64 spins, held;
+  int i, len;
+
+  if((buf = kalloc()) == 0)
+    return -1;
+  p = buf;
+  e = buf + PGSIZE;
+  p = putstr(p, e, "lock", 16);
+  p = putstr(p, e, "  acquired contended      spins    held-us\n", 0);
+  for(s = lockstats; s < &lockstats[NLOCKSTAT] && s->name; s++){
+    acquired = contended = 0;
+    spins = held = 0;
+    for(i = 0; i < ncpu; i++){
+      acquired += s->cpu[i].acquired;
+      contended += s->cpu[i].contended;
+      spins += s->cpu[i].spins;
+      held += s->cpu[i].held;
+    }
+    if(acquired == 0)
+      continue;
+    p = putstr(p, e, s->name, 16);
+    p = putnum(p, e, acquired, 10);
+    p = putnum(p, e, contended, 10);
+    p = putnum(p, e, spins, 11);
+    p = putnum(p, e, tscus(held), 11);
+    p = putstr(p, e, "\n", 0);
+  }
+  len = p - buf;
+  if(off >= len)
+    n = 0;
+  else if(n > len - off)
+    n = len - off;
+  memmove(dst, buf + off, n);
+  kfree(buf);
+  return n;
+}
+
+// Writing anything clears the counts.
+static int
+lockstatwrite(struct inode *ip, char *src, int n, int off)
+{
+  struct lockstat *s;
+
+  for(s = lockstats; s < &lockstats[NLOCKSTAT] && s->name; s++)
+    memset(s->cpu, 0, sizeof(s->cpu));
+  return n;
+}
+#endif
+
+void
+lockstatinit(void)
+{
+#ifdef LOCKSTAT
+  devsw[LOCKSTATDEV].read = lockstatread;
+  devsw[LOCKSTATDEV].write = lockstatwrite;
+#endif
+}
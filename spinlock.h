@@ -1,11 +1,36 @@
-// Mutual exclusion lock.
+// Mutual exclusion lock: a ticket lock. Each acquirer takes
+// the next ticket and waits until owner reaches it, so CPUs
+// get the lock in the order they asked for it.
 struct spinlock {
-  uint locked;       // Is the lock held?
+  uint next;            // Next ticket to hand out.
+  volatile uint owner;  // Ticket that holds the lock.
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
+#ifdef KDEBUG
   uint pcs[10];      // The call stack (an array of program counters)
                      // that locked the lock.
+#endif
+#ifdef LOCKSTAT
+  struct lockstat *stat;  // Counts for locks of this name.
+  uint64 start;           // TSC when the lock was acquired.
+#endif
+};
+
+// Reader-writer spin lock: any number of readers, or one
+// writer. A writer holds lock, which keeps out other writers
+// and new readers, and waits for the readers to leave.
+// Not recursive: a CPU that reads must not read again.
+struct rwlock {
+  struct spinlock lock;   // Held by the writer.
+  volatile int writer;    // Is a writer in, or waiting?
+  volatile uint readers;  // Readers holding the lock.
+};
+
+// Processes waiting for an event (see wqsleep in proc.c).
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;  // oldest first
 };
 
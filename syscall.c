@@ -19,7 +19,9 @@ fetchint(uint addr, int *ip)
 {
   struct proc *curproc = myproc();
 
-  if(addr >= curproc->sz || addr+4 > curproc->sz)
+  if(addr >= curproc->vm->sz || addr+4 > curproc->vm->sz)
+    return -1;
+  if(vmacheck(addr, 4, 0) < 0)
     return -1;
   *ip = *(int*)(addr);
   return 0;
@@ -34,11 +36,13 @@ fetchstr(uint addr, char **pp)
   char *s, *ep;
   struct proc *curproc = myproc();
 
-  if(addr >= curproc->sz)
+  if(addr >= curproc->vm->sz)
     return -1;
   *pp = (char*)addr;
-  ep = (char*)curproc->sz;
+  ep = (char*)curproc->vm->sz;
   for(s = *pp; s < ep; s++){
+    if((s == *pp || (uint)s % PGSIZE == 0) && vmacheck((uint)s, 1, 0) < 0)
+      return -1;
     if(*s == 0)
       return s - *pp;
   }
@@ -54,16 +58,30 @@ argint(int n, int *ip)
 
 // Fetch the nth word-sized system call argument as a pointer
 // to a block of memory of size bytes.  Check that the pointer
-// lies within the process address space.
+// lies within the process address space, and fault its pages in.
 int
 argptr(int n, char **pp, int size)
 {
   int i;
-  struct proc *curproc = myproc();
- 
+
+  if(argint(n, &i) < 0)
+    return -1;
+  if(size < 0 || vmacheck(i, size, 0) < 0)
+    return -1;
+  *pp = (char*)i;
+  return 0;
+}
+
+// Like argptr, for memory the kernel will write to: if it
+// is in a mapped region, that region must be writable.
+int
+argwptr(int n, char **pp, int size)
+{
+  int i;
+
   if(argint(n, &i) < 0)
     return -1;
-  if(size < 0 || (uint)i >= curproc->sz || (uint)i+size > curproc->sz)
+  if(size < 0 || vmacheck(i, size, 1) < 0)
     return -1;
   *pp = (char*)i;
   return 0;
@@ -123,6 +141,16 @@ extern int sys_setgid(void);
 extern int sys_chown(void);
 extern int sys_chmod(void);
 extern int sys_getcwd(void);
+extern int sys_fsync(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_spawn(void);
+extern int sys_setpriority(void);
+extern int sys_usleep(void);
+extern int sys_clone(void);
+extern int sys_futex_wait(void);
+extern int sys_futex_wake(void);
+extern int sys_splice(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -166,6 +194,16 @@ static int (*syscalls[])(void) = {
 [SYS_chown]    sys_chown,
 [SYS_chmod]    sys_chmod,
 [SYS_getcwd]   sys_getcwd,
+[SYS_fsync]    sys_fsync,
+[SYS_mmap]     sys_mmap,
+[SYS_munmap]   sys_munmap,
+[SYS_spawn]    sys_spawn,
+[SYS_setpriority] sys_setpriority,
+[SYS_usleep]   sys_usleep,
+[SYS_clone]    sys_clone,
+[SYS_futex_wait] sys_futex_wait,
+[SYS_futex_wake] sys_futex_wake,
+[SYS_splice]   sys_splice,
 };
 
 void
@@ -40,3 +40,13 @@
 #define SYS_chown  39
 #define SYS_chmod  40
 #define SYS_getcwd 41
+#define SYS_fsync  42
+#define SYS_mmap   43
+#define SYS_munmap 44
+#define SYS_spawn  45
+#define SYS_setpriority 46
+#define SYS_usleep 47
+#define SYS_clone  48
+#define SYS_futex_wait 49
+#define SYS_futex_wake 50
+#define SYS_splice 51
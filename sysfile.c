@@ -49,6 +49,9 @@ checkperm(struct inode *ip, int mode)
   return -1;
 }
 
+// The file comes with a reference, which the caller must drop
+// with fileclose(): a thread sharing the table could otherwise
+// close the file while this system call is using it.
 static int
 argfd(int n, int *pfd, struct file **pf)
 {
@@ -57,28 +60,28 @@ argfd(int n, int *pfd, struct file **pf)
 
   if(argint(n, &fd) < 0)
     return -1;
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if((f = fileget(myproc()->files, fd)) == 0)
     return -1;
   if(pfd)
     *pfd = fd;
-  if(pf)
-    *pf = f;
+  *pf = f;
   return 0;
 }
 
 // Allocate a file descriptor for the given file.
 // Takes over file reference from caller on success.
+// The table may be shared with other threads, so a slot is
+// claimed with a compare-and-swap.
 static int
 fdalloc(struct file *f)
 {
   int fd;
-  struct proc *curproc = myproc();
+  struct files *fs = myproc()->files;
 
   for(fd = 0; fd < NOFILE; fd++){
-    if(curproc->ofile[fd] == 0){
-      curproc->ofile[fd] = f;
+    if(fs->ofile[fd] == 0 &&
+       __sync_bool_compare_and_swap(&fs->ofile[fd], 0, f))
       return fd;
-    }
   }
   return -1;
 }
@@ -91,9 +94,10 @@ sys_dup(void)
 
   if(argfd(0, 0, &f) < 0)
     return -1;
-  if((fd=fdalloc(f)) < 0)
+  if((fd=fdalloc(f)) < 0){
+    fileclose(f);
     return -1;
-  filedup(f);
+  }
   return fd;
 }
 
@@ -103,10 +107,13 @@ sys_read(void)
   struct file *f;
   int n;
   char *p;
+  int r;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+  if(argint(2, &n) < 0 || argwptr(1, &p, n) < 0 || argfd(0, 0, &f) < 0)
     return -1;
-  return fileread(f, p, n);
+  r = fileread(f, p, n);
+  fileclose(f);
+  return r;
 }
 
 int
@@ -115,10 +122,33 @@ sys_write(void)
   struct file *f;
   int n;
   char *p;
+  int r;
+
+  if(argint(2, &n) < 0 || argptr(1, &p, n) < 0 || argfd(0, 0, &f) < 0)
+    return -1;
+  r = filewrite(f, p, n);
+  fileclose(f);
+  return r;
+}
+
+// splice(in, out, n): move up to n bytes between a pipe
+// and another file without copying them to user space.
+int
+sys_splice(void)
+{
+  struct file *in, *out;
+  int n, r;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+  if(argint(2, &n) < 0 || n < 0 || argfd(0, 0, &in) < 0)
     return -1;
-  return filewrite(f, p, n);
+  if(argfd(1, 0, &out) < 0){
+    fileclose(in);
+    return -1;
+  }
+  r = filesplice(in, out, n);
+  fileclose(in);
+  fileclose(out);
+  return r;
 }
 
 int
@@ -129,8 +159,13 @@ sys_close(void)
 
   if(argfd(0, &fd, &f) < 0)
     return -1;
-  myproc()->ofile[fd] = 0;
-  fileclose(f);
+  // Only one of two threads closing fd at once gets to.
+  if(!__sync_bool_compare_and_swap(&myproc()->files->ofile[fd], f, 0)){
+    fileclose(f);
+    return -1;
+  }
+  fileclose(f);  // argfd's reference
+  fileclose(f);  // the table's
   return 0;
 }
 
@@ -139,10 +174,68 @@ sys_fstat(void)
 {
   struct file *f;
   struct stat *st;
+  int r;
 
-  if(argfd(0, 0, &f) < 0 || argptr(1, (void*)&st, sizeof(*st)) < 0)
+  if(argwptr(1, (void*)&st, sizeof(*st)) < 0 || argfd(0, 0, &f) < 0)
     return -1;
-  return filestat(f, st);
+  r = filestat(f, st);
+  fileclose(f);
+  return r;
+}
+
+// Map a file or anonymous memory; see mmap.c.
+// The address hint (argument 0) is ignored.
+int
+sys_mmap(void)
+{
+  struct file *f;
+  int len, prot, flags, off;
+  uint a;
+
+  if(argint(1, &len) < 0 || argint(2, &prot) < 0 ||
+     argint(3, &flags) < 0 || argint(5, &off) < 0)
+    return -1;
+  if(len <= 0 || off < 0)
+    return -1;
+  f = 0;
+  if((flags & MAP_ANONYMOUS) == 0 && argfd(4, 0, &f) < 0)
+    return -1;
+  a = mmap(f, len, prot, flags, off);
+  if(f)
+    fileclose(f);
+  if(a == 0)
+    return -1;
+  return a;
+}
+
+int
+sys_munmap(void)
+{
+  int addr, len;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0 || len <= 0)
+    return -1;
+  return munmap(addr, len);
+}
+
+// Write the file's dirty data to disk. Its metadata is
+// already durable once the system call that changed it
+// returns (see log.c).
+int
+sys_fsync(void)
+{
+  struct file *f;
+  int r;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  r = -1;
+  if(f->type == FD_INODE){
+    bflush(f->ip->dev);
+    r = 0;
+  }
+  fileclose(f);
+  return r;
 }
 
 // Create the path new as a link to the same inode as old.
@@ -259,6 +352,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcinval(dp, name);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -315,16 +409,29 @@ create(char *path, short type, short major, short minor)
     dp->nlink++;  // for ".."
     iupdate(dp);
     // No ip->nlink++ for ".": avoid cyclic ref count.
+    // These fail only when the disk is full.
     if(dirlink(ip, ".", ip->inum) < 0 || dirlink(ip, "..", dp->inum) < 0)
-      panic("create dots");
+      goto bad;
   }
 
   if(dirlink(dp, name, ip->inum) < 0)
-    panic("create: dirlink");
+    goto bad;
 
   iunlockput(dp);
 
   return ip;
+
+bad:
+  // Directory or disk is full: free the new inode.
+  if(type == T_DIR){
+    dp->nlink--;
+    iupdate(dp);
+  }
+  ip->nlink = 0;
+  iupdate(ip);
+  iunlockput(ip);
+  iunlockput(dp);
+  return 0;
 }
 
 int
@@ -448,19 +555,19 @@ sys_chdir(void)
   return 0;
 }
 
-int
-sys_exec(void)
+// Fetch the nth system call argument as an argv array
+// of at most MAXARG strings into argv.
+static int
+argargv(int n, char **argv)
 {
-  char *path, *argv[MAXARG];
   int i;
   uint uargv, uarg;
 
-  if(argstr(0, &path) < 0 || argint(1, (int*)&uargv) < 0){
+  if(argint(n, (int*)&uargv) < 0)
     return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+  memset(argv, 0, MAXARG*sizeof(argv[0]));
   for(i=0;; i++){
-    if(i >= NELEM(argv))
+    if(i >= MAXARG)
       return -1;
     if(fetchint(uargv+4*i, (int*)&uarg) < 0)
       return -1;
@@ -471,9 +578,37 @@ sys_exec(void)
     if(fetchstr(uarg, &argv[i]) < 0)
       return -1;
   }
+  return 0;
+}
+
+int
+sys_exec(void)
+{
+  char *path, *argv[MAXARG];
+
+  if(argstr(0, &path) < 0 || argargv(1, argv) < 0){
+    return -1;
+  }
   return exec(path, argv);
 }
 
+int
+sys_spawn(void)
+{
+  char *path, *argv[MAXARG];
+  int *ufds, fds[NOFILE], nfds;
+
+  if(argstr(0, &path) < 0 || argargv(1, argv) < 0)
+    return -1;
+  if(argint(3, &nfds) < 0 || nfds < 0 || nfds > NOFILE)
+    return -1;
+  if(argptr(2, (void*)&ufds, nfds*sizeof(ufds[0])) < 0)
+    return -1;
+  // Copy them: another thread may change them while spawn sleeps.
+  memmove(fds, ufds, nfds*sizeof(fds[0]));
+  return spawn(path, argv, fds, nfds);
+}
+
 int
 sys_pipe(void)
 {
@@ -481,14 +616,14 @@ sys_pipe(void)
   struct file *rf, *wf;
   int fd0, fd1;
 
-  if(argptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
+  if(argwptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
     return -1;
   if(pipealloc(&rf, &wf) < 0)
     return -1;
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
     if(fd0 >= 0)
-      myproc()->ofile[fd0] = 0;
+      myproc()->files->ofile[fd0] = 0;
     fileclose(rf);
     fileclose(wf);
     return -1;
@@ -590,23 +725,23 @@ sys_lseek(void)
   int offset;
   int whence;
   struct file *f;
+  int r;
 
-  if(argfd(0, &fd, &f) < 0 || argint(1, &offset) < 0 || argint(2, &whence) < 0)
+  if(argint(1, &offset) < 0 || argint(2, &whence) < 0 || argfd(0, &fd, &f) < 0)
     return -1;
 
-  if(f->type == FD_PIPE)
-    return -1;
-
-  if(whence == 0) // SEEK_SET
-    f->off = offset;
-  else if(whence == 1) // SEEK_CUR
-    f->off += offset;
-  else if(whence == 2) // SEEK_END
-    f->off = f->ip->size + offset;
-  else
-    return -1;
+  r = -1;
+  if(f->type != FD_PIPE){
+    if(whence == 0) // SEEK_SET
+      r = f->off = offset;
+    else if(whence == 1) // SEEK_CUR
+      r = f->off += offset;
+    else if(whence == 2) // SEEK_END
+      r = f->off = f->ip->size + offset;
+  }
 
-  return f->off;
+  fileclose(f);
+  return r;
 }
 
 int
@@ -689,7 +824,6 @@ sys_chmod(void)
 }
 
 extern struct mount mounts[NMOUNT];
-extern struct spinlock mount_lock;
 
 static int
 namebyinum(struct inode *dp, uint inum, char *name)
@@ -721,7 +855,7 @@ sys_getcwd(void)
   int pos = 512 - 1;
   int i;
 
-  if(argptr(0, &buf, 1) < 0 || argint(1, &size) < 0)
+  if(argint(1, &size) < 0 || argwptr(0, &buf, size) < 0)
     return -1;
 
   if(size < 2) return -1;
@@ -742,25 +876,25 @@ sys_getcwd(void)
     
     if(ip->dev == pip->dev && ip->inum == pip->inum){
       // We are at a root. Check if it's a mount point.
-      int found = 0;
-      acquire(&mount_lock);
+      struct inode *mnt_ip = 0;
+      rcubegin();
       for(i = 0; i < NMOUNT; i++){
         if(mounts[i].active && mounts[i].dev == ip->dev){
           // Found mount point
-          struct inode *mnt_ip = mounts[i].ip;
-          if(mnt_ip){
-             // Switch to mount point inode
-             iunlockput(pip); // Put the ".." (which is same as ip)
-             iunlockput(ip);  // Put the current root
-             ip = idup(mnt_ip); // Switch to mount point
-             found = 1;
-             break;
-          }
+          if(mounts[i].ip)
+            mnt_ip = idup(mounts[i].ip);
+          break;
         }
       }
-      release(&mount_lock);
-      
-      if(found) continue; // Continue with new ip (mount point)
+      rcuend();
+
+      if(mnt_ip){
+        // Switch to mount point inode
+        iunlockput(pip); // Put the ".." (which is same as ip)
+        iunlockput(ip);  // Put the current root
+        ip = mnt_ip;
+        continue;
+      }
       
       // Real root
       iunlockput(pip);
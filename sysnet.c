@@ -11,11 +11,30 @@
 #include "net.h"
 
 extern struct socket sockets[];
+extern struct rwlock socklock;
 extern void socket_init(void);
 extern void net_tx_udp(uint dip, ushort sport, ushort dport, struct mbuf *payload);
 extern void tcp_send(struct socket *sock, uchar flags, char *data, int len);
 extern void icmp_send(uint dip, ushort id, ushort seq, char *data, int len);
 
+#define CONNECTUS 1000000   // how long connect waits for the handshake
+#define RECVUS    10000000  // how long a UDP recv waits for data
+
+// Sleep until sock has data or a connection, usecs() passes
+// timeout from now, or the process is killed.
+static void
+sockwait(struct socket *sock, uint timeout)
+{
+  uint64 deadline;
+
+  deadline = usecs() + timeout;
+  acquire(&sock->lock);
+  while(!sock->rxq && !(sock->type == SOCK_STREAM && sock->state != TCP_SYN_SENT) &&
+        !myproc()->killed && usecs() < deadline)
+    wqsleep(&sock->wq, &sock->lock, deadline);
+  release(&sock->lock);
+}
+
 int
 sys_socket(void)
 {
@@ -29,6 +48,7 @@ sys_socket(void)
     return -1;
   
   // Find free socket
+  wacquire(&socklock);
   for(i = 0; i < 16; i++) {
     if(!sockets[i].used) {
       sockets[i].used = 1;
@@ -38,9 +58,11 @@ sys_socket(void)
       sockets[i].rxq = 0;
       sockets[i].state = TCP_CLOSED;
       sockets[i].local_ip = htonl(0x0a000215); // 10.0.2.15
+      wrelease(&socklock);
       return i;
     }
   }
+  wrelease(&socklock);
   
   return -1;
 }
@@ -71,9 +93,8 @@ sys_connect(void)
     sockets[sockfd].state = TCP_SYN_SENT;
     tcp_send(&sockets[sockfd], TCP_SYN, 0, 0);
     
-    // Wait for connection (simple busy wait - could be improved)
-    int timeout = 1000000;
-    while(sockets[sockfd].state != TCP_ESTABLISHED && timeout-- > 0);
+    // Wait for connection, up to CONNECTUS
+    sockwait(&sockets[sockfd], CONNECTUS);
     
     if(sockets[sockfd].state != TCP_ESTABLISHED)
       return -1;
@@ -90,7 +111,7 @@ sys_send(void)
   int len;
   struct mbuf *m;
   
-  if(argint(0, &sockfd) < 0 || argptr(1, &buf, sizeof(buf)) < 0 || argint(2, &len) < 0)
+  if(argint(0, &sockfd) < 0 || argint(2, &len) < 0 || argptr(1, &buf, len) < 0)
     return -1;
   
   if(sockfd < 0 || sockfd >= 16 || !sockets[sockfd].used)
@@ -138,23 +159,15 @@ sys_recv(void)
   struct mbuf *m;
   int copylen;
   
-  if(argint(0, &sockfd) < 0 || argptr(1, &buf, sizeof(buf)) < 0 || argint(2, &len) < 0)
+  if(argint(0, &sockfd) < 0 || argint(2, &len) < 0 || argwptr(1, &buf, len) < 0)
     return -1;
   
   if(sockfd < 0 || sockfd >= 16 || !sockets[sockfd].used)
     return -1;
   
-  // For UDP, wait for data to arrive (simple polling for now)
-  if(sockets[sockfd].type == SOCK_DGRAM) {
-    int timeout = 1000; // ~10 seconds
-    while(timeout-- > 0 && !sockets[sockfd].rxq) {
-      // No data yet, sleep briefly
-      // In a real implementation, we'd use sleep/wakeup
-      // For now, just yield the CPU
-      int i;
-      for(i = 0; i < 100000; i++); // Busy wait a bit
-    }
-  }
+  // For UDP, wait for data to arrive
+  if(sockets[sockfd].type == SOCK_DGRAM)
+    sockwait(&sockets[sockfd], RECVUS);
   
   m = sockets[sockfd].rxq;
   if(!m)
@@ -177,12 +190,18 @@ sys_close_socket(void)
   if(argint(0, &sockfd) < 0)
     return -1;
   
-  if(sockfd < 0 || sockfd >= 16 || !sockets[sockfd].used)
+  if(sockfd < 0 || sockfd >= 16)
     return -1;
   
+  wacquire(&socklock);
+  if(!sockets[sockfd].used){
+    wrelease(&socklock);
+    return -1;
+  }
   if(sockets[sockfd].rxq)
     mbuffree(sockets[sockfd].rxq);
-  
+  sockets[sockfd].rxq = 0;
   sockets[sockfd].used = 0;
+  wrelease(&socklock);
   return 0;
 }
@@ -45,36 +45,32 @@ sys_getpid(void)
 int
 sys_sbrk(void)
 {
-  int addr;
   int n;
 
   if(argint(0, &n) < 0)
     return -1;
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
-    return -1;
-  return addr;
+  return growproc(n);
 }
 
 int
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
-  if(argint(0, &n) < 0)
+  if(argint(0, &n) < 0 || n < 0)
     return -1;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(myproc()->killed){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  return sleepuntil(usecs() + (uint64)n * TICKUS);
+}
+
+// Sleep for n microseconds.
+int
+sys_usleep(void)
+{
+  int n;
+
+  if(argint(0, &n) < 0 || n < 0)
+    return -1;
+  return sleepuntil(usecs() + n);
 }
 
 // return how many clock tick interrupts have occurred
@@ -84,6 +80,7 @@ sys_uptime(void)
 {
   uint xticks;
 
+  tickupdate();
   acquire(&tickslock);
   xticks = ticks;
   release(&tickslock);
@@ -140,3 +137,45 @@ sys_setgid(void)
   myproc()->gid = gid;
   return 0;
 }
+
+int
+sys_setpriority(void)
+{
+  int pid, class, prio;
+
+  if(argint(0, &pid) < 0 || argint(1, &class) < 0 || argint(2, &prio) < 0)
+    return -1;
+  return setpriority(pid, class, prio);
+}
+
+// Start a thread: clone(fn, arg, stack, tls).
+int
+sys_clone(void)
+{
+  int fn, arg, stack, tls;
+
+  if(argint(0, &fn) < 0 || argint(1, &arg) < 0 ||
+     argint(2, &stack) < 0 || argint(3, &tls) < 0)
+    return -1;
+  return clone(fn, arg, stack, tls);
+}
+
+int
+sys_futex_wait(void)
+{
+  int addr, val;
+
+  if(argint(0, &addr) < 0 || argint(1, &val) < 0)
+    return -1;
+  return futexwait(addr, val);
+}
+
+int
+sys_futex_wake(void)
+{
+  int addr, n;
+
+  if(argint(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+  return futexwake(addr, n);
+}
@@ -0,0 +1,295 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+
+// Tests of mmap, copy-on-write fork, spawn, threads and
+// splice. Prints "ok" or "FAILED" for each.
+
+#define PGSIZE 4096
+#define TMPFILE "systest.tmp"
+
+int failed;
+
+void
+check(int ok, char *what)
+{
+  printf(1, "%s: %s\n", what, ok ? "ok" : "FAILED");
+  if(!ok)
+    failed = 1;
+}
+
+// Make TMPFILE one page of c.
+int
+mkfile(char c)
+{
+  char buf[PGSIZE];
+  int fd;
+
+  unlink(TMPFILE);
+  if((fd = open(TMPFILE, O_CREATE|O_RDWR)) < 0)
+    return -1;
+  memset(buf, c, sizeof(buf));
+  if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void
+test_mmap(void)
+{
+  char *p;
+  int i, ok;
+
+  p = mmap(0, 2*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED){
+    check(0, "mmap anonymous");
+    return;
+  }
+  ok = 1;
+  for(i = 0; i < 2*PGSIZE; i++)
+    if(p[i] != 0)
+      ok = 0;
+  for(i = 0; i < 2*PGSIZE; i++)
+    p[i] = i;
+  for(i = 0; i < 2*PGSIZE; i++)
+    if(p[i] != (char)i)
+      ok = 0;
+  check(ok && munmap(p, 2*PGSIZE) == 0, "mmap anonymous");
+}
+
+char cowbuf[PGSIZE];
+
+void
+test_cow(void)
+{
+  int pid, fds[2];
+  char c;
+
+  cowbuf[0] = 'a';
+  if(pipe(fds) < 0 || (pid = fork()) < 0){
+    check(0, "cow fork");
+    return;
+  }
+  if(pid == 0){
+    close(fds[0]);
+    cowbuf[0] = 'b';
+    c = cowbuf[0] == 'b' ? 'y' : 'n';
+    write(fds[1], &c, 1);
+    exit();
+  }
+  close(fds[1]);
+  c = 'n';
+  read(fds[0], &c, 1);
+  close(fds[0]);
+  wait();
+  check(c == 'y' && cowbuf[0] == 'a', "cow fork");
+}
+
+// A page of a MAP_SHARED file mapping dirtied before fork() is
+// shared with the child, which must not write its copy back
+// over the parent's later writes.
+void
+test_sharedfork(void)
+{
+  char *p, buf[4], c;
+  int fd, pid, go[2], res[2];
+
+  if((fd = mkfile('x')) < 0){
+    check(0, "fork with dirty MAP_SHARED page");
+    return;
+  }
+  p = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(p == MAP_FAILED || pipe(go) < 0 || pipe(res) < 0){
+    check(0, "fork with dirty MAP_SHARED page");
+    return;
+  }
+  p[0] = 'p';
+  if((pid = fork()) < 0){
+    check(0, "fork with dirty MAP_SHARED page");
+    return;
+  }
+  if(pid == 0){
+    read(go[0], &c, 1);
+    c = p[0] == 'p' && p[1] == 'q' ? 'y' : 'n';
+    write(res[1], &c, 1);
+    exit();
+  }
+  p[1] = 'q';
+  munmap(p, PGSIZE);
+  write(go[1], "g", 1);
+  c = 'n';
+  read(res[0], &c, 1);
+  wait();
+  close(go[0]);
+  close(go[1]);
+  close(res[0]);
+  close(res[1]);
+
+  fd = open(TMPFILE, O_RDONLY);
+  memset(buf, 0, sizeof(buf));
+  read(fd, buf, 3);
+  close(fd);
+  check(c == 'y' && strcmp(buf, "pqx") == 0, "fork with dirty MAP_SHARED page");
+}
+
+void
+test_spawn(void)
+{
+  char *argv[] = { "echo", "spawned", 0 };
+  char buf[16];
+  int fds[2], sfds[3], n, m;
+
+  memset(buf, 0, sizeof(buf));
+  if(pipe(fds) < 0){
+    check(0, "spawn");
+    return;
+  }
+  sfds[0] = 0;
+  sfds[1] = fds[1];
+  sfds[2] = 2;
+  if(spawn("/echo", argv, sfds, 3) < 0){
+    close(fds[0]);
+    close(fds[1]);
+    check(0, "spawn");
+    return;
+  }
+  close(fds[1]);
+  n = 0;
+  while(n < sizeof(buf)-1 && (m = read(fds[0], buf+n, sizeof(buf)-1-n)) > 0)
+    n += m;
+  close(fds[0]);
+  wait();
+  check(strcmp(buf, "spawned\n") == 0, "spawn");
+}
+
+volatile int tdone;
+int tval, tfd, tread;
+
+void
+setter(void *arg)
+{
+  tval = (int)arg;
+  tdone = 1;
+  futex_wake((int*)&tdone, 1);
+  exit();
+}
+
+// Read tfd while the main thread closes it.
+void
+reader(void *arg)
+{
+  char buf[8];
+
+  tread = read(tfd, buf, 5);
+  tval = read(tfd, buf, 5);  // closed by now
+  tdone = 1;
+  futex_wake((int*)&tdone, 1);
+  exit();
+}
+
+// Run fn(arg) in a thread and wait for it to set tdone.
+int
+runthread(void (*fn)(void*), void *arg, void (*during)(void))
+{
+  char *stack;
+
+  if((stack = malloc(PGSIZE)) == 0)
+    return -1;
+  tdone = 0;
+  if(clone(fn, arg, stack + PGSIZE, 0) < 0){
+    free(stack);
+    return -1;
+  }
+  if(during)
+    during();
+  while(tdone == 0)
+    futex_wait((int*)&tdone, 0);
+  wait();
+  free(stack);
+  return 0;
+}
+
+void
+test_clone(void)
+{
+  tval = 0;
+  check(runthread(setter, (void*)42, 0) == 0 && tval == 42, "clone and futex");
+}
+
+int tpipe[2];
+
+void
+closewrite(void)
+{
+  sleep(10);  // let the reader block
+  close(tfd);
+  write(tpipe[1], "hello", 5);
+}
+
+void
+test_closeread(void)
+{
+  if(pipe(tpipe) < 0){
+    check(0, "close fd being read");
+    return;
+  }
+  tfd = tpipe[0];
+  tread = tval = 0;
+  check(runthread(reader, 0, closewrite) == 0 && tread == 5 && tval == -1,
+        "close fd being read");
+  close(tpipe[1]);
+}
+
+void
+test_splice(void)
+{
+  char buf[PGSIZE];
+  int fd, fds[2], n, ok;
+
+  if((fd = mkfile('s')) < 0 || pipe(fds) < 0){
+    check(0, "splice");
+    return;
+  }
+  close(fd);
+
+  // File to pipe.
+  fd = open(TMPFILE, O_RDONLY);
+  n = splice(fd, fds[1], 100);
+  close(fd);
+  ok = n == 100 && read(fds[0], buf, sizeof(buf)) == 100 &&
+       buf[0] == 's' && buf[99] == 's';
+
+  // Pipe to file.
+  write(fds[1], "abc", 3);
+  fd = open(TMPFILE, O_RDWR);
+  ok = ok && splice(fds[0], fd, 3) == 3;
+  close(fd);
+  fd = open(TMPFILE, O_RDONLY);
+  memset(buf, 0, 5);
+  read(fd, buf, 4);
+  close(fd);
+  ok = ok && strcmp(buf, "abcs") == 0;
+
+  close(fds[0]);
+  close(fds[1]);
+  check(ok, "splice");
+}
+
+int
+main(int argc, char *argv[])
+{
+  test_mmap();
+  test_cow();
+  test_sharedfork();
+  test_spawn();
+  test_clone();
+  test_closeread();
+  test_splice();
+  unlink(TMPFILE);
+  printf(1, failed ? "systest: FAILED\n" : "systest: ok\n");
+  exit();
+}
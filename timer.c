@@ -1,20 +1,256 @@
+// Timers.
+//
+// The clock is the TSC, counted in microseconds since boot by
+// usecs(). timerinit() measures its rate, and the local APIC
+// timer's, against the PIT.
+//
+// There is no periodic tick. Each CPU programs its APIC timer,
+// one-shot, for the next thing it must do (timerarm): charge
+// its process for a tick of CPU time (see schedtick), if it is
+// running one, or wake the first process on the timer list.
+// An idle CPU with no timer due takes no timer interrupts and
+// halts in scheduler() until something else interrupts it.
+//
+// A process sleeping with a deadline (tsleep) is on the timer
+// list until it wakes. ticks, in TICKUS units, is brought up
+// to date from the clock on every timer interrupt, and whoever
+// waits for it to change sleeps on tickwq.
+
 #include "types.h"
 #include "defs.h"
+#include "param.h"
 #include "traps.h"
 #include "x86.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
 
 #define IO_TIMER1       0x40
+#define IO_TIMER2       0x42
 #define TIMER_MODE      0x43
 #define TIMER_SEL0      0x00    // select counter 0
+#define TIMER_SEL2      0x80    // select counter 2
+#define TIMER_INTTC     0x00    // mode 0, interrupt on terminal count
 #define TIMER_RATEGEN   0x04    // mode 2, rate generator
 #define TIMER_16BIT     0x30    // r/w counter 16 bits, LSB first
-#define TIMER_DIV(x)    ((1193182+(x)/2)/(x))
+#define TIMER_FREQ      1193182
+#define TIMER_DIV(x)    ((TIMER_FREQ+(x)/2)/(x))
+#define IO_PPI          0x61    // counter 2 gate and output
+#define PPI_GATE2       0x01
+#define PPI_SPEAKER     0x02
+#define PPI_OUT2        0x20
+
+#define CALIBRATEUS     10000   // how long timerinit() measures
+
+static uint64 tsc0;     // TSC at boot
+static uint tscperus;   // TSC counts per microsecond
+
+struct {
+  struct spinlock lock;
+  struct proc *head;    // sleeping with a deadline, earliest first
+} timers;
+
+// n / d. gcc would call libgcc for a 64-bit division.
+uint64
+div64(uint64 n, uint d)
+{
+  uint hi, lo, qhi, qlo, r;
+
+  hi = n >> 32;
+  lo = n;
+  qhi = hi / d;
+  r = hi % d;
+  asm("divl %4" : "=a" (qlo), "=d" (r) : "a" (lo), "d" (r), "rm" (d));
+  return ((uint64)qhi << 32) | qlo;
+}
 
 void
 timerinit(void)
 {
-  // Interrupt 100 times/sec.
+  uint latch, n;
+  uint64 t;
+
+  initlock(&timers.lock, "timers");
+
+  // Interrupt 100 times/sec, for a machine without an APIC.
   outb(TIMER_MODE, TIMER_SEL0 | TIMER_RATEGEN | TIMER_16BIT);
   outb(IO_TIMER1, TIMER_DIV(100) % 256);
   outb(IO_TIMER1, TIMER_DIV(100) / 256);
+
+  // Count the TSC and the APIC timer for CALIBRATEUS
+  // while PIT counter 2 counts down the same time.
+  latch = TIMER_FREQ / (1000000 / CALIBRATEUS);
+  outb(IO_PPI, (inb(IO_PPI) & ~PPI_SPEAKER) | PPI_GATE2);
+  outb(TIMER_MODE, TIMER_SEL2 | TIMER_INTTC | TIMER_16BIT);
+  outb(IO_TIMER2, latch % 256);
+  outb(IO_TIMER2, latch / 256);
+  if(lapic)
+    lapictimerstart();
+  t = rdtsc();
+  while((inb(IO_PPI) & PPI_OUT2) == 0)
+    ;
+  t = rdtsc() - t;
+  n = lapic ? lapictimerstop() : 0;
+
+  tscperus = div64(t, CALIBRATEUS);
+  if(tscperus == 0)
+    tscperus = 1;
+  lapicperus = n / CALIBRATEUS;
+  if(lapicperus == 0)
+    lapicperus = 1;
+  cprintf("timer: tsc %d MHz, apic timer %d MHz\n", tscperus, lapicperus);
+
+  tsc0 = rdtsc();
+  lapicarm(TICKUS);
+}
+
+// Microseconds since timerinit().
+uint64
+usecs(void)
+{
+  return div64(rdtsc() - tsc0, tscperus);
+}
+
+// Convert a count of TSC cycles to microseconds.
+uint64
+tscus(uint64 t)
+{
+  return div64(t, tscperus);
+}
+
+// Bring ticks up to date.
+void
+tickupdate(void)
+{
+  uint t;
+
+  t = div64(usecs(), TICKUS);
+  if(t == ticks)
+    return;
+  acquire(&tickslock);
+  if((int)(t - ticks) > 0){
+    ticks = t;
+    wqwakeup(&tickwq);
+  }
+  release(&tickslock);
+}
+
+// Program this CPU's timer for the next thing it must do:
+// the first deadline on the timer list, or charging its
+// process for a tick. Interrupts must be off.
+void
+timerarm(void)
+{
+  struct cpu *c = mycpu();
+  uint64 next, now;
+
+  next = 0;
+  acquire(&timers.lock);
+  if(timers.head)
+    next = timers.head->deadline;
+  release(&timers.lock);
+  if(c->proc && (next == 0 || c->nexttick < next))
+    next = c->nexttick;
+  if(next == 0){
+    lapicarm(0);
+    return;
+  }
+  now = usecs();
+  if(next <= now)
+    lapicarm(1);
+  else if(next - now > 0xFFFFFFFF)
+    lapicarm(0xFFFFFFFF);
+  else
+    lapicarm(next - now);
+}
+
+// Put p on the timer list, to wake it at p->deadline.
+// Interrupts must be off.
+void
+timeradd(struct proc *p)
+{
+  struct proc **pp;
+
+  acquire(&timers.lock);
+  for(pp = &timers.head; *pp && (*pp)->deadline <= p->deadline;
+      pp = &(*pp)->tnext)
+    ;
+  p->tnext = *pp;
+  *pp = p;
+  release(&timers.lock);
+  if(timers.head == p)
+    timerarm();
+}
+
+// Take p off the timer list, if it is still there.
+void
+timerdel(struct proc *p)
+{
+  struct proc **pp;
+
+  acquire(&timers.lock);
+  for(pp = &timers.head; *pp; pp = &(*pp)->tnext){
+    if(*pp == p){
+      *pp = p->tnext;
+      p->tnext = 0;
+      break;
+    }
+  }
+  release(&timers.lock);
+}
+
+// Timer interrupt, on any CPU.
+void
+timerintr(void)
+{
+  struct cpu *c = mycpu();
+  struct proc *p, *expired[NPROC];
+  uint64 now;
+  int i, n;
+
+  tickupdate();
+  now = usecs();
+
+  // Wake the processes whose deadlines have passed. wakeproc()
+  // takes locks that come before timers.lock; the pin keeps
+  // each in wqsleep() until it is done.
+  n = 0;
+  acquire(&timers.lock);
+  while((p = timers.head) != 0 && p->deadline <= now){
+    timers.head = p->tnext;
+    p->tnext = 0;
+    pinproc(p);
+    expired[n++] = p;
+  }
+  release(&timers.lock);
+  for(i = 0; i < n; i++){
+    wakeproc(expired[i]);
+    unpinproc(expired[i]);
+  }
+
+  if(c->proc && c->nexttick <= now){
+    c->nexttick = now + TICKUS;
+    schedtick();
+  }
+  timerarm();
+}
+
+// Sleep until usecs() reaches deadline.
+// Returns 0, or -1 if the process is killed first.
+int
+sleepuntil(uint64 deadline)
+{
+  struct proc *p = myproc();
+
+  acquire(&tickslock);
+  while(usecs() < deadline){
+    if(p->killed){
+      release(&tickslock);
+      return -1;
+    }
+    // Only the timer wakes this channel.
+    tsleep(&p->deadline, &tickslock, deadline);
+  }
+  release(&tickslock);
+  return 0;
 }
@@ -12,6 +12,7 @@
 struct gatedesc idt[256];
 extern uint vectors[];  // in vectors.S: array of 256 entry pointers
 struct spinlock tickslock;
+struct waitq tickwq;    // woken when ticks changes
 uint ticks;
 
 void
@@ -24,6 +25,7 @@ tvinit(void)
   SETGATE(idt[T_SYSCALL], 1, SEG_KCODE<<3, vectors[T_SYSCALL], DPL_USER);
 
   initlock(&tickslock, "time");
+  initwaitq(&tickwq, "ticks");
 }
 
 void
@@ -36,6 +38,8 @@ idtinit(void)
 void
 trap(struct trapframe *tf)
 {
+  uint va;
+
   if(tf->trapno == T_SYSCALL){
     if(myproc()->killed)
       exit();
@@ -43,19 +47,31 @@ trap(struct trapframe *tf)
     syscall();
     if(myproc()->killed)
       exit();
+    // A process it woke may be more urgent.
+    preempt();
     return;
   }
 
+  // Interrupts are on outside read sections (see rcu.c), so
+  // an interrupt finds this CPU in none.
+  if(tf->trapno >= T_IRQ0)
+    rcuquiesce();
+
   switch(tf->trapno){
   case T_IRQ0 + IRQ_TIMER:
-    if(cpuid() == 0){
-      acquire(&tickslock);
-      ticks++;
-      wakeup(&ticks);
-      release(&tickslock);
-    }
+    timerintr();
     if(lapic) lapiceoi(); else piceoi();
     break;
+  case T_IRQ0 + IRQ_RESCHED:
+    // Another CPU queued a process for us (see makerunnable).
+    lapiceoi();
+    break;
+  case T_IRQ0 + IRQ_TLB:
+    // Another CPU changed the page table we run on (see vmflush).
+    lcr3(rcr3());
+    mycpu()->tlbflush = 0;
+    lapiceoi();
+    break;
   case T_IRQ0 + IRQ_IDE:
     ideintr();
     if(lapic) lapiceoi(); else piceoi();
@@ -88,6 +104,23 @@ trap(struct trapframe *tf)
     if(lapic) lapiceoi(); else piceoi();
     break;
 
+  case T_PGFLT:
+    // A page of a mapped region not touched yet (see mmap.c).
+    if(myproc() && (tf->cs&3) == DPL_USER &&
+       vmfault(rcr2(), tf->err & FEC_WR) == 0)
+      break;
+    // A system call touching user memory that another thread
+    // unmapped, or made copy-on-write, after vmacheck(). The
+    // kernel holds no spin lock while it does, so may sleep.
+    if(myproc() && (tf->cs&3) == 0 && rcr2() < KERNBASE &&
+       mycpu()->ncli == 0){
+      va = rcr2();
+      if(vmfault(va, tf->err & FEC_WR) < 0)
+        vmkill(va);
+      break;
+    }
+    // fall through
+
   //PAGEBREAK: 13
   default:
     if(myproc() == 0 || (tf->cs&3) == 0){
@@ -110,11 +143,11 @@ trap(struct trapframe *tf)
   if(myproc() && myproc()->killed && (tf->cs&3) == DPL_USER)
     exit();
 
-  // Force process to give up CPU on clock tick.
+  // Force process to give up CPU when its time slice is used up
+  // or a more urgent one has woken (see schedtick, makerunnable).
   // If interrupts were on while locks held, would need to check nlock.
-  if(myproc() && myproc()->state == RUNNING &&
-     tf->trapno == T_IRQ0+IRQ_TIMER)
-    yield();
+  if(myproc() && myproc()->state == RUNNING)
+    preempt();
 
   // Check if the process has been killed since we yielded
   if(myproc() && myproc()->killed && (tf->cs&3) == DPL_USER)
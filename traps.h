@@ -34,6 +34,8 @@
 #define IRQ_COM1         4
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_RESCHED     20      // IPI: look at the run queue again
+#define IRQ_TLB         21      // IPI: flush the TLB (see vmflush)
 #define IRQ_SPURIOUS    31
 #define IRQ_MOUSE       12
 
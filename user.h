@@ -43,6 +43,16 @@ int setgid(int);
 int chown(const char*, int, int);
 int chmod(const char*, int);
 int getcwd(char*, int);
+int fsync(int);
+void* mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int spawn(char*, char**, int*, int);
+int setpriority(int, int, int);
+int usleep(int);
+int clone(void(*)(void*), void*, void*, void*);
+int futex_wait(int*, int);
+int futex_wake(int*, int);
+int splice(int, int, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -6,6 +6,7 @@
 #include "mmu.h"
 #include "proc.h"
 #include "elf.h"
+#include "traps.h"
 
 extern char data[];  // defined by kernel.ld
 pde_t *kpgdir;  // for use in scheduler()
@@ -32,13 +33,15 @@ seginit(void)
 // Return the address of the PTE in page table pgdir
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page table pages.
-static pte_t *
+pte_t *
 walkpgdir(pde_t *pgdir, const void *va, int alloc)
 {
   pde_t *pde;
   pte_t *pgtab;
 
   pde = &pgdir[PDX(va)];
+  if(*pde & PTE_PS)
+    return 0;  // a kernel superpage has no page table
   if(*pde & PTE_P){
     pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
   } else {
@@ -57,7 +60,7 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
 // be page-aligned.
-static int
+int
 mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 {
   char *a, *last;
@@ -85,6 +88,13 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 // page protection bits prevent user code from using the kernel's
 // mappings.
 //
+// kvmalloc() builds the kernel's mappings once, in kpgdir, with
+// 4-Mbyte superpages wherever a whole aligned 4 Mbytes has the
+// same permissions, and marks them global so that switching
+// page tables does not flush them from the TLB. setupkvm() just
+// copies kpgdir's directory entries for the kernel half, so all
+// page tables share the kernel's few page table pages.
+//
 // setupkvm() and exec() set up every page table like this:
 //
 //   0..KERNBASE: user memory (text+data+stack+heap), mapped to
@@ -114,33 +124,63 @@ static struct kmap {
  { (void*)DEVSPACE, DEVSPACE,      0,         PTE_W}, // more devices
 };
 
+// Map size bytes of the kernel at va to physical addresses
+// starting at pa, with superpages where va and pa are both
+// aligned to one and size covers it.
+static int
+kmappages(pde_t *pgdir, char *va, uint size, uint pa, int perm)
+{
+  uint n;
+
+  while(size > 0){
+    if((uint)va % SUPERPGSIZE == 0 && pa % SUPERPGSIZE == 0 &&
+       size >= SUPERPGSIZE){
+      if(pgdir[PDX(va)] & PTE_P)
+        panic("remap");
+      pgdir[PDX(va)] = pa | perm | PTE_P | PTE_PS | PTE_G;
+      n = SUPERPGSIZE;
+    } else {
+      if(mappages(pgdir, va, PGSIZE, pa, perm | PTE_G) < 0)
+        return -1;
+      n = PGSIZE;
+    }
+    va += n;
+    pa += n;
+    size -= n;
+  }
+  return 0;
+}
+
 // Set up kernel part of a page table.
 pde_t*
 setupkvm(void)
 {
   pde_t *pgdir;
-  struct kmap *k;
 
   if((pgdir = (pde_t*)kalloc()) == 0)
     return 0;
   memset(pgdir, 0, PGSIZE);
-  if (P2V(PHYSTOP) > (void*)DEVSPACE)
-    panic("PHYSTOP too high");
-  for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
-    if(mappages(pgdir, k->virt, k->phys_end - k->phys_start,
-                (uint)k->phys_start, k->perm) < 0) {
-      freevm(pgdir);
-      return 0;
-    }
+  memmove(&pgdir[PDX(KERNBASE)], &kpgdir[PDX(KERNBASE)],
+          (NPDENTRIES - PDX(KERNBASE)) * sizeof(pde_t));
   return pgdir;
 }
 
-// Allocate one page table for the machine for the kernel address
-// space for scheduler processes.
+// Build kpgdir, the kernel's mappings, which every page table
+// shares, and use it for scheduler processes.
 void
 kvmalloc(void)
 {
-  kpgdir = setupkvm();
+  struct kmap *k;
+
+  if((kpgdir = (pde_t*)kalloc()) == 0)
+    panic("kvmalloc");
+  memset(kpgdir, 0, PGSIZE);
+  if (P2V(PHYSTOP) > (void*)DEVSPACE)
+    panic("PHYSTOP too high");
+  for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
+    if(kmappages(kpgdir, k->virt, k->phys_end - k->phys_start,
+                 (uint)k->phys_start, k->perm) < 0)
+      panic("kvmalloc");
   switchkvm();
 }
 
@@ -173,10 +213,46 @@ switchuvm(struct proc *p)
   // forbids I/O instructions (e.g., inb and outb) from user space
   mycpu()->ts.iomb = (ushort) 0xFFFF;
   ltr(SEG_TSS << 3);
+  // %fs is reloaded from here on the way back to user space.
+  mycpu()->gdt[SEG_UTLS] = SEG(STA_W, p->tls, 0xffffffff, DPL_USER);
   lcr3(V2P(p->pgdir));  // switch to process's address space
   popcli();
 }
 
+// Flush stale TLB entries of vm, after its pages were unmapped
+// or made read-only, on this CPU and on every other CPU running
+// one of its threads, and wait until they have. The caller must
+// not hold spinlocks: the other CPUs may need them first.
+void
+vmflush(struct vmspace *vm)
+{
+  struct cpu *c, *me;
+  struct proc *p;
+  int kicked[NCPU];
+
+  // Order the PTE changes before reading c->proc: a CPU that
+  // starts running a thread of vm after this loads %cr3 anew.
+  __sync_synchronize();
+  pushcli();
+  me = mycpu();
+  if(me->proc && me->proc->vm == vm)
+    lcr3(V2P(vm->pgdir));
+  for(c = cpus; c < &cpus[ncpu]; c++){
+    kicked[c - cpus] = 0;
+    p = c->proc;
+    if(c == me || p == 0 || p->vm != vm)
+      continue;
+    c->tlbflush = 1;
+    kicked[c - cpus] = 1;
+    lapicipi(c->apicid, T_IRQ0 + IRQ_TLB);
+  }
+  popcli();
+  for(c = cpus; c < &cpus[ncpu]; c++)
+    if(kicked[c - cpus])
+      while(c->tlbflush)
+        ;
+}
+
 // Load the initcode into address 0 of pgdir.
 // sz must be less than a page.
 void
@@ -192,30 +268,6 @@ inituvm(pde_t *pgdir, char *init, uint sz)
   memmove(mem, init, sz);
 }
 
-// Load a program segment into pgdir.  addr must be page-aligned
-// and the pages from addr to addr+sz must already be mapped.
-int
-loaduvm(pde_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
-{
-  uint i, pa, n;
-  pte_t *pte;
-
-  if((uint) addr % PGSIZE != 0)
-    panic("loaduvm: addr must be page aligned");
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, addr+i, 0)) == 0)
-      panic("loaduvm: address should exist");
-    pa = PTE_ADDR(*pte);
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, P2V(pa), offset+i, n) != n)
-      return -1;
-  }
-  return 0;
-}
-
 // Allocate page tables and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
 int
@@ -279,7 +331,7 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 }
 
 // Free a page table and all the physical memory pages
-// in the user part.
+// in the user part. The kernel part belongs to kpgdir.
 void
 freevm(pde_t *pgdir)
 {
@@ -288,7 +340,7 @@ freevm(pde_t *pgdir)
   if(pgdir == 0)
     panic("freevm: no pgdir");
   deallocuvm(pgdir, KERNBASE, 0);
-  for(i = 0; i < NPDENTRIES; i++){
+  for(i = 0; i < PDX(KERNBASE); i++){
     if(pgdir[i] & PTE_P){
       char * v = P2V(PTE_ADDR(pgdir[i]));
       kfree(v);
@@ -310,38 +362,79 @@ clearpteu(pde_t *pgdir, char *uva)
   *pte &= ~PTE_U;
 }
 
+// Map the present user pages of src in [start, end) into dst
+// as well. If cow is set, they are shared copy-on-write:
+// writable pages become read-only PTE_COW pages in both, and
+// the first write to one copies it (see cowfault); the caller
+// must then flush src's TLB. Otherwise both may write them.
+// dst's mappings start out clean (no PTE_D): the writes so far
+// were src's.
+// Returns 0 on success, -1 if out of memory.
+int
+uvmshare(pde_t *dst, pde_t *src, uint start, uint end, int cow)
+{
+  pte_t *pte;
+  uint pa, i;
+
+  for(i = start; i < end; i += PGSIZE){
+    if((pte = walkpgdir(src, (void *) i, 0)) == 0 || !(*pte & PTE_P))
+      continue;
+    if(cow && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+    pa = PTE_ADDR(*pte);
+    if(mappages(dst, (void*)i, PGSIZE, pa, PTE_FLAGS(*pte) & ~PTE_D) < 0)
+      return -1;
+    kref(P2V(pa));
+  }
+  return 0;
+}
+
+// Give the page at va in pgdir, the current page table, a
+// PTE_COW page, a copy of its own that it can write, unless
+// no one else shares it.
+// Returns 0 on success, -1 if va is not such a page or
+// memory is short.
+int
+cowfault(pde_t *pgdir, uint va)
+{
+  pte_t *pte;
+  char *old, *mem;
+
+  if(va >= KERNBASE)
+    return -1;
+  pte = walkpgdir(pgdir, (void*)va, 0);
+  if(pte == 0 || (*pte & (PTE_P|PTE_U|PTE_COW)) != (PTE_P|PTE_U|PTE_COW))
+    return -1;
+  old = P2V(PTE_ADDR(*pte));
+  if(krefs(old) == 1){
+    *pte = (*pte & ~PTE_COW) | PTE_W;
+  } else {
+    if((mem = kalloc()) == 0)
+      return -1;
+    memmove(mem, old, PGSIZE);
+    *pte = V2P(mem) | (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+    kfree(old);
+  }
+  lcr3(V2P(pgdir));  // flush the stale read-only entry
+  return 0;
+}
+
 // Given a parent process's page table, create a copy
-// of it for a child.
+// of it for a child, sharing the pages copy-on-write.
+// Pages of the program image not faulted in yet stay
+// that way.
 pde_t*
 copyuvm(pde_t *pgdir, uint sz)
 {
   pde_t *d;
-  pte_t *pte;
-  uint pa, i, flags;
-  char *mem;
 
   if((d = setupkvm()) == 0)
     return 0;
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      panic("copyuvm: pte should exist");
-    if(!(*pte & PTE_P))
-      panic("copyuvm: page not present");
-    pa = PTE_ADDR(*pte);
-    flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto bad;
-    memmove(mem, (char*)P2V(pa), PGSIZE);
-    if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0) {
-      kfree(mem);
-      goto bad;
-    }
+  if(uvmshare(d, pgdir, 0, sz, 1) < 0){
+    freevm(d);
+    return 0;
   }
   return d;
-
-bad:
-  freevm(d);
-  return 0;
 }
 
 //PAGEBREAK!
@@ -352,7 +445,7 @@ uva2ka(pde_t *pgdir, char *uva)
   pte_t *pte;
 
   pte = walkpgdir(pgdir, uva, 0);
-  if((*pte & PTE_P) == 0)
+  if(pte == 0 || (*pte & PTE_P) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
@@ -141,6 +141,29 @@ sti(void)
   asm volatile("sti");
 }
 
+// Enable interrupts and wait for one. sti takes effect only
+// after the next instruction, so none can slip in before hlt.
+static inline void
+stihlt(void)
+{
+  asm volatile("sti; hlt");
+}
+
+// Tell the processor this is a spin-wait loop.
+static inline void
+pause(void)
+{
+  asm volatile("pause");
+}
+
+static inline uint64
+rdtsc(void)
+{
+  uint64 t;
+  asm volatile("rdtsc" : "=A" (t));
+  return t;
+}
+
 static inline uint
 xchg(volatile uint *addr, uint newval)
 {
@@ -168,6 +191,14 @@ lcr3(uint val)
   asm volatile("movl %0,%%cr3" : : "r" (val));
 }
 
+static inline uint
+rcr3(void)
+{
+  uint val;
+  asm volatile("movl %%cr3,%0" : "=r" (val));
+  return val;
+}
+
 //PAGEBREAK: 36
 // Layout of the trap frame built on the stack by the
 // hardware and by trapasm.S, and passed to trap().
@@ -19,12 +19,17 @@ typedef unsigned char  uchar;
 
 // xv6 fs.h constants and structs (renamed to avoid conflicts)
 #define XV6_ROOTINO 1
-#define XV6_BSIZE 512
-#define XV6_NDIRECT 11
-#define XV6_NINDIRECT (XV6_BSIZE / sizeof(uint))
-#define XV6_MAXFILE (XV6_NDIRECT + XV6_NINDIRECT + XV6_NINDIRECT * XV6_NINDIRECT)
+#define XV6_BSIZE 4096
+#define XV6_FSMAGIC 0x36767866
+#define XV6_FSVERSION 3
+#define XV6_NEXTENT 11
+#define XV6_NIEXTENT (XV6_BSIZE / sizeof(struct xv6_extent))
+#define XV6_MAXFILE (1 << 18)
 #define XV6_IPB (XV6_BSIZE / sizeof(struct xv6_dinode))
-#define XV6_DIRSIZ 14
+#define XV6_DIRSIZ 60
+#define XV6_DPB (XV6_BSIZE / sizeof(struct xv6_dirent))
+#define XV6_DXMAGIC 0x78647864
+#define XV6_NDXENTRY ((XV6_BSIZE - 2*sizeof(uint)) / sizeof(struct xv6_dxentry))
 
 struct xv6_superblock {
   uint size;         // Size of file system image (blocks)
@@ -34,6 +39,13 @@ struct xv6_superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint magic;        // XV6_FSMAGIC
+  uint version;      // XV6_FSVERSION
+};
+
+struct xv6_extent {
+  uint start;
+  uint len;
 };
 
 struct xv6_dinode {
@@ -42,14 +54,31 @@ struct xv6_dinode {
   short minor;          // Minor device number (T_DEV only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[XV6_NDIRECT+2];   // Data block addresses
+  uint uid;             // Owner ID
+  uint gid;             // Group ID
+  uint mode;            // Protection/Permissions
+  struct xv6_extent ext[XV6_NEXTENT+1];  // Data extents, then indirect extent block
+  uint index;           // Hash index block (T_DIR only), or 0
+  uint spare;           // Reserved, zero
 };
 
 struct xv6_dirent {
-  ushort inum;
+  uint inum;
   char name[XV6_DIRSIZ];
 };
 
+// Hash index of a large directory; see fs.h.
+struct xv6_dxentry {
+  uint hash;   // lowest hash in this block
+  uint block;  // block number within the directory
+};
+
+struct xv6_dxroot {
+  uint magic;
+  uint count;
+  struct xv6_dxentry e[XV6_NDXENTRY];
+};
+
 // xv6 file types
 #define XV6_T_DIR  1
 #define XV6_T_FILE 2
@@ -94,6 +123,19 @@ uint balloc() {
     return 0;
 }
 
+// Allocate block b if it is free; returns b or 0
+uint balloc_at(uint b) {
+    if (b >= sb->size) return 0;
+    uchar *bp = (uchar*)get_block(sb->bmapstart + b/BPB);
+    int bi = b % BPB;
+    int m = 1 << (bi % 8);
+    if (bp[bi/8] & m)
+        return 0;
+    bp[bi/8] |= m;
+    xv6_bzero(b);
+    return b;
+}
+
 // Free a block
 void bfree(uint b) {
     uchar *bp = (uchar*)get_block(sb->bmapstart + b/BPB);
@@ -124,52 +166,36 @@ uint get_inum(struct xv6_dinode *ip) {
     return diff / sizeof(struct xv6_dinode);
 }
 
+// Free the blocks of an extent
+void efree(struct xv6_extent *e) {
+    for (uint b = e->start; b < e->start + e->len; b++)
+        bfree(b);
+    e->start = 0;
+    e->len = 0;
+}
+
 // Truncate inode (discard contents)
 void itrunc(struct xv6_dinode *ip) {
-    int i, j;
-    uint *a;
-    void *bp;
-
-    for(i = 0; i < XV6_NDIRECT; i++){
-        if(ip->addrs[i]){
-            bfree(ip->addrs[i]);
-            ip->addrs[i] = 0;
+    int i;
+    struct xv6_extent *x;
+
+    for(i = 0; i < XV6_NEXTENT; i++)
+        efree(&ip->ext[i]);
+
+    if(ip->ext[XV6_NEXTENT].start){
+        x = (struct xv6_extent*)get_block(ip->ext[XV6_NEXTENT].start);
+        if (x) {
+            for(i = 0; i < ip->ext[XV6_NEXTENT].len; i++)
+                efree(&x[i]);
         }
+        bfree(ip->ext[XV6_NEXTENT].start);
+        ip->ext[XV6_NEXTENT].start = 0;
+        ip->ext[XV6_NEXTENT].len = 0;
     }
 
-    if(ip->addrs[XV6_NDIRECT]){
-        bp = get_block(ip->addrs[XV6_NDIRECT]);
-        if (bp) {
-            a = (uint*)bp;
-            for(j = 0; j < XV6_NINDIRECT; j++){
-                if(a[j])
-                    bfree(a[j]);
-            }
-        }
-        bfree(ip->addrs[XV6_NDIRECT]);
-        ip->addrs[XV6_NDIRECT] = 0;
-    }
-
-    if(ip->addrs[XV6_NDIRECT+1]){
-        bp = get_block(ip->addrs[XV6_NDIRECT+1]);
-        if (bp) {
-            a = (uint*)bp;
-            for(j = 0; j < XV6_NINDIRECT; j++){
-                if(a[j]){
-                    void *bp2 = get_block(a[j]);
-                    if (bp2) {
-                        uint *a2 = (uint*)bp2;
-                        for(int k = 0; k < XV6_NINDIRECT; k++){
-                            if(a2[k])
-                                bfree(a2[k]);
-                        }
-                    }
-                    bfree(a[j]);
-                }
-            }
-        }
-        bfree(ip->addrs[XV6_NDIRECT+1]);
-        ip->addrs[XV6_NDIRECT+1] = 0;
+    if(ip->index){
+        bfree(ip->index);
+        ip->index = 0;
     }
 
     ip->size = 0;
@@ -185,63 +211,80 @@ uint ialloc(short type) {
         if(dip->type == 0){  // a free inode
             memset(dip, 0, sizeof(*dip));
             dip->type = type;
+            dip->mode = (type == XV6_T_DIR) ? 0755 : 0644;
             return inum;
         }
     }
     return 0;
 }
 
-// Helper to map logical block number to physical block number
-uint bmap(struct xv6_dinode *ip, uint bn, int alloc) {
-    uint addr, *a;
-    
-    if(bn < XV6_NDIRECT){
-        if((addr = ip->addrs[bn]) == 0) {
-            if (!alloc) return 0;
-            ip->addrs[bn] = addr = balloc();
-        }
-        return addr;
-    }
-    bn -= XV6_NDIRECT;
+// Append one block to the file, growing the last extent if the
+// block after it is free. Returns the new block or 0.
+static uint bappend(struct xv6_dinode *ip) {
+    struct xv6_extent *e = NULL, *x;
+    uint addr;
+    int i, n;
 
-    if(bn < XV6_NINDIRECT){
-        if((addr = ip->addrs[XV6_NDIRECT]) == 0) {
-            if (!alloc) return 0;
-            ip->addrs[XV6_NDIRECT] = addr = balloc();
+    for(i = 0; i < XV6_NEXTENT && ip->ext[i].len > 0; i++)
+        e = &ip->ext[i];
+
+    if(ip->ext[XV6_NEXTENT].start == 0){
+        if(e && (addr = balloc_at(e->start + e->len)) != 0){
+            e->len++;
+            return addr;
         }
-        a = (uint*)get_block(addr);
-        if (!a) return 0;
-        if((addr = a[bn]) == 0){
-            if (!alloc) return 0;
-            a[bn] = addr = balloc();
+        if(i < XV6_NEXTENT){
+            if((addr = balloc()) == 0) return 0;
+            ip->ext[i].start = addr;
+            ip->ext[i].len = 1;
+            return addr;
         }
+        if((ip->ext[XV6_NEXTENT].start = balloc()) == 0) return 0;
+    }
+
+    x = (struct xv6_extent*)get_block(ip->ext[XV6_NEXTENT].start);
+    if (!x) return 0;
+    n = ip->ext[XV6_NEXTENT].len;
+    if(n > 0 && (addr = balloc_at(x[n-1].start + x[n-1].len)) != 0){
+        x[n-1].len++;
         return addr;
     }
-    bn -= XV6_NINDIRECT;
+    if(n >= XV6_NIEXTENT || (addr = balloc()) == 0) return 0;
+    x[n].start = addr;
+    x[n].len = 1;
+    ip->ext[XV6_NEXTENT].len++;
+    return addr;
+}
 
-    if(bn < XV6_NINDIRECT * XV6_NINDIRECT){
-        if((addr = ip->addrs[XV6_NDIRECT+1]) == 0) {
-            if (!alloc) return 0;
-            ip->addrs[XV6_NDIRECT+1] = addr = balloc();
-        }
-        a = (uint*)get_block(addr);
-        if (!a) return 0;
-        addr = a[bn / XV6_NINDIRECT];
-        if (addr == 0) {
-            if (!alloc) return 0;
-            a[bn / XV6_NINDIRECT] = addr = balloc();
-            addr = a[bn / XV6_NINDIRECT];
-        }
-        a = (uint*)get_block(addr);
-        if (!a) return 0;
-        if((addr = a[bn % XV6_NINDIRECT]) == 0){
-            if (!alloc) return 0;
-            a[bn % XV6_NINDIRECT] = addr = balloc();
+// Helper to map logical block number to physical block number.
+// Extents map a file's blocks in order, so blocks can only be
+// added at the end; with alloc, any gap up to bn is filled.
+uint bmap(struct xv6_dinode *ip, uint bn, int alloc) {
+    struct xv6_extent *x;
+    uint addr = 0;
+    int i;
+
+    for(i = 0; i < XV6_NEXTENT && ip->ext[i].len > 0; i++){
+        if(bn < ip->ext[i].len)
+            return ip->ext[i].start + bn;
+        bn -= ip->ext[i].len;
+    }
+    if(ip->ext[XV6_NEXTENT].start){
+        x = (struct xv6_extent*)get_block(ip->ext[XV6_NEXTENT].start);
+        if (!x) return 0;
+        for(i = 0; i < ip->ext[XV6_NEXTENT].len; i++){
+            if(bn < x[i].len)
+                return x[i].start + bn;
+            bn -= x[i].len;
         }
-        return addr;
     }
 
-    return 0;
+    if (!alloc) return 0;
+    // bn is now the number of blocks past the end.
+    for(i = 0; i <= bn; i++)
+        if((addr = bappend(ip)) == 0)
+            return 0;
+    return addr;
 }
 
 // Helper to resolve path to inode
@@ -315,11 +358,98 @@ struct xv6_dinode *nameiparent(const char *path, char *name) {
     return ip;
 }
 
+// Hashed directories, laid out as in the kernel's fs.c:
+// names go in the directory block their hash selects, and
+// a full block is split at its median hash.
+
+static uint dxhash(const char *name) {
+    uint h = 2166136261U;
+    for (int i = 0; i < XV6_DIRSIZ && name[i]; i++) {
+        h ^= (uchar)name[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static int dxfind(struct xv6_dxroot *r, uint h) {
+    int lo = 0, hi = r->count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (r->e[mid].hash <= h)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+static int dxcmp(const void *a, const void *b) {
+    uint x = *(const uint*)a, y = *(const uint*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Move the upper half of full index entry i's names to a new block.
+static int dxsplit(struct xv6_dinode *dp, struct xv6_dxroot *r, int i) {
+    uint hs[XV6_DPB], mid, blk, nblk, bno;
+    int j, k, n = 0;
+
+    if (r->count >= XV6_NDXENTRY) return -1;
+    blk = r->e[i].block;
+    nblk = dp->size / XV6_BSIZE;
+    struct xv6_dirent *de = get_block(bmap(dp, blk, 0));
+    for (j = (blk == 0 ? 2 : 0); j < XV6_DPB; j++)
+        if (de[j].inum != 0)
+            hs[n++] = dxhash(de[j].name);
+    qsort(hs, n, sizeof(hs[0]), dxcmp);
+    for (k = n/2; k < n && hs[k] == hs[0]; k++)
+        ;
+    if (k == n) return -1;
+    mid = hs[k];
+
+    if ((bno = bmap(dp, nblk, 1)) == 0) return -1;
+    dp->size += XV6_BSIZE;
+    struct xv6_dirent *nde = get_block(bno);
+    for (j = (blk == 0 ? 2 : 0), k = 0; j < XV6_DPB; j++) {
+        if (de[j].inum == 0 || dxhash(de[j].name) < mid) continue;
+        nde[k++] = de[j];
+        memset(&de[j], 0, sizeof(de[j]));
+    }
+
+    memmove(&r->e[i+2], &r->e[i+1], (r->count - i - 1) * sizeof(r->e[0]));
+    r->e[i+1].hash = mid;
+    r->e[i+1].block = nblk;
+    r->count++;
+    return 0;
+}
+
+static int dxadd(struct xv6_dinode *dp, char *name, uint inum) {
+    struct xv6_dxroot *r = get_block(dp->index);
+    uint h = dxhash(name);
+
+    if (r == NULL || r->magic != XV6_DXMAGIC) return -1;
+    for (int tries = 0; tries < 2; tries++) {
+        int i = dxfind(r, h);
+        struct xv6_dirent *de = get_block(bmap(dp, r->e[i].block, 0));
+        for (int j = 0; j < XV6_DPB; j++) {
+            if (de[j].inum == 0) {
+                memset(&de[j], 0, sizeof(de[j]));
+                strncpy(de[j].name, name, XV6_DIRSIZ);
+                de[j].inum = inum;
+                return 0;
+            }
+        }
+        if (dxsplit(dp, r, i) < 0) break;
+    }
+    return -1;
+}
+
 // Add entry to directory
 int dirlink(struct xv6_dinode *dp, char *name, uint inum) {
     int off;
     struct xv6_dirent de;
-    
+
+    if (dp->index) return dxadd(dp, name, inum);
+
     // Look for empty dirent
     for(off = 0; off < dp->size; off += sizeof(de)){
         uint bno = bmap(dp, off / XV6_BSIZE, 0);
@@ -331,6 +461,16 @@ int dirlink(struct xv6_dinode *dp, char *name, uint inum) {
         }
     }
 
+    // A full first block gets a hash index, as in the kernel.
+    if (off == XV6_BSIZE && dp->size == XV6_BSIZE) {
+        struct xv6_dxroot *r;
+        if ((dp->index = balloc()) == 0) return -1;
+        r = get_block(dp->index);
+        r->magic = XV6_DXMAGIC;
+        r->count = 1;
+        return dxadd(dp, name, inum);
+    }
+
     memset(&de, 0, sizeof(de));
     strncpy(de.name, name, XV6_DIRSIZ);
     de.inum = inum;
@@ -618,6 +758,10 @@ int main(int argc, char *argv[]) {
     }
     
     sb = (struct xv6_superblock *)((char*)disk_image + XV6_BSIZE); // Superblock is at block 1
+    if (sb->magic != XV6_FSMAGIC || sb->version != XV6_FSVERSION) {
+        fprintf(stderr, "%s: not an xv6 file system of version %d\n", argv[1], XV6_FSVERSION);
+        return 1;
+    }
 
     printf("Superblock: size=%d nblocks=%d ninodes=%d\n", sb->size, sb->nblocks, sb->ninodes);
 